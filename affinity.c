@@ -0,0 +1,469 @@
+#include "./affinity.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SYSFS_CPU "/sys/devices/system/cpu"
+#define SYSFS_NODE "/sys/devices/system/node"
+#define MAX_NODES 64
+
+/* where a CPU sits in the topology */
+struct cpu_info {
+    int cpu;
+    int node;     // index into nodes, not the kernel's node id
+    int package;  // physical_package_id
+    int core;     // core_id, unique within the package
+    int thread;   // rank among the core's hyperthreads (0 for the first)
+    int slot;     // rank among CPUs of the same node and thread rank
+};
+typedef struct cpu_info cpu_info_t;
+
+/* a job placed by affinity_place(), for counting load */
+struct placement {
+    int jid;
+    int cpu;   // index into cpus, -1 if the job got a whole node
+    int node;  // index into nodes
+};
+typedef struct placement placement_t;
+
+static int topology_read;
+static cpu_info_t cpus[CPU_SETSIZE];
+static int cpu_num;
+static int node_ids[MAX_NODES];  // the kernel's id of each node
+static cpu_set_t node_sets[MAX_NODES];
+static int node_num;
+
+// CPUs in the order each policy hands them out
+static int compact_order[CPU_SETSIZE];
+static int spread_order[CPU_SETSIZE];
+
+static affinity_policy_t current_policy = AFFINITY_NONE;
+
+static placement_t *placements;
+static int placement_num;
+static int placement_cap;
+
+static const char *policy_names[] = {"none", "compact", "spread",
+                                     "numa-spread"};
+
+/*
+ * reads the first line of path into buf, without the newline
+ * returns 0 on success, -1 on failure
+ */
+static int read_line(const char *path, char *buf, size_t size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t got = read(fd, buf, size - 1);
+    close(fd);
+    if (got <= 0) {
+        return -1;
+    }
+    buf[got] = '\0';
+    buf[strcspn(buf, "\n")] = '\0';
+    return 0;
+}
+
+/* reads an integer from path, returns fallback if it can't be read */
+static int read_int(const char *path, int fallback) {
+    char buf[32];
+    if (read_line(path, buf, sizeof(buf)) < 0) {
+        return fallback;
+    }
+    return atoi(buf);
+}
+
+/*
+ * parses a CPU list (e.g. "0-3,8,10-11") into set
+ * returns 0 on success, -1 on failure
+ */
+static int parse_cpulist(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    const char *p = list;
+    while (*p != '\0') {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p) {
+            return -1;
+        }
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p) {
+                return -1;
+            }
+        }
+        if (first < 0 || last >= CPU_SETSIZE || first > last) {
+            return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET((size_t)cpu, set);
+        }
+        if (*end != ',' && *end != '\0') {
+            return -1;
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
+    return 0;
+}
+
+/* qsort comparator: node, package, core, thread (siblings adjacent) */
+static int compare_compact(const void *a, const void *b) {
+    const cpu_info_t *x = &cpus[*(const int *)a];
+    const cpu_info_t *y = &cpus[*(const int *)b];
+    if (x->node != y->node) {
+        return x->node - y->node;
+    }
+    if (x->package != y->package) {
+        return x->package - y->package;
+    }
+    if (x->core != y->core) {
+        return x->core - y->core;
+    }
+    return x->thread - y->thread;
+}
+
+/* qsort comparator: thread, slot, node (round robin over nodes' cores) */
+static int compare_spread(const void *a, const void *b) {
+    const cpu_info_t *x = &cpus[*(const int *)a];
+    const cpu_info_t *y = &cpus[*(const int *)b];
+    if (x->thread != y->thread) {
+        return x->thread - y->thread;
+    }
+    if (x->slot != y->slot) {
+        return x->slot - y->slot;
+    }
+    return x->node - y->node;
+}
+
+/* reads /sys/devices/system/node into node_ids and node_sets */
+static void read_nodes(const cpu_set_t *allowed) {
+    node_num = 0;
+    DIR *dir = opendir(SYSFS_NODE);
+    if (dir != NULL) {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL && node_num < MAX_NODES) {
+            char *end;
+            if (strncmp(entry->d_name, "node", 4) != 0) {
+                continue;
+            }
+            long id = strtol(&entry->d_name[4], &end, 10);
+            if (end == &entry->d_name[4] || *end != '\0') {
+                continue;
+            }
+
+            char path[300];
+            char list[4096];
+            cpu_set_t set;
+            snprintf(path, sizeof(path), SYSFS_NODE "/%s/cpulist",
+                     entry->d_name);
+            if (read_line(path, list, sizeof(list)) < 0 ||
+                parse_cpulist(list, &set) < 0) {
+                continue;
+            }
+            CPU_AND(&set, &set, allowed);
+            // memory-only nodes have no CPUs to place jobs on
+            if (CPU_COUNT(&set) == 0) {
+                continue;
+            }
+
+            // keep nodes sorted by id
+            int i = node_num;
+            while (i > 0 && node_ids[i - 1] > id) {
+                node_ids[i] = node_ids[i - 1];
+                node_sets[i] = node_sets[i - 1];
+                i--;
+            }
+            node_ids[i] = (int)id;
+            node_sets[i] = set;
+            node_num++;
+        }
+        closedir(dir);
+    }
+
+    // without NUMA support, all CPUs are on one node
+    if (node_num == 0) {
+        node_ids[0] = 0;
+        node_sets[0] = *allowed;
+        node_num = 1;
+    }
+}
+
+/*
+ * reads the CPU and NUMA topology, if it hasn't been read yet
+ * returns 0 on success, -1 on failure
+ */
+int affinity_init(void) {
+    if (topology_read) {
+        return 0;
+    }
+
+    // only place jobs on CPUs that are online and that the shell may use
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        perror("affinity: sched_getaffinity");
+        return -1;
+    }
+    char list[4096];
+    cpu_set_t online;
+    if (read_line(SYSFS_CPU "/online", list, sizeof(list)) == 0 &&
+        parse_cpulist(list, &online) == 0) {
+        CPU_AND(&allowed, &allowed, &online);
+    }
+    if (CPU_COUNT(&allowed) == 0) {
+        fprintf(stderr, "affinity: no usable CPUs\n");
+        return -1;
+    }
+
+    read_nodes(&allowed);
+
+    cpu_num = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET((size_t)cpu, &allowed)) {
+            continue;
+        }
+        cpu_info_t *info = &cpus[cpu_num];
+        char path[128];
+        info->cpu = cpu;
+        info->node = 0;
+        for (int n = 0; n < node_num; n++) {
+            if (CPU_ISSET((size_t)cpu, &node_sets[n])) {
+                info->node = n;
+                break;
+            }
+        }
+        snprintf(path, sizeof(path),
+                 SYSFS_CPU "/cpu%d/topology/physical_package_id", cpu);
+        info->package = read_int(path, 0);
+        snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/topology/core_id",
+                 cpu);
+        info->core = read_int(path, cpu);
+        // earlier CPUs on the same core are this one's siblings
+        info->thread = 0;
+        for (int i = 0; i < cpu_num; i++) {
+            if (cpus[i].package == info->package &&
+                cpus[i].core == info->core) {
+                info->thread++;
+            }
+        }
+        compact_order[cpu_num] = cpu_num;
+        spread_order[cpu_num] = cpu_num;
+        cpu_num++;
+    }
+
+    qsort(compact_order, (size_t)cpu_num, sizeof(int), compare_compact);
+    // slot: rank in compact order among CPUs of the same node and thread
+    for (int i = 0; i < cpu_num; i++) {
+        cpu_info_t *info = &cpus[compact_order[i]];
+        info->slot = 0;
+        for (int j = 0; j < i; j++) {
+            cpu_info_t *other = &cpus[compact_order[j]];
+            if (other->node == info->node && other->thread == info->thread) {
+                info->slot++;
+            }
+        }
+    }
+    qsort(spread_order, (size_t)cpu_num, sizeof(int), compare_spread);
+
+    topology_read = 1;
+    return 0;
+}
+
+/*
+ * parses a policy name ("none", "compact", "spread" or "numa-spread")
+ * returns 0 on success, -1 if name is not a policy
+ */
+int affinity_parse_policy(const char *name, affinity_policy_t *policy) {
+    for (int i = AFFINITY_NONE; i <= AFFINITY_NUMA_SPREAD; i++) {
+        if (strcmp(name, policy_names[i]) == 0) {
+            *policy = (affinity_policy_t)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* returns the name of policy */
+const char *affinity_policy_name(affinity_policy_t policy) {
+    return policy_names[policy];
+}
+
+/*
+ * sets the placement policy, reading the topology first if needed
+ * returns 0 on success, -1 on failure
+ */
+int affinity_set_policy(affinity_policy_t policy) {
+    if (policy != AFFINITY_NONE && affinity_init() < 0) {
+        return -1;
+    }
+    current_policy = policy;
+    return 0;
+}
+
+/* gets the placement policy */
+affinity_policy_t affinity_get_policy(void) { return current_policy; }
+
+/* forgets placements of jobs that have left the job list */
+static void prune_placements(job_list_t *job_list) {
+    int kept = 0;
+    for (int i = 0; i < placement_num; i++) {
+        if (get_job_pid(job_list, placements[i].jid) >= 0) {
+            placements[kept++] = placements[i];
+        }
+    }
+    placement_num = kept;
+}
+
+/* returns the first CPU in order with the fewest placed jobs on it */
+static int least_loaded_cpu(const int *order) {
+    static int load[CPU_SETSIZE];
+    memset(load, 0, sizeof(int) * (size_t)cpu_num);
+    for (int i = 0; i < placement_num; i++) {
+        if (placements[i].cpu >= 0) {
+            load[placements[i].cpu]++;
+        }
+    }
+
+    int best = order[0];
+    for (int i = 1; i < cpu_num; i++) {
+        if (load[order[i]] < load[best]) {
+            best = order[i];
+        }
+    }
+    return best;
+}
+
+/* returns the lowest numbered node with the fewest placed jobs on it */
+static int least_loaded_node(void) {
+    int load[MAX_NODES] = {0};
+    for (int i = 0; i < placement_num; i++) {
+        load[placements[i].node]++;
+    }
+
+    int best = 0;
+    for (int n = 1; n < node_num; n++) {
+        if (load[n] < load[best]) {
+            best = n;
+        }
+    }
+    return best;
+}
+
+/*
+ * picks the CPUs job jid should run on under the current policy and records
+ * the placement
+ * returns 0 if set was filled in, -1 if the job should not be pinned
+ */
+int affinity_place(job_list_t *job_list, int jid, cpu_set_t *set) {
+    if (current_policy == AFFINITY_NONE || !topology_read) {
+        return -1;
+    }
+
+    prune_placements(job_list);
+    // a restarted job keeps its jid; its old placement is replaced, not
+    // counted as a second job
+    for (int i = 0; i < placement_num; i++) {
+        if (placements[i].jid == jid) {
+            placements[i] = placements[--placement_num];
+            break;
+        }
+    }
+    if (placement_num == placement_cap) {
+        int cap = placement_cap > 0 ? 2 * placement_cap : 16;
+        placement_t *grown = (placement_t *)realloc(
+            placements, sizeof(placement_t) * (size_t)cap);
+        if (grown == NULL) {
+            perror("affinity: realloc");
+            return -1;
+        }
+        placements = grown;
+        placement_cap = cap;
+    }
+    placement_t *placed = &placements[placement_num];
+    placed->jid = jid;
+
+    if (current_policy == AFFINITY_NUMA_SPREAD) {
+        placed->cpu = -1;
+        placed->node = least_loaded_node();
+        *set = node_sets[placed->node];
+    } else {
+        placed->cpu = least_loaded_cpu(current_policy == AFFINITY_COMPACT
+                                           ? compact_order
+                                           : spread_order);
+        placed->node = cpus[placed->cpu].node;
+        CPU_ZERO(set);
+        CPU_SET((size_t)cpus[placed->cpu].cpu, set);
+    }
+    placement_num++;
+    return 0;
+}
+
+/*
+ * writes set as a CPU list (e.g. "0-3,8") into buf
+ * returns 0 on success, -1 if buf is too small
+ */
+int affinity_format(const cpu_set_t *set, char *buf, size_t size) {
+    size_t len = 0;
+    buf[0] = '\0';
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET((size_t)cpu, set)) {
+            continue;
+        }
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET((size_t)(last + 1), set)) {
+            last++;
+        }
+        int written =
+            last == cpu
+                ? snprintf(&buf[len], size - len, "%s%d", len ? "," : "", cpu)
+                : snprintf(&buf[len], size - len, "%s%d-%d", len ? "," : "",
+                           cpu, last);
+        if (written < 0 || (size_t)written >= size - len) {
+            return -1;
+        }
+        len += (size_t)written;
+        cpu = last;
+    }
+    return 0;
+}
+
+/*
+ * prints the policy, the topology and the number of placed jobs on each node
+ * returns 0 on success, -1 on failure
+ */
+int affinity_print(job_list_t *job_list) {
+    if (printf("policy %s\n", affinity_policy_name(current_policy)) < 0) {
+        return -1;
+    }
+    if (affinity_init() < 0) {
+        return -1;
+    }
+
+    prune_placements(job_list);
+    for (int n = 0; n < node_num; n++) {
+        char list[4096];
+        int jobs_on_node = 0;
+        for (int i = 0; i < placement_num; i++) {
+            jobs_on_node += placements[i].node == n;
+        }
+        affinity_format(&node_sets[n], list, sizeof(list));
+        if (printf("node%d cpus %s jobs %d\n", node_ids[n], list,
+                   jobs_on_node) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* frees the placement records */
+void affinity_cleanup(void) {
+    free(placements);
+    placements = NULL;
+    placement_num = 0;
+    placement_cap = 0;
+}
@@ -0,0 +1,76 @@
+#ifndef AFFINITY_H_
+#define AFFINITY_H_
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE  // cpu_set_t
+#endif
+#include <sched.h>
+#include <stddef.h>
+#include "./jobs.h"
+
+/*
+ * CPU placement of background jobs. The CPU and NUMA topology is read from
+ * /sys/devices/system once, limited to the CPUs the shell may run on. Each
+ * job placed is given a cpuset by the current policy:
+ *   compact      one CPU per job, filling a node's cores (and their
+ *                hyperthreads) before moving to the next node
+ *   spread       one CPU per job, alternating nodes and using every physical
+ *                core before any hyperthread sibling
+ *   numa-spread  all the CPUs of one node per job, on the node running the
+ *                fewest placed jobs, so memory stays local (first touch) and
+ *                jobs share out the nodes' memory bandwidth
+ * Jobs placed earlier count towards a CPU's (or node's) load until they leave
+ * the job list.
+ */
+typedef enum {
+    AFFINITY_NONE,  // jobs inherit the shell's affinity
+    AFFINITY_COMPACT,
+    AFFINITY_SPREAD,
+    AFFINITY_NUMA_SPREAD
+} affinity_policy_t;
+
+/*
+ * reads the CPU and NUMA topology, if it hasn't been read yet
+ * returns 0 on success, -1 on failure
+ */
+int affinity_init(void);
+
+/*
+ * parses a policy name ("none", "compact", "spread" or "numa-spread")
+ * returns 0 on success, -1 if name is not a policy
+ */
+int affinity_parse_policy(const char *name, affinity_policy_t *policy);
+/* returns the name of policy */
+const char *affinity_policy_name(affinity_policy_t policy);
+
+/*
+ * sets the placement policy, reading the topology first if needed
+ * returns 0 on success, -1 on failure
+ */
+int affinity_set_policy(affinity_policy_t policy);
+/* gets the placement policy */
+affinity_policy_t affinity_get_policy(void);
+
+/*
+ * picks the CPUs job jid should run on under the current policy and records
+ * the placement
+ * returns 0 if set was filled in, -1 if the job should not be pinned
+ */
+int affinity_place(job_list_t *job_list, int jid, cpu_set_t *set);
+
+/*
+ * writes set as a CPU list (e.g. "0-3,8") into buf
+ * returns 0 on success, -1 if buf is too small
+ */
+int affinity_format(const cpu_set_t *set, char *buf, size_t size);
+
+/*
+ * prints the policy, the topology and the number of placed jobs on each node
+ * returns 0 on success, -1 on failure
+ */
+int affinity_print(job_list_t *job_list);
+
+/* frees the placement records */
+void affinity_cleanup(void);
+
+#endif  // AFFINITY_H_
@@ -0,0 +1,165 @@
+/*
+ * affinity_bench: memory-bound parallel jobs under each placement policy
+ *
+ * For each policy in affinity.h (none, compact, spread, numa-spread), places
+ * JOBS jobs with affinity_place() the way the shell places background jobs,
+ * then forks them at once. Each job pins itself to its cpuset as exec_child()
+ * does, allocates and first-touches its own arrays (so their pages land on
+ * the job's node) and runs a STREAM-style triad, a[i] = b[i] + s * c[i], over
+ * them. The result is the aggregate memory bandwidth from fork to the last
+ * job exiting.
+ *
+ * With "none" the kernel places the jobs and migrates them freely, which is
+ * what psh did before affinity. spread and numa-spread should beat it on
+ * multi-socket machines, where they split the jobs across the memory
+ * controllers and keep every access local; compact shows the cost of
+ * crowding one node. On a single-node machine all four should be about
+ * equal.
+ *
+ * Results are printed as one JSON object per line.
+ *
+ * Usage: affinity_bench [-j JOBS] [-m MIB_PER_JOB] [-p PASSES]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "../affinity.h"
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* runs the triad over elements doubles per array, passes times */
+static void triad_job(size_t elements, long passes) {
+    double *a = (double *)malloc(sizeof(double) * elements);
+    double *b = (double *)malloc(sizeof(double) * elements);
+    double *c = (double *)malloc(sizeof(double) * elements);
+    if (a == NULL || b == NULL || c == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    // first touch, after pinning, decides which node the pages are on
+    for (size_t i = 0; i < elements; i++) {
+        a[i] = 0.0;
+        b[i] = 1.0;
+        c[i] = 2.0;
+    }
+
+    double scalar = 3.0;
+    for (long pass = 0; pass < passes; pass++) {
+        for (size_t i = 0; i < elements; i++) {
+            a[i] = b[i] + scalar * c[i];
+        }
+        scalar = a[pass % (long)elements] / 8.0;  // depend on the last pass
+    }
+    // exit status keeps the compiler from discarding the loop
+    exit(a[elements / 2] < 0.0);
+}
+
+/* runs one policy, returns aggregate GB/s or a negative value on failure */
+static double bench_policy(affinity_policy_t policy, int jobs, size_t elements,
+                           long passes) {
+    if (affinity_set_policy(policy) < 0) {
+        return -1.0;
+    }
+
+    // place every job first, as if they were all queued with & at once
+    job_list_t *job_list = init_job_list();
+    cpu_set_t *sets = (cpu_set_t *)malloc(sizeof(cpu_set_t) * (size_t)jobs);
+    int *placed = (int *)malloc(sizeof(int) * (size_t)jobs);
+    for (int k = 0; k < jobs; k++) {
+        add_job(job_list, k + 1, 0, RUNNING, "triad");
+        placed[k] = affinity_place(job_list, k + 1, &sets[k]) == 0;
+    }
+
+    double start = now();
+    for (int k = 0; k < jobs; k++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            exit(1);
+        }
+        if (pid == 0) {
+            if (placed[k] &&
+                sched_setaffinity(0, sizeof(cpu_set_t), &sets[k]) < 0) {
+                perror("sched_setaffinity");
+            }
+            triad_job(elements, passes);
+        }
+    }
+    int failed = 0;
+    int status;
+    while (wait(&status) > 0) {
+        failed |= !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    }
+    double seconds = now() - start;
+
+    // the placeholder jobs have pid 0, so cleanup sends no signals
+    cleanup_job_list(job_list);
+    affinity_cleanup();
+    free(sets);
+    free(placed);
+
+    if (failed) {
+        return -1.0;
+    }
+    // each element moves three doubles: two loads and a store
+    double bytes = 3.0 * sizeof(double) * (double)elements * (double)passes *
+                   (double)jobs;
+    return bytes / seconds / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    int jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    long mib = 64;
+    long passes = 10;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "j:m:p:")) != -1) {
+        switch (opt) {
+            case 'j':
+                jobs = atoi(optarg);
+                break;
+            case 'm':
+                mib = atol(optarg);
+                break;
+            case 'p':
+                passes = atol(optarg);
+                break;
+            default:
+                fprintf(stderr,
+                        "usage: %s [-j JOBS] [-m MIB_PER_JOB] [-p PASSES]\n",
+                        argv[0]);
+                return 2;
+        }
+    }
+    if (jobs < 1 || mib < 1 || passes < 1) {
+        fprintf(stderr, "%s: arguments must be positive\n", argv[0]);
+        return 2;
+    }
+
+    // the three arrays together take mib MiB
+    size_t elements = (size_t)mib * 1024 * 1024 / (3 * sizeof(double));
+    affinity_policy_t policies[] = {AFFINITY_NONE, AFFINITY_COMPACT,
+                                    AFFINITY_SPREAD, AFFINITY_NUMA_SPREAD};
+    // warm up, so the first policy doesn't pay for cold page allocation
+    bench_policy(AFFINITY_NONE, jobs, elements, 1);
+    for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+        double gbps = bench_policy(policies[i], jobs, elements, passes);
+        if (gbps < 0.0) {
+            fprintf(stderr, "%s: %s failed\n", argv[0],
+                    affinity_policy_name(policies[i]));
+            return 1;
+        }
+        printf("{\"bench\":\"affinity\",\"policy\":\"%s\",\"jobs\":%d,"
+               "\"mib_per_job\":%ld,\"passes\":%ld,\"gb_per_s\":%.2f}\n",
+               affinity_policy_name(policies[i]), jobs, mib, passes, gbps);
+        fflush(stdout);
+    }
+    return 0;
+}
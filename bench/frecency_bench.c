@@ -0,0 +1,236 @@
+/*
+ * frecency_bench: visits and lookups in the cd -j frecency database
+ *
+ * Fills a fresh database with ENTRIES directories spread over a deep tree,
+ * timing the visits, then times LOOKUPS lookups for a piece of a random
+ * directory's last component (every fourth with a parent term before it) and
+ * checks that each finds a directory that matches. The mean, p50, p99 and max
+ * lookup times are reported, and "p99_under_1ms" says whether the p99 meets
+ * the target of well under a millisecond. Lookups never age the database
+ * (it has room for every entry), so the slowest are the ones whose best
+ * match comes late in the table, after many entries whose signatures match
+ * but whose paths don't; a single max can also be the scheduler.
+ *
+ * Then checks the ranking (a directory visited more often wins, a forgotten
+ * one is skipped) and that aging keeps a small database at a fixed size
+ * while a steady stream of new directories goes through it, without losing a
+ * directory in regular use.
+ *
+ * Results are printed as one JSON object per line.
+ *
+ * Usage: frecency_bench [-n ENTRIES] [-q LOOKUPS]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "../frecency.h"
+
+static const char *words[] = {
+    "api",     "build",  "client", "core",    "docs",   "engine", "front",
+    "gateway", "infra",  "kernel", "lib",     "mobile", "net",    "ops",
+    "parser",  "query",  "render", "service", "store",  "tools",  "ui",
+    "vendor",  "worker", "xform",  "yaml",    "zone"};
+#define WORD_NUM (sizeof(words) / sizeof(words[0]))
+
+static unsigned long long rng_state = 88172645463325252ULL;
+
+/* xorshift64*, so runs are reproducible */
+static unsigned long rng(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (unsigned long)((rng_state * 2685821657736338717ULL) >> 32);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* the i'th directory of the tree, /src/mono/WORD/WORD/WORDN */
+static void tree_dir(long i, char *dir, size_t size) {
+    unsigned long a = (unsigned long)i % WORD_NUM;
+    unsigned long b = (unsigned long)i / WORD_NUM % WORD_NUM;
+    unsigned long c = (unsigned long)i / (WORD_NUM * WORD_NUM) % WORD_NUM;
+    snprintf(dir, size, "/src/mono/%s/%s/%s%ld", words[a], words[b],
+             words[c], i);
+}
+
+static int open_fresh(const char *path, uint32_t capacity) {
+    unlink(path);
+    if (frecency_open(path, capacity) < 0) {
+        fprintf(stderr, "can't open %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * times lookups for pieces of random entries, filling times with each
+ * lookup's time in microseconds, sorted; returns -1 on a bad result
+ */
+static int bench_lookups(long entries, long lookups, double *times) {
+    char dir[256];
+    char found[256];
+    for (long q = 0; q < lookups; q++) {
+        tree_dir((long)(rng() % (unsigned long)entries), dir, sizeof(dir));
+        char *last = strrchr(dir, '/') + 1;
+        size_t len = strlen(last);
+        size_t start = rng() % (len - 2);
+        size_t piece_len = 3 + rng() % (len - start - 2);
+        char piece[64];
+        snprintf(piece, sizeof(piece), "%.*s", (int)piece_len, &last[start]);
+        char parent[64];
+        snprintf(parent, sizeof(parent), "%.*s", 3, &dir[strlen("/src/mono/")]);
+        char *terms[] = {parent, piece};
+        int two = q % 4 == 0;
+
+        double t = now();
+        int failed = frecency_query(two ? terms : &terms[1], two ? 2 : 1, NULL,
+                                    found, sizeof(found));
+        t = now() - t;
+        if (failed || strstr(strrchr(found, '/'), piece) == NULL ||
+            (two && strstr(found, parent) == NULL)) {
+            fprintf(stderr, "lookup %s %s found %s\n", two ? parent : "",
+                    piece, failed ? "nothing" : found);
+            return -1;
+        }
+        times[q] = t * 1e6;
+    }
+    qsort(times, (size_t)lookups, sizeof(double), compare_double);
+    return 0;
+}
+
+/* checks that visits rank directories and forgetting hides them */
+static int check_ranking(const char *path) {
+    char found[256];
+    char *term[] = {"ranked"};
+    if (open_fresh(path, 1024) < 0) {
+        return -1;
+    }
+    frecency_visit("/a/ranked");
+    for (int i = 0; i < 3; i++) {
+        frecency_visit("/b/ranked");
+    }
+    frecency_visit("/c/ranked/not");
+    int ok = frecency_query(term, 1, NULL, found, sizeof(found)) == 0 &&
+             strcmp(found, "/b/ranked") == 0 &&
+             frecency_query(term, 1, "/b/ranked", found, sizeof(found)) == 0 &&
+             strcmp(found, "/a/ranked") == 0;
+    frecency_forget("/b/ranked");
+    ok = ok && frecency_query(term, 1, NULL, found, sizeof(found)) == 0 &&
+         strcmp(found, "/a/ranked") == 0;
+    frecency_close();
+    return ok ? 0 : -1;
+}
+
+/*
+ * streams visits to new directories through a small database, visiting one
+ * directory regularly; returns -1 if it grows or loses that directory
+ */
+static int check_aging(const char *path, uint32_t capacity, long visits) {
+    char dir[256];
+    char found[256];
+    char *term[] = {"regular"};
+    struct stat before;
+    struct stat after;
+    if (open_fresh(path, capacity) < 0 || stat(path, &before) < 0) {
+        return -1;
+    }
+    for (long i = 0; i < visits; i++) {
+        tree_dir(i, dir, sizeof(dir));
+        frecency_visit(dir);
+        if (i % 16 == 0) {
+            frecency_visit("/home/user/regular");
+        }
+    }
+    int ok = stat(path, &after) == 0 && after.st_size == before.st_size &&
+             frecency_query(term, 1, NULL, found, sizeof(found)) == 0;
+    frecency_close();
+    return ok ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+    long entries = 300000;
+    long lookups = 2000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:q:")) != -1) {
+        switch (opt) {
+            case 'n':
+                entries = atol(optarg);
+                break;
+            case 'q':
+                lookups = atol(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-n ENTRIES] [-q LOOKUPS]\n",
+                        argv[0]);
+                return 2;
+        }
+    }
+    if (entries < 1 || lookups < 1) {
+        fprintf(stderr, "%s: arguments must be positive\n", argv[0]);
+        return 2;
+    }
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/frecency_bench.%d", (int)getpid());
+    // room for every entry without aging: ranks may add up to half of it
+    if (open_fresh(path, (uint32_t)entries * 2 + 2) < 0) {
+        return 1;
+    }
+    char dir[256];
+    double t = now();
+    for (long i = 0; i < entries; i++) {
+        tree_dir(i, dir, sizeof(dir));
+        frecency_visit(dir);
+    }
+    double visit_rate = (double)entries / (now() - t);
+
+    double *times = (double *)malloc(sizeof(double) * (size_t)lookups);
+    int status = 1;
+    if (times == NULL) {
+        perror("malloc");
+    } else if (bench_lookups(entries, lookups, times) < 0) {
+        fprintf(stderr, "%s: lookups found the wrong directory\n", argv[0]);
+    } else {
+        double total = 0.0;
+        for (long q = 0; q < lookups; q++) {
+            total += times[q];
+        }
+        double p99 = times[(size_t)((double)(lookups - 1) * 0.99)];
+        printf("{\"bench\":\"frecency\",\"entries\":%ld,\"visits_per_s\":%.0f,"
+               "\"lookups\":%ld,\"lookup_mean_us\":%.1f,"
+               "\"lookup_p50_us\":%.1f,\"lookup_p99_us\":%.1f,"
+               "\"lookup_max_us\":%.1f,\"p99_under_1ms\":%s}\n",
+               entries, visit_rate, lookups, total / (double)lookups,
+               times[(lookups - 1) / 2], p99, times[lookups - 1],
+               p99 < 1000.0 ? "true" : "false");
+        status = 0;
+    }
+    free(times);
+    frecency_close();
+
+    if (status == 0 && check_ranking(path) < 0) {
+        fprintf(stderr, "%s: directories ranked wrongly\n", argv[0]);
+        status = 1;
+    }
+    if (status == 0 && check_aging(path, 4096, 100000) < 0) {
+        fprintf(stderr, "%s: aging grew the file or lost a directory\n",
+                argv[0]);
+        status = 1;
+    }
+    unlink(path);
+    return status;
+}
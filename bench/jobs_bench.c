@@ -0,0 +1,210 @@
+/*
+ * jobs_bench: microbenchmarks for the job list API in jobs.h
+ *
+ * For each list size (10, 100, ... up to -n), fills a list with that many
+ * jobs and times each operation against it: add_job, remove_job_jid,
+ * remove_job_pid, update_job_jid, update_job_pid, get_job_pid, get_job_jid,
+ * get_job_hidden, and a full get_next_pid() pass (reported per element).
+ * Lookups use random keys that are present in the list. Removals put the job
+ * back (untimed) so the size stays the same.
+ *
+ * Filling the list is itself timed. If the next size would take longer than
+ * the time budget (-t, default 120s) to fill, assuming the worst case of
+ * quadratic growth, it and every larger size are reported as skipped, with
+ * "measured":false and the projected fill time, rather than run. With
+ * jobs.c, whose add_job() walks to the tail, 100k entries take about a
+ * minute to fill and 1M is projected at about two hours, so 1M is not
+ * measured by default; pass a larger -t to run it.
+ *
+ * Results are printed as one JSON object per line.
+ *
+ * PIDs start above the kernel's PID_MAX_LIMIT, and lists are emptied before
+ * cleanup_job_list(), so no signal is ever sent to a real process.
+ *
+ * Usage: jobs_bench [-n MAX_SIZE] [-o OPERATIONS] [-t BUDGET_SECONDS]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "../jobs.h"
+
+#define PID_BASE (1 << 23)  // above PID_MAX_LIMIT
+
+static unsigned long long rng_state = 88172645463325252ULL;
+
+/* xorshift64*, so runs are reproducible */
+static unsigned long rng(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (unsigned long)((rng_state * 2685821657736338717ULL) >> 32);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* keeps the compiler from discarding results */
+static volatile long sink;
+
+static void report(const char *op, long size, long ops, double seconds) {
+    printf("{\"op\":\"%s\",\"size\":%ld,\"ops\":%ld,\"ns_per_op\":%.1f}\n",
+           op, size, ops, seconds * 1e9 / (double)ops);
+    fflush(stdout);
+}
+
+/* job i (0-based) has jid i + 1 and pid PID_BASE + i + 1 */
+static int jid_of(long i) { return (int)i + 1; }
+static pid_t pid_of(long i) { return PID_BASE + (pid_t)i + 1; }
+
+/* runs every benchmark at one list size, returns seconds spent filling */
+static double bench_size(long size, long ops) {
+    job_list_t *list = init_job_list();
+    long *keys = (long *)malloc(sizeof(long) * (size_t)ops);
+    for (long k = 0; k < ops; k++) {
+        keys[k] = (long)(rng() % (unsigned long)size);
+    }
+
+    double start = now();
+    for (long i = 0; i < size; i++) {
+        add_job(list, jid_of(i), pid_of(i), RUNNING, "/bin/sleep");
+    }
+    double fill = now() - start;
+    report("fill", size, size, fill);
+
+    // add_job: append ops new jobs, then remove them again (untimed)
+    start = now();
+    for (long k = 0; k < ops; k++) {
+        add_job(list, jid_of(size + k), pid_of(size + k), RUNNING,
+                "/bin/sleep");
+    }
+    report("add_job", size, ops, now() - start);
+    for (long k = ops - 1; k >= 0; k--) {
+        remove_job_jid(list, jid_of(size + k));
+    }
+
+    start = now();
+    for (long k = 0; k < ops; k++) {
+        sink += get_job_pid(list, jid_of(keys[k]));
+    }
+    report("get_job_pid", size, ops, now() - start);
+
+    start = now();
+    for (long k = 0; k < ops; k++) {
+        sink += get_job_jid(list, pid_of(keys[k]));
+    }
+    report("get_job_jid", size, ops, now() - start);
+
+    start = now();
+    for (long k = 0; k < ops; k++) {
+        sink += get_job_hidden(list, pid_of(keys[k]));
+    }
+    report("get_job_hidden", size, ops, now() - start);
+
+    start = now();
+    for (long k = 0; k < ops; k++) {
+        sink += update_job_jid(list, jid_of(keys[k]),
+                               k % 2 ? RUNNING : STOPPED);
+    }
+    report("update_job_jid", size, ops, now() - start);
+
+    start = now();
+    for (long k = 0; k < ops; k++) {
+        sink += update_job_pid(list, pid_of(keys[k]),
+                               k % 2 ? RUNNING : STOPPED);
+    }
+    report("update_job_pid", size, ops, now() - start);
+
+    // removals: time each removal alone, put the job back at the tail
+    double removing = 0;
+    for (long k = 0; k < ops; k++) {
+        start = now();
+        sink += remove_job_jid(list, jid_of(keys[k]));
+        removing += now() - start;
+        add_job(list, jid_of(keys[k]), pid_of(keys[k]), RUNNING, "/bin/sleep");
+    }
+    report("remove_job_jid", size, ops, removing);
+
+    removing = 0;
+    for (long k = 0; k < ops; k++) {
+        start = now();
+        sink += remove_job_pid(list, pid_of(keys[k]));
+        removing += now() - start;
+        add_job(list, jid_of(keys[k]), pid_of(keys[k]), RUNNING, "/bin/sleep");
+    }
+    report("remove_job_pid", size, ops, removing);
+
+    // one full iterator pass, the way reap_jobs() walks the list
+    while (get_next_pid(list) > 0) {
+    }
+    start = now();
+    pid_t pid;
+    while ((pid = get_next_pid(list)) > 0) {
+        sink += pid;
+    }
+    report("get_next_pid", size, size, now() - start);
+
+    // empty the list front to back so cleanup_job_list() signals nothing
+    pid_t front;
+    while ((front = get_next_pid(list)) > 0) {
+        remove_job_pid(list, front);
+    }
+    cleanup_job_list(list);
+    free(keys);
+    return fill;
+}
+
+int main(int argc, char *argv[]) {
+    long max_size = 1000000;
+    long ops = 1000;
+    double budget = 120.0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:o:t:")) != -1) {
+        switch (opt) {
+            case 'n':
+                max_size = atol(optarg);
+                break;
+            case 'o':
+                ops = atol(optarg);
+                break;
+            case 't':
+                budget = atof(optarg);
+                break;
+            default:
+                fprintf(stderr,
+                        "usage: %s [-n MAX_SIZE] [-o OPERATIONS] "
+                        "[-t BUDGET_SECONDS]\n",
+                        argv[0]);
+                return 2;
+        }
+    }
+    if (max_size < 10 || ops < 1) {
+        fprintf(stderr, "%s: MAX_SIZE must be at least 10\n", argv[0]);
+        return 2;
+    }
+
+    double last_fill = 0;
+    long last_size = 0;
+    for (long size = 10; size <= max_size; size *= 10) {
+        if (last_size > 0) {
+            double ratio = (double)size / (double)last_size;
+            double projected = last_fill * ratio * ratio;
+            if (projected > budget) {
+                printf("{\"size\":%ld,\"measured\":false,"
+                       "\"projected_fill_s\":%.0f,\"skipped\":\"fill would "
+                       "exceed the %.0fs budget\"}\n",
+                       size, projected, budget);
+                last_fill = projected;
+                last_size = size;
+                continue;
+            }
+        }
+        last_fill = bench_size(size, ops);
+        last_size = size;
+    }
+    return 0;
+}
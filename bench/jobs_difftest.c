@@ -0,0 +1,633 @@
+/*
+ * jobs_difftest: randomized differential test for the job list
+ *
+ * Applies long random sequences of job list operations both to the
+ * implementation in jobs.c (or whichever file the Makefile's JOBS_SRC names)
+ * and to a deliberately simple reference model, and checks that every return
+ * value, every PID produced by the get_next_pid() iterator and the output of
+ * jobs() and jobs_long() agree. Each job's priority, CPU list, deadline and
+ * restart policy (including a restart waiting out its backoff, which takes
+ * the job out of the queue) are set and read back at random too. JIDs and
+ * PIDs are drawn from a small range so that lookups miss, duplicates occur
+ * and the list empties and refills often.
+ *
+ * The iterator is also exercised the way reap_jobs() in sh.c uses it: a full
+ * pass of get_next_pid() calls with jobs removed (the current one or others)
+ * in the middle of the pass.
+ *
+ * PIDs start above the kernel's PID_MAX_LIMIT, and lists are emptied before
+ * cleanup_job_list(), so no signal is ever sent to a real process.
+ *
+ * Usage: jobs_difftest [-s SEED] [-r ROUNDS] [-o OPERATIONS]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "../jobs.h"
+
+#define PID_BASE (1 << 23)  // above PID_MAX_LIMIT
+#define KEY_RANGE 24        // jids 1..KEY_RANGE, pids PID_BASE + 1..KEY_RANGE
+#define MODEL_SIZE 4096
+
+struct model_job {
+    int jid;
+    pid_t pid;
+    process_state_t state;
+    int hidden;
+    int priority;
+    char command[32];
+    char cpus[16];  // empty if not pinned
+    job_timeout_t timeout;  // duration_ms is 0 if there is no deadline
+    int supervised;
+    job_supervise_t supervise;
+    long serial;  // identity of the element, for the iterator
+};
+typedef struct model_job model_job_t;
+
+/* reference model: jobs in list order, plus the iterator's position */
+struct model {
+    model_job_t jobs[MODEL_SIZE];
+    int size;
+    long current;  // serial of the element get_next_pid() returns next,
+                   // -1 once the end of the list has been reached
+    long next_serial;
+};
+typedef struct model model_t;
+
+static unsigned long long rng_state;
+
+/* xorshift64*, so runs are reproducible from the seed */
+static unsigned long rng(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (unsigned long)((rng_state * 2685821657736338717ULL) >> 32);
+}
+
+static int rand_jid(void) { return (int)(rng() % KEY_RANGE) + 1; }
+
+static pid_t rand_pid(void) {
+    return PID_BASE + (pid_t)(rng() % KEY_RANGE) + 1;
+}
+
+static process_state_t rand_state(void) {
+    switch (rng() % 3) {
+        case 0:
+            return RUNNING;
+        case 1:
+            return STOPPED;
+        default:
+            return QUEUED;
+    }
+}
+
+static int model_find_jid(model_t *m, int jid) {
+    for (int i = 0; i < m->size; i++) {
+        if (m->jobs[i].jid == jid) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int model_find_pid(model_t *m, pid_t pid) {
+    for (int i = 0; i < m->size; i++) {
+        if (m->jobs[i].pid == pid) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int model_add(model_t *m, int jid, pid_t pid, process_state_t state,
+                     const char *command) {
+    if (command == NULL || m->size == MODEL_SIZE) {
+        return -1;
+    }
+    model_job_t *job = &m->jobs[m->size];
+    job->jid = jid;
+    job->pid = pid;
+    job->state = state;
+    job->hidden = 0;
+    job->priority = 0;
+    job->cpus[0] = '\0';
+    job->timeout.duration_ms = 0;
+    job->supervised = 0;
+    snprintf(job->command, sizeof(job->command), "%s", command);
+    job->serial = m->next_serial++;
+    // adding to an empty list points the iterator at the new job
+    if (m->size == 0) {
+        m->current = job->serial;
+    }
+    m->size++;
+    return 0;
+}
+
+static int model_remove_at(model_t *m, int i) {
+    if (i < 0) {
+        return -1;
+    }
+    // removing the iterator's job moves the iterator to the one after it
+    if (m->current == m->jobs[i].serial) {
+        m->current = i + 1 < m->size ? m->jobs[i + 1].serial : -1;
+    }
+    memmove(&m->jobs[i], &m->jobs[i + 1],
+            sizeof(model_job_t) * (size_t)(m->size - i - 1));
+    m->size--;
+    return 0;
+}
+
+static pid_t model_next_pid(model_t *m) {
+    int i = 0;
+    if (m->current != -1) {
+        while (i < m->size && m->jobs[i].serial != m->current) {
+            i++;
+        }
+        if (i == m->size) {
+            fprintf(stderr, "model iterator points at a removed job\n");
+            exit(2);
+        }
+        // queued jobs have no process and are skipped
+        while (i < m->size && m->jobs[i].state == QUEUED) {
+            i++;
+        }
+        m->current = i < m->size ? m->jobs[i].serial : -1;
+    }
+    if (m->current == -1) {
+        m->current = m->size > 0 ? m->jobs[0].serial : -1;
+        return -1;
+    }
+    m->current = i + 1 < m->size ? m->jobs[i + 1].serial : -1;
+    return m->jobs[i].pid;
+}
+
+/* queued jobs start unless they are waiting to be restarted */
+static int model_startable(model_job_t *job) {
+    return job->state == QUEUED &&
+           !(job->supervised && job->supervise.waiting);
+}
+
+/* the queued job that starts next: lowest priority, then first added */
+static int model_next_queued(model_t *m) {
+    int best = -1;
+    for (int i = 0; i < m->size; i++) {
+        if (model_startable(&m->jobs[i]) &&
+            (best < 0 || m->jobs[i].priority < m->jobs[best].priority)) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+/* position of job i in the queue, computed by sorting a copy of the queue */
+static int model_queue_position(model_t *m, int i) {
+    if (i < 0 || !model_startable(&m->jobs[i])) {
+        return -1;
+    }
+    static model_t queue;
+    queue = *m;
+    int position = 0;
+    int next;
+    while ((next = model_next_queued(&queue)) >= 0) {
+        position++;
+        if (queue.jobs[next].serial == m->jobs[i].serial) {
+            return position;
+        }
+        queue.jobs[next].state = RUNNING;
+    }
+    return -1;
+}
+
+static int model_count(model_t *m, process_state_t state) {
+    int count = 0;
+    for (int i = 0; i < m->size; i++) {
+        if (m->jobs[i].state == state && !m->jobs[i].hidden) {
+            count++;
+        }
+    }
+    return count;
+}
+
+/*
+ * writes what jobs() (or jobs_long() if long_format) should print for the
+ * model into buf
+ */
+static size_t model_jobs_output(model_t *m, int long_format, char *buf,
+                                size_t size) {
+    size_t len = 0;
+    for (int i = 0; i < m->size && len < size; i++) {
+        model_job_t *job = &m->jobs[i];
+        if (job->hidden) {
+            continue;
+        }
+        if (job->state == QUEUED && !model_startable(job)) {
+            len += (size_t)snprintf(&buf[len], size - len,
+                                    "[%d] (-) Restarting %s", job->jid,
+                                    job->command);
+        } else if (job->state == QUEUED) {
+            len += (size_t)snprintf(&buf[len], size - len,
+                                    "[%d] (-) Queued #%d %s", job->jid,
+                                    model_queue_position(m, i), job->command);
+        } else {
+            len += (size_t)snprintf(
+                &buf[len], size - len, "[%d] (%d) %s %s", job->jid, job->pid,
+                job->state == RUNNING ? "Running" : "Stopped", job->command);
+        }
+        if (long_format && len < size) {
+            len += (size_t)snprintf(&buf[len], size - len, " nice=%d",
+                                    job->priority);
+        }
+        if (long_format && job->cpus[0] != '\0' && len < size) {
+            len += (size_t)snprintf(&buf[len], size - len, " cpus=%s",
+                                    job->cpus);
+        }
+        if (long_format && job->timeout.duration_ms != 0 && len < size) {
+            len += (size_t)snprintf(&buf[len], size - len, " timeout=%ldms",
+                                    job->timeout.duration_ms);
+        }
+        if (long_format && job->supervised && len < size) {
+            len += (size_t)snprintf(&buf[len], size - len, " restarts=%d",
+                                    job->supervise.restarts);
+            if (job->supervise.max_restarts >= 0 && len < size) {
+                len += (size_t)snprintf(&buf[len], size - len, "/%d",
+                                        job->supervise.max_restarts);
+            }
+            if (job->supervise.crashes >= CRASH_LOOP_CRASHES && len < size) {
+                len += (size_t)snprintf(&buf[len], size - len, " crash-loop");
+            }
+        }
+        if (len < size) {
+            len += (size_t)snprintf(&buf[len], size - len, "\n");
+        }
+    }
+    return len < size ? len : size;
+}
+
+/*
+ * captures what jobs() (or jobs_long() if long_format) prints for the real
+ * list into buf
+ */
+static size_t real_jobs_output(job_list_t *list, int long_format, char *buf,
+                               size_t size) {
+    fflush(stdout);
+    int mem_fd = memfd_create("jobs_difftest", 0);
+    int saved = dup(STDOUT_FILENO);
+    dup2(mem_fd, STDOUT_FILENO);
+    if (long_format) {
+        jobs_long(list);
+    } else {
+        jobs(list);
+    }
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    ssize_t got = pread(mem_fd, buf, size, 0);
+    close(mem_fd);
+    return got < 0 ? 0 : (size_t)got;
+}
+
+static long checks;
+static unsigned long long run_seed;
+static long run_op;
+
+static void check(long expected, long actual, const char *what) {
+    checks++;
+    if (expected != actual) {
+        fprintf(stderr,
+                "MISMATCH seed=%llu op=%ld %s: reference %ld, got %ld\n",
+                run_seed, run_op, what, expected, actual);
+        exit(1);
+    }
+}
+
+/*
+ * runs one reap_jobs()-style pass over both lists, removing jobs with
+ * probability 1/3 as they are visited (the visited job itself, or a random
+ * other one) and checking the PIDs visited
+ */
+static void check_reap_pass(job_list_t *list, model_t *m) {
+    for (int steps = 0; steps <= 2 * MODEL_SIZE; steps++) {
+        pid_t expected = model_next_pid(m);
+        pid_t actual = get_next_pid(list);
+        check(expected, actual, "reap pass get_next_pid");
+        if (actual <= 0) {
+            return;
+        }
+        switch (rng() % 6) {
+            case 0:
+                check(model_remove_at(m, model_find_pid(m, actual)),
+                      remove_job_pid(list, actual), "reap pass remove self");
+                break;
+            case 1: {
+                pid_t other = rand_pid();
+                check(model_remove_at(m, model_find_pid(m, other)),
+                      remove_job_pid(list, other), "reap pass remove other");
+                break;
+            }
+            default:
+                break;
+        }
+    }
+    check(0, 1, "reap pass did not terminate");
+}
+
+/* applies one random operation to both lists and compares the results */
+static void step(job_list_t *list, model_t *m) {
+    int jid = rand_jid();
+    pid_t pid = rand_pid();
+    process_state_t state = rand_state();
+    char command[32];
+    snprintf(command, sizeof(command), "/bin/cmd%lu", rng() % 100);
+    int i;
+
+    switch (rng() % 28) {
+        case 0:
+        case 1:
+        case 2:
+            check(model_add(m, jid, pid, state, command),
+                  add_job(list, jid, pid, state, command), "add_job");
+            break;
+        case 3:
+            // a NULL command is rejected
+            check(model_add(m, jid, pid, state, NULL),
+                  add_job(list, jid, pid, state, NULL), "add_job NULL");
+            break;
+        case 4:
+            check(model_remove_at(m, model_find_jid(m, jid)),
+                  remove_job_jid(list, jid), "remove_job_jid");
+            break;
+        case 5:
+            check(model_remove_at(m, model_find_pid(m, pid)),
+                  remove_job_pid(list, pid), "remove_job_pid");
+            break;
+        case 6:
+            i = model_find_jid(m, jid);
+            if (i >= 0) {
+                m->jobs[i].state = state;
+            }
+            check(i < 0 ? -1 : 0, update_job_jid(list, jid, state),
+                  "update_job_jid");
+            break;
+        case 7:
+            i = model_find_pid(m, pid);
+            if (i >= 0) {
+                m->jobs[i].state = state;
+            }
+            check(i < 0 ? -1 : 0, update_job_pid(list, pid, state),
+                  "update_job_pid");
+            break;
+        case 8:
+            i = model_find_jid(m, jid);
+            check(i < 0 ? -1 : m->jobs[i].pid, get_job_pid(list, jid),
+                  "get_job_pid");
+            break;
+        case 9:
+            i = model_find_pid(m, pid);
+            check(i < 0 ? -1 : m->jobs[i].jid, get_job_jid(list, pid),
+                  "get_job_jid");
+            break;
+        case 10:
+            check(model_next_pid(m), get_next_pid(list), "get_next_pid");
+            break;
+        case 11:
+            i = model_find_pid(m, pid);
+            if (i >= 0) {
+                m->jobs[i].hidden = (int)(rng() % 2);
+            }
+            check(i < 0 ? -1 : 0,
+                  set_job_hidden(list, pid, i < 0 ? 1 : m->jobs[i].hidden),
+                  "set_job_hidden");
+            break;
+        case 12:
+            i = model_find_pid(m, pid);
+            check(i < 0 ? -1 : m->jobs[i].hidden, get_job_hidden(list, pid),
+                  "get_job_hidden");
+            break;
+        case 13:
+            check_reap_pass(list, m);
+            break;
+        case 14:
+            i = model_find_jid(m, jid);
+            if (i >= 0) {
+                m->jobs[i].pid = pid;
+            }
+            check(i < 0 ? -1 : 0, set_job_pid(list, jid, pid), "set_job_pid");
+            break;
+        case 15: {
+            int priority = (int)(rng() % 5) - 2;
+            i = model_find_jid(m, jid);
+            if (i >= 0) {
+                m->jobs[i].priority = priority;
+            }
+            check(i < 0 ? -1 : 0, set_job_priority(list, jid, priority),
+                  "set_job_priority");
+            break;
+        }
+        case 16:
+            i = model_find_jid(m, jid);
+            check(i < 0 ? 0 : m->jobs[i].priority, get_job_priority(list, jid),
+                  "get_job_priority");
+            break;
+        case 17:
+            i = model_next_queued(m);
+            check(i < 0 ? -1 : m->jobs[i].jid, get_next_queued(list),
+                  "get_next_queued");
+            break;
+        case 18:
+            check(model_queue_position(m, model_find_jid(m, jid)),
+                  get_queue_position(list, jid), "get_queue_position");
+            break;
+        case 19:
+            check(model_count(m, state), count_jobs(list, state),
+                  "count_jobs");
+            break;
+        case 20: {
+            // a quarter of the time, clear the CPU list
+            char cpus[16] = "";
+            if (rng() % 4 != 0) {
+                snprintf(cpus, sizeof(cpus), "%lu-%lu", rng() % 8,
+                         8 + rng() % 8);
+            }
+            i = model_find_jid(m, jid);
+            if (i >= 0) {
+                snprintf(m->jobs[i].cpus, sizeof(m->jobs[i].cpus), "%s", cpus);
+            }
+            check(i < 0 ? -1 : 0,
+                  set_job_cpus(list, jid, cpus[0] != '\0' ? cpus : NULL),
+                  "set_job_cpus");
+            break;
+        }
+        case 21: {
+            i = model_find_jid(m, jid);
+            const char *expected =
+                i < 0 || m->jobs[i].cpus[0] == '\0' ? NULL : m->jobs[i].cpus;
+            const char *actual = get_job_cpus(list, jid);
+            check(expected == NULL, actual == NULL, "get_job_cpus NULL");
+            if (expected != NULL && actual != NULL) {
+                check(0, strcmp(expected, actual) != 0, "get_job_cpus");
+            }
+            break;
+        }
+        case 22: {
+            // a quarter of the time, clear the deadline
+            job_timeout_t timeout = {(long)(rng() % 5000) + 1,
+                                     (int)(rng() % 31) + 1,
+                                     (long)(rng() % 3) * 500};
+            int clear = rng() % 4 == 0;
+            i = model_find_jid(m, jid);
+            if (i >= 0) {
+                m->jobs[i].timeout = timeout;
+                if (clear) {
+                    m->jobs[i].timeout.duration_ms = 0;
+                }
+            }
+            check(i < 0 ? -1 : 0,
+                  set_job_timeout(list, jid, clear ? NULL : &timeout),
+                  "set_job_timeout");
+            break;
+        }
+        case 23: {
+            job_timeout_t timeout;
+            i = model_find_jid(m, jid);
+            int has = i >= 0 && m->jobs[i].timeout.duration_ms != 0;
+            check(has ? 0 : -1, get_job_timeout(list, jid, &timeout),
+                  "get_job_timeout");
+            if (has) {
+                check(m->jobs[i].timeout.duration_ms, timeout.duration_ms,
+                      "get_job_timeout duration");
+                check(m->jobs[i].timeout.signal, timeout.signal,
+                      "get_job_timeout signal");
+                check(m->jobs[i].timeout.kill_after_ms, timeout.kill_after_ms,
+                      "get_job_timeout kill after");
+            }
+            break;
+        }
+        case 24:
+            i = model_find_jid(m, jid);
+            check(i < 0 ? -1 : (int)m->jobs[i].state, get_job_state(list, jid),
+                  "get_job_state");
+            break;
+        case 25: {
+            // a quarter of the time, stop supervising
+            int crashes = (int)(rng() % (CRASH_LOOP_CRASHES + 2));
+            job_supervise_t supervise = {(int)(rng() % 4) - 1,
+                                         (long)(rng() % 1000),
+                                         (int)(rng() % 4),
+                                         crashes,
+                                         (int)(rng() % 2),
+                                         rng()};
+            int clear = rng() % 4 == 0;
+            i = model_find_jid(m, jid);
+            if (i >= 0) {
+                m->jobs[i].supervised = !clear;
+                m->jobs[i].supervise = supervise;
+            }
+            check(i < 0 ? -1 : 0,
+                  set_job_supervise(list, jid, clear ? NULL : &supervise),
+                  "set_job_supervise");
+            break;
+        }
+        case 26: {
+            job_supervise_t supervise;
+            i = model_find_jid(m, jid);
+            int has = i >= 0 && m->jobs[i].supervised;
+            check(has ? 0 : -1, get_job_supervise(list, jid, &supervise),
+                  "get_job_supervise");
+            if (has) {
+                job_supervise_t *expected = &m->jobs[i].supervise;
+                check(expected->max_restarts, supervise.max_restarts,
+                      "get_job_supervise max restarts");
+                check(expected->backoff_ms, supervise.backoff_ms,
+                      "get_job_supervise backoff");
+                check(expected->restarts, supervise.restarts,
+                      "get_job_supervise restarts");
+                check(expected->crashes, supervise.crashes,
+                      "get_job_supervise crashes");
+                check(expected->waiting, supervise.waiting,
+                      "get_job_supervise waiting");
+                check(expected->started_ns == supervise.started_ns, 1,
+                      "get_job_supervise started");
+            }
+            break;
+        }
+        case 27: {
+            int supervised = 0;
+            for (i = 0; i < m->size; i++) {
+                supervised += m->jobs[i].supervised;
+            }
+            check(supervised, count_supervised(list), "count_supervised");
+            break;
+        }
+    }
+}
+
+/* removes every job front to back, then frees the list */
+static void drain(job_list_t *list, model_t *m) {
+    while (m->size > 0) {
+        check(0, remove_job_jid(list, m->jobs[0].jid), "drain");
+        model_remove_at(m, 0);
+    }
+    check(-1, get_next_pid(list), "get_next_pid on empty list");
+    cleanup_job_list(list);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long long seed = 1;
+    long rounds = 2000;
+    long operations = 500;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:r:o:")) != -1) {
+        switch (opt) {
+            case 's':
+                seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'r':
+                rounds = atol(optarg);
+                break;
+            case 'o':
+                operations = atol(optarg);
+                break;
+            default:
+                fprintf(stderr,
+                        "usage: %s [-s SEED] [-r ROUNDS] [-o OPERATIONS]\n",
+                        argv[0]);
+                return 2;
+        }
+    }
+
+    static model_t model;
+    static char expected[1 << 16];
+    static char actual[1 << 16];
+
+    for (long round = 0; round < rounds; round++) {
+        run_seed = seed + (unsigned long long)round;
+        rng_state = run_seed * 0x9E3779B97F4A7C15ULL + 1;
+        memset(&model, 0, sizeof(model));
+        model.current = -1;
+
+        job_list_t *list = init_job_list();
+        for (run_op = 0; run_op < operations; run_op++) {
+            step(list, &model);
+            if (run_op % 50 == 0) {
+                int long_format = run_op % 100 == 0;
+                size_t expected_len = model_jobs_output(
+                    &model, long_format, expected, sizeof(expected));
+                size_t actual_len = real_jobs_output(list, long_format, actual,
+                                                     sizeof(actual));
+                check((long)expected_len, (long)actual_len, "jobs length");
+                check(0, memcmp(expected, actual, expected_len) != 0,
+                      "jobs output");
+            }
+        }
+        drain(list, &model);
+    }
+
+    printf("{\"test\":\"jobs_difftest\",\"seed\":%llu,\"rounds\":%ld,"
+           "\"operations\":%ld,\"checks\":%ld,\"result\":\"pass\"}\n",
+           seed, rounds, operations, checks);
+    return 0;
+}
@@ -0,0 +1,163 @@
+/*
+ * libpsh_bench: command lines run in-process with libpsh, from many threads
+ *
+ * Starts THREADS threads, each with its own psh_ctx_t, and has each run
+ * COMMANDS command lines with psh_run(). Most are /bin/true; every 16th
+ * writes "<thread> <i> <substitution>" to a per-thread file with a >
+ * redirection and a $(...) command substitution, and the thread reads it back
+ * and checks it, so a context that saw another thread's tokens, redirections
+ * or pipes fails the run. Then the same number of /bin/true commands is run
+ * through system(), which starts a /bin/sh -c for each, for comparison.
+ *
+ * Results are printed as one JSON object per line.
+ *
+ * Usage: libpsh_bench [-t THREADS] [-n COMMANDS_PER_THREAD]
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "../psh.h"
+
+struct worker {
+    pthread_t thread;
+    int id;
+    long commands;
+    int use_system;  // run /bin/true through system() instead of libpsh
+    int failed;
+};
+typedef struct worker worker_t;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* runs a redirected, substituted command line and checks what it wrote */
+static int check_line(psh_ctx_t *ctx, int id, long i) {
+    char path[64];
+    char line[256];
+    char expected[64];
+    char got[64] = "";
+    snprintf(path, sizeof(path), "/tmp/libpsh_bench.%d.%d", (int)getpid(), id);
+    snprintf(line, sizeof(line), "/bin/echo %d %ld $(/bin/echo sub%d) > %s",
+             id, i, id, path);
+    snprintf(expected, sizeof(expected), "%d %ld sub%d\n", id, i, id);
+
+    int status;
+    if (psh_run(ctx, line, &status) != 0 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+        return -1;
+    }
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    if (fgets(got, sizeof(got), file) == NULL) {
+        got[0] = '\0';
+    }
+    fclose(file);
+    unlink(path);
+    return strcmp(got, expected) == 0 ? 0 : -1;
+}
+
+static void *run_worker(void *arg) {
+    worker_t *worker = (worker_t *)arg;
+    if (worker->use_system) {
+        for (long i = 0; i < worker->commands; i++) {
+            int status = system("/bin/true");
+            worker->failed |= !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+        }
+        return NULL;
+    }
+
+    psh_ctx_t *ctx = psh_ctx_new();
+    if (ctx == NULL) {
+        worker->failed = 1;
+        return NULL;
+    }
+    for (long i = 0; i < worker->commands && !worker->failed; i++) {
+        if (i % 16 == 0) {
+            if (check_line(ctx, worker->id, i) < 0) {
+                fprintf(stderr, "thread %d: command %ld wrote the wrong output\n",
+                        worker->id, i);
+                worker->failed = 1;
+            }
+            continue;
+        }
+        int status;
+        worker->failed |= psh_run(ctx, "/bin/true", &status) != 0 ||
+                          !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    }
+    psh_ctx_free(ctx);
+    return NULL;
+}
+
+/* runs threads workers at once, returns commands/sec or -1.0 on failure */
+static double bench(int threads, long commands, int use_system) {
+    worker_t *workers = (worker_t *)calloc((size_t)threads, sizeof(worker_t));
+    double start = now();
+    for (int t = 0; t < threads; t++) {
+        workers[t].id = t;
+        workers[t].commands = commands;
+        workers[t].use_system = use_system;
+        if (pthread_create(&workers[t].thread, NULL, run_worker,
+                           &workers[t]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    int failed = 0;
+    for (int t = 0; t < threads; t++) {
+        pthread_join(workers[t].thread, NULL);
+        failed |= workers[t].failed;
+    }
+    double seconds = now() - start;
+    free(workers);
+    return failed ? -1.0 : (double)threads * (double)commands / seconds;
+}
+
+int main(int argc, char *argv[]) {
+    int threads = 4;
+    long commands = 1000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:n:")) != -1) {
+        switch (opt) {
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 'n':
+                commands = atol(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-t THREADS] [-n COMMANDS]\n",
+                        argv[0]);
+                return 2;
+        }
+    }
+    if (threads < 1 || commands < 1) {
+        fprintf(stderr, "%s: arguments must be positive\n", argv[0]);
+        return 2;
+    }
+
+    double psh_rate = bench(threads, commands, 0);
+    if (psh_rate < 0.0) {
+        fprintf(stderr, "%s: libpsh commands failed\n", argv[0]);
+        return 1;
+    }
+    double system_rate = bench(threads, commands, 1);
+    if (system_rate < 0.0) {
+        fprintf(stderr, "%s: system() commands failed\n", argv[0]);
+        return 1;
+    }
+    printf("{\"bench\":\"libpsh\",\"threads\":%d,\"commands\":%ld,"
+           "\"psh_per_s\":%.0f,\"system_per_s\":%.0f}\n",
+           threads, (long)threads * commands, psh_rate, system_rate);
+    return 0;
+}
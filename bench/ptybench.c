@@ -0,0 +1,361 @@
+/*
+ * ptybench: end-to-end benchmark for psh
+ *
+ * Drives one or more shell executables through a pseudo-terminal, the way a
+ * user (or the cs0330 harness) would, and measures:
+ *   builtin   commands/sec for a stream of built-in commands (cd .)
+ *   external  commands/sec for a stream of foreground /bin/true
+ *   keystroke newline-to-prompt latency (only for shells that print a prompt)
+ *   storm     background jobs spawned/sec for a burst of /bin/true &
+ *   reap      time for the shell to reap the whole storm once it's finished
+ *
+ * Every result is printed to stdout as one JSON object per line, so runs of
+ * different versions can be diffed or loaded by a script.
+ *
+ * Usage: ptybench [-n COMMANDS] [-j JOBS] [-l ITERATIONS] shell...
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DONE_MARKER "__ptybench_done__"
+#define TIMEOUT_S 120.0
+
+struct session {
+    const char *shell;
+    pid_t pid;
+    int fd;       // pty master
+    char *out;    // everything the shell has written so far
+    size_t len;   // bytes in out
+    size_t cap;   // bytes allocated for out
+    size_t mark;  // offset of the first byte not yet matched
+};
+typedef struct session session_t;
+
+/* returns CLOCK_MONOTONIC time in seconds */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* reads whatever the shell has written, returns -1 once the pty is closed */
+static int session_drain(session_t *s) {
+    for (;;) {
+        if (s->cap - s->len < 4096) {
+            s->cap *= 2;
+            s->out = (char *)realloc(s->out, s->cap);
+        }
+        ssize_t got = read(s->fd, &s->out[s->len], s->cap - s->len - 1);
+        if (got > 0) {
+            s->len += (size_t)got;
+            s->out[s->len] = '\0';
+        } else if (got < 0 && errno == EAGAIN) {
+            return 0;
+        } else if (got < 0 && errno == EINTR) {
+            continue;
+        } else {
+            return -1;  // EIO: the shell closed its side
+        }
+    }
+}
+
+/*
+ * starts shell on a new pty with echo and CRLF output translation turned off
+ * (but canonical mode on, so every read() in the shell returns one line),
+ * returns 0 on success
+ */
+static int session_start(session_t *s, const char *shell) {
+    s->shell = shell;
+    s->cap = 1 << 16;
+    s->len = 0;
+    s->mark = 0;
+    s->out = (char *)malloc(s->cap);
+    s->out[0] = '\0';
+
+    s->pid = forkpty(&s->fd, NULL, NULL, NULL);
+    if (s->pid < 0) {
+        perror("forkpty");
+        return -1;
+    }
+    if (s->pid == 0) {
+        struct termios tio;
+        if (tcgetattr(STDIN_FILENO, &tio) == 0) {
+            tio.c_lflag &= ~(tcflag_t)(ECHO | ECHONL);
+            tio.c_oflag &= ~(tcflag_t)ONLCR;
+            tcsetattr(STDIN_FILENO, TCSANOW, &tio);
+        }
+        execl(shell, shell, (char *)NULL);
+        perror("execl");
+        _exit(127);
+    }
+
+    int flags = fcntl(s->fd, F_GETFL);
+    fcntl(s->fd, F_SETFL, flags | O_NONBLOCK);
+    return 0;
+}
+
+/* writes len bytes to the shell, draining its output while the pty is full */
+static int session_send(session_t *s, const char *data, size_t len) {
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t put = write(s->fd, &data[sent], len - sent);
+        if (put > 0) {
+            sent += (size_t)put;
+            continue;
+        }
+        if (put < 0 && errno != EAGAIN && errno != EINTR) {
+            perror("write");
+            return -1;
+        }
+        struct pollfd pfd = {s->fd, POLLIN | POLLOUT, 0};
+        poll(&pfd, 1, 100);
+        if (session_drain(s) < 0) {
+            fprintf(stderr, "%s exited early\n", s->shell);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * waits until needle appears in the output after the mark, then moves the
+ * mark past it, returns 0 on success, -1 on timeout or if the shell exited
+ */
+static int session_expect(session_t *s, const char *needle) {
+    double deadline = now() + TIMEOUT_S;
+    size_t needle_len = strlen(needle);
+    for (;;) {
+        char *found = (char *)memmem(&s->out[s->mark], s->len - s->mark,
+                                     needle, needle_len);
+        if (found != NULL) {
+            s->mark = (size_t)(found - s->out) + needle_len;
+            return 0;
+        }
+        if (now() > deadline) {
+            fprintf(stderr, "%s: timed out waiting for \"%s\"\n", s->shell,
+                    needle);
+            return -1;
+        }
+        struct pollfd pfd = {s->fd, POLLIN, 0};
+        poll(&pfd, 1, 100);
+        if (session_drain(s) < 0) {
+            fprintf(stderr, "%s exited early\n", s->shell);
+            return -1;
+        }
+    }
+}
+
+/* returns the number of times needle appears in the output after from */
+static long session_count(session_t *s, size_t from, const char *needle) {
+    long count = 0;
+    size_t needle_len = strlen(needle);
+    char *cur = &s->out[from];
+    char *end = &s->out[s->len];
+    char *found;
+    while ((found = (char *)memmem(cur, (size_t)(end - cur), needle,
+                                   needle_len)) != NULL) {
+        count++;
+        cur = found + needle_len;
+    }
+    return count;
+}
+
+/* sends EOF and waits for the shell to exit */
+static void session_stop(session_t *s) {
+    session_send(s, "\x04", 1);
+    double deadline = now() + 5.0;
+    while (waitpid(s->pid, NULL, WNOHANG) == 0) {
+        if (now() > deadline) {
+            kill(s->pid, SIGKILL);
+            waitpid(s->pid, NULL, 0);
+            break;
+        }
+        session_drain(s);
+        usleep(1000);
+    }
+    close(s->fd);
+    free(s->out);
+}
+
+/* sends a command that prints DONE_MARKER and waits for it */
+static int session_sync(session_t *s) {
+    const char *line = "echo " DONE_MARKER "\n";
+    if (session_send(s, line, strlen(line)) < 0) {
+        return -1;
+    }
+    return session_expect(s, DONE_MARKER "\n");
+}
+
+/* sends line count times and times how long the shell takes to run them */
+static int bench_stream(session_t *s, const char *name, const char *line,
+                        long count) {
+    size_t line_len = strlen(line);
+    char *batch = (char *)malloc(line_len * (size_t)count);
+    for (long i = 0; i < count; i++) {
+        memcpy(&batch[(size_t)i * line_len], line, line_len);
+    }
+
+    double start = now();
+    int ret = session_send(s, batch, line_len * (size_t)count);
+    if (ret == 0) {
+        ret = session_sync(s);
+    }
+    double elapsed = now() - start;
+    free(batch);
+    if (ret < 0) {
+        return -1;
+    }
+
+    printf("{\"shell\":\"%s\",\"bench\":\"%s\",\"commands\":%ld,"
+           "\"seconds\":%.6f,\"commands_per_sec\":%.1f}\n",
+           s->shell, name, count, elapsed, (double)count / elapsed);
+    return 0;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* times newline-to-prompt for iterations empty lines */
+static int bench_keystroke(session_t *s, long iterations) {
+    double *samples = (double *)malloc(sizeof(double) * (size_t)iterations);
+    // consume the prompt printed after the previous command
+    if (session_expect(s, "$ ") < 0) {
+        free(samples);
+        return -1;
+    }
+    for (long i = 0; i < iterations; i++) {
+        double start = now();
+        if (session_send(s, "\n", 1) < 0 || session_expect(s, "$ ") < 0) {
+            free(samples);
+            return -1;
+        }
+        samples[i] = now() - start;
+    }
+    qsort(samples, (size_t)iterations, sizeof(double), compare_doubles);
+
+    printf("{\"shell\":\"%s\",\"bench\":\"keystroke\",\"iterations\":%ld,"
+           "\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}\n",
+           s->shell, iterations, samples[iterations / 2] * 1e6,
+           samples[(size_t)((double)iterations * 0.99)] * 1e6,
+           samples[iterations - 1] * 1e6);
+    free(samples);
+    return 0;
+}
+
+/*
+ * spawns jobs background jobs as fast as the shell accepts them, then times
+ * how long the shell takes to reap all of them once they have exited
+ */
+static int bench_storm(session_t *s, long jobs) {
+    size_t storm_start = s->len;
+    if (bench_stream(s, "storm", "/bin/true &\n", jobs) < 0) {
+        return -1;
+    }
+
+    // give the last jobs time to exit so only reaping is measured
+    usleep(500000);
+    session_drain(s);
+    const char *reaped_msg = "terminated with exit status";
+    long reaped_before = session_count(s, storm_start, reaped_msg);
+
+    // the shell reaps before reading each line, so every empty line is one
+    // full pass over the job list
+    double start = now();
+    long passes = 0;
+    while (session_count(s, storm_start, reaped_msg) < jobs) {
+        if (now() - start > TIMEOUT_S) {
+            fprintf(stderr, "%s: timed out reaping\n", s->shell);
+            return -1;
+        }
+        if (session_sync(s) < 0) {
+            return -1;
+        }
+        passes++;
+    }
+    double elapsed = now() - start;
+
+    printf("{\"shell\":\"%s\",\"bench\":\"reap\",\"jobs\":%ld,"
+           "\"reaped_during_storm\":%ld,\"passes\":%ld,\"seconds\":%.6f}\n",
+           s->shell, jobs, reaped_before, passes, elapsed);
+    return 0;
+}
+
+/* runs every benchmark against shell, returns 0 on success */
+static int bench_shell(const char *shell, long commands, long jobs,
+                       long iterations) {
+    session_t s;
+    if (session_start(&s, shell) < 0) {
+        return -1;
+    }
+    int ret = session_sync(&s);
+    if (ret == 0) {
+        ret = bench_stream(&s, "builtin", "cd .\n", commands);
+    }
+    if (ret == 0) {
+        ret = bench_stream(&s, "external", "/bin/true\n", commands);
+    }
+    if (ret == 0 && memmem(s.out, s.len, "$ ", 2) != NULL) {
+        ret = bench_keystroke(&s, iterations);
+    }
+    if (ret == 0) {
+        ret = bench_storm(&s, jobs);
+    }
+    session_stop(&s);
+    fflush(stdout);
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    long commands = 10000;
+    long jobs = 10000;
+    long iterations = 1000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:j:l:")) != -1) {
+        switch (opt) {
+            case 'n':
+                commands = atol(optarg);
+                break;
+            case 'j':
+                jobs = atol(optarg);
+                break;
+            case 'l':
+                iterations = atol(optarg);
+                break;
+            default:
+                fprintf(stderr,
+                        "usage: %s [-n COMMANDS] [-j JOBS] [-l ITERATIONS] "
+                        "shell...\n",
+                        argv[0]);
+                return 2;
+        }
+    }
+    if (optind == argc || commands < 1 || jobs < 1 || iterations < 1) {
+        fprintf(stderr,
+                "usage: %s [-n COMMANDS] [-j JOBS] [-l ITERATIONS] shell...\n",
+                argv[0]);
+        return 2;
+    }
+
+    int failed = 0;
+    for (int i = optind; i < argc; i++) {
+        if (bench_shell(argv[i], commands, jobs, iterations) < 0) {
+            failed = 1;
+        }
+    }
+    return failed;
+}
@@ -0,0 +1,160 @@
+/*
+ * rm_bench: rm -r on a large tree, against /bin/rm -rf
+ *
+ * Builds a scratch tree of FILES empty files, PER_DIR to a directory, with
+ * the directories spread over 16 top-level subdirectories, then removes it
+ * with rmtree_remove() on one thread and on THREADS threads, and with a
+ * forked /bin/rm -rf. Each removal is timed and checked to leave nothing
+ * behind. Building the tree is not timed.
+ *
+ * This is done for three shapes of the same FILES: "flat" puts every file
+ * in one directory, "tree" uses PER_DIR, and "wide" puts WIDE_PER_DIR files
+ * in each of many small directories. Helper threads only start once
+ * subdirectories queue up, so the flat shape runs on the caller alone and
+ * the wide shape is where parallel removal should pull ahead; how far
+ * depends on the number of CPUs and on the filesystem.
+ *
+ * Results are printed as one JSON object per line, one line per shape.
+ *
+ * Usage: rm_bench [-n FILES] [-d PER_DIR] [-t THREADS]
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "../rmtree.h"
+
+#define TOP_DIRS 16
+#define WIDE_PER_DIR 8
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* makes root/T/D/F for files files, per_dir to a directory */
+static int build_tree(const char *root, long files, long per_dir) {
+    char path[256];
+    if (mkdir(root, 0755) < 0) {
+        perror(root);
+        return -1;
+    }
+    for (int t = 0; t < TOP_DIRS; t++) {
+        snprintf(path, sizeof(path), "%s/%d", root, t);
+        if (mkdir(path, 0755) < 0) {
+            perror(path);
+            return -1;
+        }
+    }
+    for (long f = 0; f < files; f++) {
+        long dir = f / per_dir;
+        snprintf(path, sizeof(path), "%s/%ld/%ld", root, dir % TOP_DIRS, dir);
+        if (f % per_dir == 0 && mkdir(path, 0755) < 0) {
+            perror(path);
+            return -1;
+        }
+        snprintf(path, sizeof(path), "%s/%ld/%ld/%ld", root, dir % TOP_DIRS,
+                 dir, f);
+        int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd < 0) {
+            perror(path);
+            return -1;
+        }
+        close(fd);
+    }
+    return 0;
+}
+
+/* runs /bin/rm -rf root, returns 0 if it succeeded */
+static int system_rm(const char *root) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        execl("/bin/rm", "rm", "-rf", root, (char *)NULL);
+        _exit(127);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/* builds the tree and times one removal, returns files/sec or -1.0 */
+static double bench(const char *root, long files, long per_dir, int threads) {
+    if (build_tree(root, files, per_dir) < 0) {
+        return -1.0;
+    }
+    sync();
+    double t = now();
+    int failed = threads > 0 ? rmtree_remove(root, threads, 0)
+                             : system_rm(root);
+    t = now() - t;
+    struct stat st;
+    if (failed || lstat(root, &st) == 0 || errno != ENOENT) {
+        fprintf(stderr, "%s was not removed\n", root);
+        return -1.0;
+    }
+    return (double)files / t;
+}
+
+int main(int argc, char *argv[]) {
+    long files = 100000;
+    long per_dir = 250;
+    int threads = RMTREE_MAX_THREADS;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:d:t:")) != -1) {
+        switch (opt) {
+            case 'n':
+                files = atol(optarg);
+                break;
+            case 'd':
+                per_dir = atol(optarg);
+                break;
+            case 't':
+                threads = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-n FILES] [-d PER_DIR] "
+                        "[-t THREADS]\n", argv[0]);
+                return 2;
+        }
+    }
+    if (files < 1 || per_dir < 1 || threads < 1) {
+        fprintf(stderr, "%s: arguments must be positive\n", argv[0]);
+        return 2;
+    }
+
+    const char *shapes[] = {"flat", "tree", "wide"};
+    long shape_per_dir[] = {files, per_dir, WIDE_PER_DIR};
+    char root[64];
+    snprintf(root, sizeof(root), "/tmp/rm_bench.%d", (int)getpid());
+    for (int i = 0; i < 3; i++) {
+        long n = shape_per_dir[i];
+        double single = bench(root, files, n, 1);
+        double parallel = single < 0.0 ? -1.0 : bench(root, files, n,
+                                                      threads);
+        double system = parallel < 0.0 ? -1.0 : bench(root, files, n, 0);
+        if (system < 0.0) {
+            rmtree_remove(root, 1, 1);
+            return 1;
+        }
+        printf("{\"bench\":\"rm\",\"shape\":\"%s\",\"files\":%ld,"
+               "\"per_dir\":%ld,\"threads\":%d,\"single_per_s\":%.0f,"
+               "\"parallel_per_s\":%.0f,\"bin_rm_per_s\":%.0f}\n",
+               shapes[i], files, n, threads, single, parallel, system);
+        fflush(stdout);
+    }
+    return 0;
+}
@@ -0,0 +1,202 @@
+/*
+ * servebench: job submission throughput of psh --serve
+ *
+ * Starts SHELL --serve on a temporary socket, checks that a capture request
+ * sends back the job's output, then submits N "run /bin/true" requests over
+ * one connection, keeping up to WINDOW jobs in flight. The result is the
+ * number of jobs submitted, run and reported done per second, end to end.
+ *
+ * Results are printed as one JSON object per line.
+ *
+ * Usage: servebench [-n JOBS] [-w WINDOW] SHELL
+ */
+#define _GNU_SOURCE
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* connects to the server at path, retrying while it starts up */
+static int connect_server(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    for (int tries = 0; tries < 500; tries++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            return fd;
+        }
+        close(fd);
+        usleep(10000);
+    }
+    return -1;
+}
+
+/* reads one line from fd into line (without the newline) */
+static int read_line(int fd, char *line, size_t size) {
+    size_t len = 0;
+    while (len + 1 < size) {
+        if (read(fd, &line[len], 1) != 1) {
+            return -1;
+        }
+        if (line[len] == '\n') {
+            break;
+        }
+        len++;
+    }
+    line[len] = '\0';
+    return 0;
+}
+
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0) {
+            return -1;
+        }
+        data += written;
+        len -= (size_t)written;
+    }
+    return 0;
+}
+
+/* checks that capture sends back exactly the job's output */
+static int check_capture(int fd) {
+    const char *request = "capture /bin/echo servebench\n";
+    char line[256];
+    int jid;
+    int pid;
+    int code;
+    size_t len;
+    char output[64];
+    if (write_all(fd, request, strlen(request)) < 0 ||
+        read_line(fd, line, sizeof(line)) < 0 ||
+        sscanf(line, "job %d %d", &jid, &pid) != 2 ||
+        read_line(fd, line, sizeof(line)) < 0 ||
+        sscanf(line, "done %*d exit %d %zu", &code, &len) != 2 || code != 0 ||
+        len != strlen("servebench\n") || read(fd, output, len) != (ssize_t)len) {
+        return -1;
+    }
+    return memcmp(output, "servebench\n", len) == 0 ? 0 : -1;
+}
+
+/* submits jobs requests with up to window in flight, returns jobs/sec */
+static double bench_run(int fd, long jobs, long window) {
+    const char *request = "run /bin/true\n";
+    FILE *replies = fdopen(dup(fd), "r");
+    char line[256];
+    long sent = 0;
+    long done = 0;
+    double start = now();
+    while (done < jobs) {
+        // top the window up in one write
+        long batch = jobs - sent;
+        if (batch > window - (sent - done)) {
+            batch = window - (sent - done);
+        }
+        if (batch > 0) {
+            size_t len = strlen(request);
+            char *requests = (char *)malloc(len * (size_t)batch);
+            for (long i = 0; i < batch; i++) {
+                memcpy(&requests[len * (size_t)i], request, len);
+            }
+            int failed = write_all(fd, requests, len * (size_t)batch) < 0;
+            free(requests);
+            if (failed) {
+                fclose(replies);
+                return -1.0;
+            }
+            sent += batch;
+        }
+
+        if (fgets(line, sizeof(line), replies) == NULL) {
+            fclose(replies);
+            return -1.0;
+        }
+        if (strncmp(line, "done ", 5) == 0) {
+            done++;
+        } else if (strncmp(line, "job ", 4) != 0) {
+            fprintf(stderr, "unexpected reply: %s", line);
+            fclose(replies);
+            return -1.0;
+        }
+    }
+    double seconds = now() - start;
+    fclose(replies);
+    return (double)jobs / seconds;
+}
+
+int main(int argc, char *argv[]) {
+    long jobs = 5000;
+    long window = 64;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:w:")) != -1) {
+        switch (opt) {
+            case 'n':
+                jobs = atol(optarg);
+                break;
+            case 'w':
+                window = atol(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-n JOBS] [-w WINDOW] SHELL\n",
+                        argv[0]);
+                return 2;
+        }
+    }
+    if (optind + 1 != argc || jobs < 1 || window < 1) {
+        fprintf(stderr, "usage: %s [-n JOBS] [-w WINDOW] SHELL\n", argv[0]);
+        return 2;
+    }
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/servebench.%d.sock", (int)getpid());
+    pid_t server = fork();
+    if (server < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (server == 0) {
+        execl(argv[optind], argv[optind], "--serve", path, (char *)NULL);
+        perror("execl");
+        exit(1);
+    }
+
+    int status = 1;
+    int fd = connect_server(path);
+    if (fd < 0) {
+        fprintf(stderr, "%s: can't connect to %s\n", argv[0], path);
+    } else if (check_capture(fd) < 0) {
+        fprintf(stderr, "%s: capture reply is wrong\n", argv[0]);
+    } else {
+        double rate = bench_run(fd, jobs, window);
+        if (rate < 0.0) {
+            fprintf(stderr, "%s: run requests failed\n", argv[0]);
+        } else {
+            printf("{\"bench\":\"serve\",\"jobs\":%ld,\"window\":%ld,"
+                   "\"jobs_per_s\":%.0f}\n",
+                   jobs, window, rate);
+            status = 0;
+        }
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    return status;
+}
@@ -0,0 +1,164 @@
+#include "./evlog.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// mapping of the whole log file, NULL if not recording
+static evlog_header_t *header;
+static evlog_record_t *records;
+static size_t map_size;
+
+/*
+ * opens (creating if needed) the event log at path with room for capacity
+ * records and starts recording; an existing log with the same capacity is
+ * appended to, and a new or empty file becomes an empty log
+ * returns 0 on success, -1 on failure (including a non-empty file that isn't
+ * a log of this capacity, which is left as it is)
+ */
+int evlog_open(const char *path, uint64_t capacity) {
+    if (header != NULL || capacity == 0) {
+        return -1;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("evlog: open");
+        return -1;
+    }
+    // another shell may be creating the same log
+    if (flock(fd, LOCK_EX) < 0) {
+        perror("evlog: flock");
+        close(fd);
+        return -1;
+    }
+
+    size_t size = sizeof(evlog_header_t) + capacity * sizeof(evlog_record_t);
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror("evlog: fstat");
+        close(fd);
+        return -1;
+    }
+    int reuse = st.st_size != 0;
+    if (reuse) {
+        evlog_header_t h;
+        if (pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) ||
+            memcmp(h.magic, EVLOG_MAGIC, sizeof(h.magic)) != 0 ||
+            h.version != EVLOG_VERSION ||
+            h.record_size != sizeof(evlog_record_t) ||
+            h.capacity != capacity || (size_t)st.st_size != size) {
+            fprintf(stderr,
+                    "evlog: %s is not an event log of %llu records\n", path,
+                    (unsigned long long)capacity);
+            close(fd);
+            return -1;
+        }
+    } else if (ftruncate(fd, (off_t)size) < 0) {
+        perror("evlog: ftruncate");
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("evlog: mmap");
+        close(fd);
+        return -1;
+    }
+
+    // a new file is already zeroed
+    evlog_header_t *h = (evlog_header_t *)map;
+    if (!reuse) {
+        memcpy(h->magic, EVLOG_MAGIC, sizeof(h->magic));
+        h->version = EVLOG_VERSION;
+        h->record_size = sizeof(evlog_record_t);
+        h->capacity = capacity;
+        h->head = 0;
+    }
+    close(fd);  // also drops the lock
+
+    header = h;
+    records = (evlog_record_t *)(h + 1);
+    map_size = size;
+    return 0;
+}
+
+/* stops recording and unmaps the log */
+void evlog_close(void) {
+    if (header == NULL) {
+        return;
+    }
+    munmap(header, map_size);
+    header = NULL;
+    records = NULL;
+}
+
+static uint64_t timeval_us(struct timeval tv) {
+    return (uint64_t)tv.tv_sec * 1000000u + (uint64_t)tv.tv_usec;
+}
+
+/*
+ * records event for the job; usage may be NULL
+ * does nothing if no log is open
+ */
+void evlog_record(evlog_event_t event, int jid, pid_t pid, int status,
+                  const struct rusage *usage) {
+    if (header == NULL) {
+        return;
+    }
+
+    // several shells may share one log, so claim the slot atomically
+    uint64_t seq = __atomic_add_fetch(&header->head, 1, __ATOMIC_RELAXED);
+    evlog_record_t *rec = &records[(seq - 1) % header->capacity];
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+    rec->time_ns = (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+    rec->jid = jid;
+    rec->pid = pid;
+    rec->event = (uint32_t)event;
+    rec->status = status;
+    if (usage != NULL) {
+        rec->utime_us = timeval_us(usage->ru_utime);
+        rec->stime_us = timeval_us(usage->ru_stime);
+        rec->maxrss_kb = usage->ru_maxrss;
+        rec->nvcsw = (uint32_t)usage->ru_nvcsw;
+        rec->nivcsw = (uint32_t)usage->ru_nivcsw;
+    } else {
+        rec->utime_us = 0;
+        rec->stime_us = 0;
+        rec->maxrss_kb = 0;
+        rec->nvcsw = 0;
+        rec->nivcsw = 0;
+    }
+    __atomic_store_n(&rec->seq, seq, __ATOMIC_RELEASE);
+}
+
+/*
+ * records the state change described by a wait status (stopped, continued,
+ * exited or signaled) for the job; usage may be NULL
+ * does nothing if no log is open
+ */
+void evlog_record_wait(int jid, pid_t pid, int status,
+                       const struct rusage *usage) {
+    if (header == NULL) {
+        return;
+    }
+    if (WIFEXITED(status)) {
+        evlog_record(EV_EXIT, jid, pid, status, usage);
+    } else if (WIFSIGNALED(status)) {
+        evlog_record(EV_SIGNALED, jid, pid, status, usage);
+    } else if (WIFSTOPPED(status)) {
+        evlog_record(EV_STOP, jid, pid, status, NULL);
+    } else if (WIFCONTINUED(status)) {
+        evlog_record(EV_CONT, jid, pid, status, NULL);
+    }
+}
@@ -0,0 +1,83 @@
+#ifndef EVLOG_H_
+#define EVLOG_H_
+
+#include <stdint.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+
+/*
+ * Job lifecycle event log: a file holding an evlog_header_t followed by a
+ * ring of capacity fixed-size evlog_record_t's. The shell maps the file and
+ * writes records straight into the mapping, so logging an event is a few
+ * stores and no system calls. Record n (counting from 1) lives in slot
+ * (n - 1) % capacity, so once the ring is full the oldest records are
+ * overwritten. Decode with evlogdump.
+ */
+
+#define EVLOG_MAGIC "PSHEVLG1"
+#define EVLOG_VERSION 1
+#define EVLOG_DEFAULT_CAPACITY 65536
+
+typedef enum {
+    EV_SPAWN,     // forked (status unused)
+    EV_STOP,      // stopped by a signal (status is the wait status)
+    EV_CONT,      // continued (status unused)
+    EV_EXIT,      // exited and reaped (status is the wait status)
+    EV_SIGNALED,  // terminated by a signal and reaped (status is the wait status)
+    EV_TIMEOUT,   // deadline passed and signaled (status is the signal sent)
+    EV_NUM
+} evlog_event_t;
+
+struct evlog_header {
+    char magic[8];         // EVLOG_MAGIC
+    uint32_t version;      // EVLOG_VERSION
+    uint32_t record_size;  // sizeof(evlog_record_t)
+    uint64_t capacity;     // number of record slots
+    uint64_t head;         // number of records ever written
+    char reserved[32];
+};
+typedef struct evlog_header evlog_header_t;
+
+struct evlog_record {
+    uint64_t seq;        // 1-based record number, 0 if slot is unused;
+                         // written last so a torn record is never seen
+    uint64_t time_ns;    // CLOCK_REALTIME
+    int32_t jid;         // 0 if the job has no job id (e.g. foreground)
+    int32_t pid;
+    uint32_t event;      // evlog_event_t
+    int32_t status;      // wait status for EV_STOP, EV_EXIT, EV_SIGNALED
+    uint64_t utime_us;   // user CPU time, for EV_EXIT and EV_SIGNALED
+    uint64_t stime_us;   // system CPU time
+    int64_t maxrss_kb;   // peak resident set size
+    uint32_t nvcsw;      // voluntary context switches
+    uint32_t nivcsw;     // involuntary context switches
+};
+typedef struct evlog_record evlog_record_t;
+
+/*
+ * opens (creating if needed) the event log at path with room for capacity
+ * records and starts recording; an existing log with the same capacity is
+ * appended to, and a new or empty file becomes an empty log
+ * returns 0 on success, -1 on failure (including a non-empty file that isn't
+ * a log of this capacity, which is left as it is)
+ */
+int evlog_open(const char *path, uint64_t capacity);
+
+/* stops recording and unmaps the log */
+void evlog_close(void);
+
+/*
+ * records event for the job; usage may be NULL
+ * does nothing if no log is open
+ */
+void evlog_record(evlog_event_t event, int jid, pid_t pid, int status,
+                  const struct rusage *usage);
+/*
+ * records the state change described by a wait status (stopped, continued,
+ * exited or signaled) for the job; usage may be NULL
+ * does nothing if no log is open
+ */
+void evlog_record_wait(int jid, pid_t pid, int status,
+                       const struct rusage *usage);
+
+#endif  // EVLOG_H_
@@ -0,0 +1,135 @@
+/*
+ * evlogdump: prints a psh job lifecycle event log (see evlog.h)
+ *
+ * Records are printed oldest first, one per line:
+ *   TIME SEQ EVENT jid=JID pid=PID [exit=N | signal=N] [utime= stime= ...]
+ * With -j, each record is printed as a JSON object instead.
+ *
+ * Usage: evlogdump [-j] logfile
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "evlog.h"
+
+static const char *event_names[EV_NUM] = {"spawn",    "stop", "cont",
+                                          "exit",     "signaled",
+                                          "timeout"};
+
+/* prints one record as text, or as JSON if json is nonzero */
+static void print_record(const evlog_record_t *rec, int json) {
+    const char *event =
+        rec->event < EV_NUM ? event_names[rec->event] : "unknown";
+    int reaped = rec->event == EV_EXIT || rec->event == EV_SIGNALED;
+
+    if (json) {
+        printf("{\"seq\":%lu,\"time_ns\":%lu,\"event\":\"%s\",\"jid\":%d,"
+               "\"pid\":%d,\"status\":%d",
+               (unsigned long)rec->seq, (unsigned long)rec->time_ns, event,
+               rec->jid, rec->pid, rec->status);
+        if (reaped) {
+            printf(",\"utime_us\":%lu,\"stime_us\":%lu,\"maxrss_kb\":%ld,"
+                   "\"nvcsw\":%u,\"nivcsw\":%u",
+                   (unsigned long)rec->utime_us, (unsigned long)rec->stime_us,
+                   (long)rec->maxrss_kb, rec->nvcsw, rec->nivcsw);
+        }
+        printf("}\n");
+        return;
+    }
+
+    time_t secs = (time_t)(rec->time_ns / 1000000000u);
+    struct tm tm;
+    char when[32];
+    localtime_r(&secs, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+
+    printf("%s.%06lu %lu %-8s jid=%d pid=%d", when,
+           (unsigned long)(rec->time_ns % 1000000000u / 1000u),
+           (unsigned long)rec->seq, event, rec->jid, rec->pid);
+    if (rec->event == EV_EXIT) {
+        printf(" exit=%d", WEXITSTATUS(rec->status));
+    } else if (rec->event == EV_SIGNALED) {
+        printf(" signal=%d", WTERMSIG(rec->status));
+    } else if (rec->event == EV_STOP) {
+        printf(" signal=%d", WSTOPSIG(rec->status));
+    } else if (rec->event == EV_TIMEOUT) {
+        printf(" signal=%d", rec->status);
+    }
+    if (reaped) {
+        printf(" utime=%.3fs stime=%.3fs maxrss=%ldkB csw=%u/%u",
+               (double)rec->utime_us / 1e6, (double)rec->stime_us / 1e6,
+               (long)rec->maxrss_kb, rec->nvcsw, rec->nivcsw);
+    }
+    printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+    int json = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "j")) != -1) {
+        if (opt == 'j') {
+            json = 1;
+        } else {
+            fprintf(stderr, "usage: %s [-j] logfile\n", argv[0]);
+            return 2;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-j] logfile\n", argv[0]);
+        return 2;
+    }
+
+    int fd = open(argv[optind], O_RDONLY);
+    if (fd < 0) {
+        perror("open");
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror("fstat");
+        return 1;
+    }
+    if ((size_t)st.st_size < sizeof(evlog_header_t)) {
+        fprintf(stderr, "%s: not an event log\n", argv[optind]);
+        return 1;
+    }
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    const evlog_header_t *header = (const evlog_header_t *)map;
+    if (memcmp(header->magic, EVLOG_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != EVLOG_VERSION ||
+        header->record_size != sizeof(evlog_record_t) ||
+        sizeof(evlog_header_t) + header->capacity * sizeof(evlog_record_t) >
+            (size_t)st.st_size) {
+        fprintf(stderr, "%s: not a version %d event log\n", argv[optind],
+                EVLOG_VERSION);
+        return 1;
+    }
+
+    const evlog_record_t *records = (const evlog_record_t *)(header + 1);
+    uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+    uint64_t first = head > header->capacity ? head - header->capacity + 1 : 1;
+    for (uint64_t seq = first; seq <= head; seq++) {
+        const evlog_record_t *slot = &records[(seq - 1) % header->capacity];
+        evlog_record_t rec = *slot;
+        // skip slots being written or overwritten while they were copied
+        if (rec.seq == seq &&
+            __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == seq) {
+            print_record(&rec, json);
+        }
+    }
+
+    munmap(map, (size_t)st.st_size);
+    return 0;
+}
@@ -0,0 +1,414 @@
+#define _GNU_SOURCE  // strcasestr
+#include "./frecency.h"
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_CAPACITY (1u << 24)
+#define MAX_AGINGS 64  // agings tried to make room for one new directory
+
+// mapping of the whole database, NULL if not recording
+static frecency_header_t *header;
+static uint32_t *index_slots;
+static uint64_t *slices;  // slice b starts at slices[b * slice_words]
+static frecency_entry_t *entries;
+static char *paths;
+static size_t map_size;
+static int db_fd = -1;
+
+static uint32_t index_size_for(uint32_t capacity) {
+    uint32_t size = 1;
+    while (size < 2 * capacity) {
+        size <<= 1;
+    }
+    return size;
+}
+
+static uint32_t slice_words_for(uint32_t capacity) {
+    return (capacity + 63) / 64;
+}
+
+static size_t db_size(uint32_t capacity) {
+    return sizeof(frecency_header_t) +
+           (size_t)index_size_for(capacity) * sizeof(uint32_t) +
+           (size_t)slice_words_for(capacity) * 64 * sizeof(uint64_t) +
+           (size_t)capacity * (sizeof(frecency_entry_t) + FRECENCY_PATH_BYTES);
+}
+
+static uint32_t hash_path(const char *dir, size_t len) {
+    uint32_t hash = 2166136261u;  // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)dir[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static uint64_t gram_bit(uint32_t gram) {
+    return (uint64_t)1 << ((gram * 2654435761u) >> 26);
+}
+
+
+/* one bit per character and per pair of adjacent characters, ignoring case */
+static uint64_t signature(const char *s) {
+    uint64_t sig = 0;
+    uint32_t prev = 0;
+    for (; *s != '\0'; s++) {
+        uint32_t c = (uint32_t)tolower((unsigned char)*s);
+        sig |= gram_bit(c);
+        if (prev != 0) {
+            sig |= gram_bit(0x10000u | prev << 8 | c);
+        }
+        prev = c;
+    }
+    return sig;
+}
+
+static const char *last_component(const char *dir) {
+    const char *slash = strrchr(dir, '/');
+    return slash != NULL ? slash + 1 : dir;
+}
+
+/* sets entry n's bit in the slice of every bit of its path's signature */
+static void add_signature(uint32_t n, const char *dir) {
+    uint64_t sig = signature(last_component(dir));
+    while (sig != 0) {
+        int b = __builtin_ctzll(sig);
+        uint64_t *word = &slices[(size_t)b * header->slice_words + n / 64];
+        *word |= (uint64_t)1 << (n % 64);
+        sig &= sig - 1;
+    }
+}
+
+/*
+ * returns the entry number of dir, or -1 with the empty index slot it would
+ * go in stored in *slot
+ */
+static long find(const char *dir, size_t len, uint32_t *slot) {
+    uint32_t mask = header->index_size - 1;
+    uint32_t i = hash_path(dir, len) & mask;
+    while (index_slots[i] != 0) {
+        frecency_entry_t *entry = &entries[index_slots[i] - 1];
+        if (entry->path_len == len &&
+            memcmp(&paths[entry->path_off], dir, len) == 0) {
+            return (long)index_slots[i] - 1;
+        }
+        i = (i + 1) & mask;
+    }
+    *slot = i;
+    return -1;
+}
+
+/*
+ * scales every rank by FRECENCY_AGING, drops the entries left below 1 and
+ * moves the rest down over the gaps, then rebuilds the index and slices;
+ * paths are in entry order, so they can be moved down in place
+ */
+static void age(void) {
+    uint32_t kept = 0;
+    uint32_t used = 0;
+    double total = 0.0;
+    for (uint32_t i = 0; i < header->count; i++) {
+        frecency_entry_t entry = entries[i];
+        entry.rank *= (float)FRECENCY_AGING;
+        if (entry.rank < 1.0f) {
+            continue;
+        }
+        memmove(&paths[used], &paths[entry.path_off], entry.path_len + 1);
+        entry.path_off = used;
+        used += entry.path_len + 1;
+        entries[kept++] = entry;
+        total += entry.rank;
+    }
+    header->count = kept;
+    header->path_used = used;
+    header->total_rank = total;
+    header->agings++;
+
+    memset(index_slots, 0, header->index_size * sizeof(uint32_t));
+    memset(slices, 0, (size_t)header->slice_words * 64 * sizeof(uint64_t));
+    for (uint32_t i = 0; i < kept; i++) {
+        uint32_t slot;
+        const char *dir = &paths[entries[i].path_off];
+        find(dir, entries[i].path_len, &slot);
+        index_slots[slot] = i + 1;
+        add_signature(i, dir);
+    }
+}
+
+/*
+ * opens (creating if needed) the database at path and starts recording; a
+ * valid existing file keeps its own capacity, and a new or empty one becomes
+ * an empty database of capacity entries
+ * returns 0 on success, -1 on failure (including a non-empty file that isn't
+ * a database, which is left as it is)
+ */
+int frecency_open(const char *path, uint32_t capacity) {
+    if (header != NULL || capacity == 0 || capacity > MAX_CAPACITY) {
+        return -1;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("frecency: open");
+        return -1;
+    }
+    // another shell may be creating the same file
+    if (flock(fd, LOCK_EX) < 0) {
+        perror("frecency: flock");
+        close(fd);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror("frecency: fstat");
+        close(fd);
+        return -1;
+    }
+    frecency_header_t h;
+    int reuse = pread(fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h) &&
+                memcmp(h.magic, FRECENCY_MAGIC, sizeof(h.magic)) == 0 &&
+                h.version == FRECENCY_VERSION &&
+                h.entry_size == sizeof(frecency_entry_t) &&
+                h.capacity != 0 && h.capacity <= MAX_CAPACITY &&
+                h.index_size == index_size_for(h.capacity) &&
+                h.slice_words == slice_words_for(h.capacity) &&
+                h.path_size == h.capacity * FRECENCY_PATH_BYTES &&
+                h.count <= h.capacity && h.path_used <= h.path_size &&
+                (size_t)st.st_size == db_size(h.capacity);
+    if (reuse) {
+        capacity = h.capacity;
+    } else if (st.st_size != 0) {
+        // only a new or empty file is made into a database
+        fprintf(stderr, "frecency: %s is not a frecency database\n", path);
+        close(fd);
+        return -1;
+    }
+    size_t size = db_size(capacity);
+    // truncating to 0 first leaves every area zeroed
+    if (!reuse &&
+        (ftruncate(fd, 0) < 0 || ftruncate(fd, (off_t)size) < 0)) {
+        perror("frecency: ftruncate");
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("frecency: mmap");
+        close(fd);
+        return -1;
+    }
+
+    header = (frecency_header_t *)map;
+    if (!reuse) {
+        memcpy(header->magic, FRECENCY_MAGIC, sizeof(header->magic));
+        header->version = FRECENCY_VERSION;
+        header->entry_size = sizeof(frecency_entry_t);
+        header->capacity = capacity;
+        header->index_size = index_size_for(capacity);
+        header->slice_words = slice_words_for(capacity);
+        header->path_size = capacity * FRECENCY_PATH_BYTES;
+    }
+    index_slots = (uint32_t *)(header + 1);
+    slices = (uint64_t *)(index_slots + header->index_size);
+    entries = (frecency_entry_t *)(slices + (size_t)header->slice_words * 64);
+    paths = (char *)(entries + capacity);
+    map_size = size;
+    db_fd = fd;
+    flock(fd, LOCK_UN);
+    return 0;
+}
+
+/* stops recording and unmaps the database */
+void frecency_close(void) {
+    if (header == NULL) {
+        return;
+    }
+    munmap(header, map_size);
+    close(db_fd);
+    header = NULL;
+    db_fd = -1;
+}
+
+/*
+ * records a visit to dir, an absolute path
+ * does nothing if no database is open
+ */
+void frecency_visit(const char *dir) {
+    size_t len = strlen(dir);
+    if (header == NULL || len == 0 || len >= header->path_size) {
+        return;
+    }
+    flock(db_fd, LOCK_EX);
+
+    uint32_t now = (uint32_t)time(NULL);
+    uint32_t slot;
+    long i = find(dir, len, &slot);
+    if (i >= 0) {
+        entries[i].rank += 1.0f;
+        entries[i].atime = now;
+    } else {
+        // make room by aging; a pass drops at least the directories that
+        // were visited once, so this ends well before MAX_AGINGS in practice
+        for (int agings = 0;
+             agings < MAX_AGINGS &&
+             (header->count == header->capacity ||
+              header->path_used + len + 1 > header->path_size);
+             agings++) {
+            age();
+        }
+        if (header->count == header->capacity ||
+            header->path_used + len + 1 > header->path_size) {
+            flock(db_fd, LOCK_UN);
+            return;
+        }
+        find(dir, len, &slot);
+
+        uint32_t n = header->count;
+        frecency_entry_t *entry = &entries[n];
+        entry->rank = 1.0f;
+        entry->atime = now;
+        entry->path_off = header->path_used;
+        entry->path_len = (uint32_t)len;
+        memcpy(&paths[entry->path_off], dir, len + 1);
+        add_signature(n, dir);
+        header->path_used += (uint32_t)len + 1;
+        index_slots[slot] = n + 1;
+        header->count = n + 1;
+    }
+
+    header->total_rank += 1.0;
+    if (header->total_rank > header->capacity / 2.0) {
+        age();
+    }
+    flock(db_fd, LOCK_UN);
+}
+
+/* drops dir from lookups until it is visited again */
+void frecency_forget(const char *dir) {
+    if (header == NULL) {
+        return;
+    }
+    flock(db_fd, LOCK_EX);
+    uint32_t slot;
+    long i = find(dir, strlen(dir), &slot);
+    if (i >= 0) {
+        // the next aging removes it
+        header->total_rank -= entries[i].rank;
+        entries[i].rank = 0.0f;
+    }
+    flock(db_fd, LOCK_UN);
+}
+
+/* z's weighting: visits in the last hour count 4 times, ... */
+static double recency_weight(uint32_t now, uint32_t atime) {
+    uint32_t age = now > atime ? now - atime : 0;
+    if (age < 3600) {
+        return 4.0;
+    } else if (age < 86400) {
+        return 2.0;
+    } else if (age < 604800) {
+        return 0.5;
+    }
+    return 0.25;
+}
+
+/* returns 1 if dir contains the terms in order, the last in its last part */
+static int matches(const char *dir, size_t len, char *const terms[],
+                   int term_num) {
+    const char *cursor = dir;
+    size_t last = (size_t)(last_component(dir) - dir);
+    for (int t = 0; t < term_num; t++) {
+        size_t term_len = strlen(terms[t]);
+        if (t == term_num - 1) {
+            // the match must end after the last slash
+            size_t start = last + 1 > term_len ? last + 1 - term_len : 0;
+            if (start > len) {
+                start = len;
+            }
+            if (&dir[start] > cursor) {
+                cursor = &dir[start];
+            }
+        }
+        const char *match = strcasestr(cursor, terms[t]);
+        if (match == NULL) {
+            return 0;
+        }
+        cursor = match + term_len;
+    }
+    return 1;
+}
+
+/*
+ * finds the highest-scoring directory other than exclude (which may be
+ * NULL) that contains terms[0] through terms[term_num - 1] in that order,
+ * ignoring case, with the last term ending in its last component; the score
+ * is the rank weighted by how recently the directory was visited
+ * returns 0 and copies the path into dir on success, -1 if nothing matches
+ */
+int frecency_query(char *const terms[], int term_num, const char *exclude,
+                   char *dir, size_t size) {
+    if (header == NULL) {
+        return -1;
+    }
+    flock(db_fd, LOCK_SH);
+
+    // only entries whose last component has every character and pair of
+    // characters of the last term's last component can match, so AND
+    // together the slices for those
+    uint64_t sig =
+        term_num > 0 ? signature(last_component(terms[term_num - 1])) : 0;
+    const uint64_t *wanted[64];
+    int wanted_num = 0;
+    for (; sig != 0; sig &= sig - 1) {
+        int b = __builtin_ctzll(sig);
+        wanted[wanted_num++] = &slices[(size_t)b * header->slice_words];
+    }
+
+    uint32_t now = (uint32_t)time(NULL);
+    uint32_t count = header->count;
+    long best = -1;
+    double best_score = 0.0;
+    for (uint32_t w = 0; w < (count + 63) / 64; w++) {
+        uint64_t candidates = ~(uint64_t)0;
+        for (int k = 0; k < wanted_num && candidates != 0; k++) {
+            candidates &= wanted[k][w];
+        }
+        if (count - w * 64 < 64) {
+            candidates &= ((uint64_t)1 << (count - w * 64)) - 1;
+        }
+        for (; candidates != 0; candidates &= candidates - 1) {
+            uint32_t i = w * 64 + (uint32_t)__builtin_ctzll(candidates);
+            if (entries[i].rank <= 0.0f) {
+                continue;
+            }
+            // scoring is cheaper than matching, so only match possible
+            // winners
+            double score =
+                entries[i].rank * recency_weight(now, entries[i].atime);
+            const char *path = &paths[entries[i].path_off];
+            if (score <= best_score ||
+                !matches(path, entries[i].path_len, terms, term_num) ||
+                (exclude != NULL && strcmp(path, exclude) == 0)) {
+                continue;
+            }
+            best = (long)i;
+            best_score = score;
+        }
+    }
+
+    int found = best >= 0 && entries[best].path_len < size;
+    if (found) {
+        memcpy(dir, &paths[entries[best].path_off],
+               entries[best].path_len + 1);
+    }
+    flock(db_fd, LOCK_UN);
+    return found ? 0 : -1;
+}
@@ -0,0 +1,90 @@
+#ifndef FRECENCY_H_
+#define FRECENCY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Frecency database of visited directories, for cd -j and z. The file holds
+ * a frecency_header_t followed by four areas sized from its capacity:
+ *   index    uint32_t[index_size]  open-addressed hash of paths, each slot
+ *                                  an entry number + 1 (0 if empty)
+ *   slices   uint64_t[64][slice_words]
+ *                                  bit-sliced signatures: bit n of slice b is
+ *                                  set if entry n's last component has a
+ *                                  character or pair of characters hashing
+ *                                  to b
+ *   entries  frecency_entry_t[capacity]
+ *   paths    char[path_size]       NUL-terminated paths, in entry order
+ * The shell maps the file, so a visit is a hash probe and a few stores. A
+ * lookup ANDs together the slices for the pattern's characters, 64 entries a
+ * word, and only looks at the paths of the entries left. Every visit adds 1
+ * to a directory's rank; once the ranks add up to more than half the
+ * capacity, or an area fills up, every rank is scaled by FRECENCY_AGING and
+ * directories left below rank 1 are dropped, compacting the areas in place.
+ * Several shells may share one file; each update holds an flock on it.
+ */
+
+#define FRECENCY_MAGIC "PSHFRCY1"
+#define FRECENCY_VERSION 1
+#define FRECENCY_DEFAULT_CAPACITY 65536
+#define FRECENCY_PATH_BYTES 64  // path area bytes per entry
+#define FRECENCY_AGING 0.9
+
+struct frecency_header {
+    char magic[8];         // FRECENCY_MAGIC
+    uint32_t version;      // FRECENCY_VERSION
+    uint32_t entry_size;   // sizeof(frecency_entry_t)
+    uint32_t capacity;     // number of entries
+    uint32_t index_size;   // number of index slots, a power of two
+    uint32_t path_size;    // bytes in the path area
+    uint32_t count;        // entries in use
+    uint32_t path_used;    // bytes of the path area in use
+    uint32_t agings;       // number of times the ranks were aged
+    uint32_t slice_words;  // words in each signature slice, capacity / 64
+    uint32_t unused;
+    double total_rank;     // sum of the ranks of all entries
+    char reserved[16];
+};
+typedef struct frecency_header frecency_header_t;
+
+struct frecency_entry {
+    float rank;          // visits, scaled down by aging; 0 if forgotten
+    uint32_t atime;      // last visit, in seconds since the epoch
+    uint32_t path_off;   // offset of the path in the path area
+    uint32_t path_len;   // length of the path, not counting the NUL
+};
+typedef struct frecency_entry frecency_entry_t;
+
+/*
+ * opens (creating if needed) the database at path and starts recording; a
+ * valid existing file keeps its own capacity, and a new or empty one becomes
+ * an empty database of capacity entries
+ * returns 0 on success, -1 on failure (including a non-empty file that isn't
+ * a database, which is left as it is)
+ */
+int frecency_open(const char *path, uint32_t capacity);
+
+/* stops recording and unmaps the database */
+void frecency_close(void);
+
+/*
+ * records a visit to dir, an absolute path
+ * does nothing if no database is open
+ */
+void frecency_visit(const char *dir);
+
+/* drops dir from lookups until it is visited again */
+void frecency_forget(const char *dir);
+
+/*
+ * finds the highest-scoring directory other than exclude (which may be
+ * NULL) that contains terms[0] through terms[term_num - 1] in that order,
+ * ignoring case, with the last term ending in its last component; the score
+ * is the rank weighted by how recently the directory was visited
+ * returns 0 and copies the path into dir on success, -1 if nothing matches
+ */
+int frecency_query(char *const terms[], int term_num, const char *exclude,
+                   char *dir, size_t size);
+
+#endif  // FRECENCY_H_
@@ -8,7 +8,13 @@ struct job_element {
     int jid;
     pid_t pid;
     process_state_t state;
+    int hidden;
+    int priority;
     char *command;
+    char *cpus;  // CPU list the job is pinned to, NULL if not pinned
+    job_timeout_t timeout;  // duration_ms is 0 if the job has no deadline
+    int supervised;         // 1 if supervise holds the restart policy
+    job_supervise_t supervise;
     struct job_element *next;
 };
 typedef struct job_element job_element_t;
@@ -45,7 +51,8 @@ void cleanup_job_list(job_list_t *job_list) {
         job_element_t *nextElement = cur->next;
 
         // if we are cleaning up the shell's job list and not a child's
-        if (getpid() == job_list->shell_pid) {
+        // (queued jobs have no process to kill)
+        if (getpid() == job_list->shell_pid && cur->pid > 0) {
             /* kill process */
             if (kill(-cur->pid, SIGKILL) < 0) {
                 perror("kill");
@@ -56,6 +63,7 @@ void cleanup_job_list(job_list_t *job_list) {
             free(cur->command);
             cur->command = NULL;
         }
+        free(cur->cpus);
 
         free(cur);
         cur = nextElement;
@@ -71,7 +79,8 @@ void cleanup_job_list(job_list_t *job_list) {
 /* adds new job to list, returns 0 on success, -1 on failure */
 int add_job(job_list_t *job_list, int jid, pid_t pid, process_state_t state,
             char *command) {
-    if (job_list == NULL || (state != RUNNING && state != STOPPED) ||
+    if (job_list == NULL ||
+        (state != RUNNING && state != STOPPED && state != QUEUED) ||
         command == NULL) {
         return -1;
     }
@@ -82,6 +91,11 @@ int add_job(job_list_t *job_list, int jid, pid_t pid, process_state_t state,
 
     // allocate new char*'s and copy buffers in to protect our code
     new->state = state;
+    new->hidden = 0;
+    new->priority = 0;
+    new->cpus = NULL;
+    new->timeout.duration_ms = 0;
+    new->supervised = 0;
 
     size_t cmdlen = strlen(command);
     new->command = (char *)malloc(sizeof(char) * (cmdlen + 1));
@@ -130,6 +144,7 @@ int remove_job_jid(job_list_t *job_list, int jid) {
                 free(cur->command);
                 cur->command = NULL;
             }
+            free(cur->cpus);
 
             free(cur);
             cur = NULL;
@@ -169,6 +184,7 @@ int remove_job_pid(job_list_t *job_list, pid_t pid) {
                 free(cur->command);
                 cur->command = NULL;
             }
+            free(cur->cpus);
             free(cur);
             cur = NULL;
 
@@ -182,6 +198,25 @@ int remove_job_pid(job_list_t *job_list, pid_t pid) {
     return -1;
 }
 
+/* sets job's PID, given job's JID, returns 0 on success, -1 on failure */
+int set_job_pid(job_list_t *job_list, int jid, pid_t pid) {
+    if (job_list == NULL) {
+        return -1;
+    }
+
+    job_element_t *cur = job_list->head;
+    while (cur != NULL) {
+        if (cur->jid == jid) {
+            cur->pid = pid;
+            return 0;
+        }
+
+        cur = cur->next;
+    }
+
+    return -1;
+}
+
 /* updates job's state, given job's JID, returns 0 on success, -1 on failure */
 int update_job_jid(job_list_t *job_list, int jid, process_state_t state) {
     if (job_list == NULL) {
@@ -256,17 +291,383 @@ int get_job_jid(job_list_t *job_list, pid_t pid) {
     return -1;
 }
 
+/* gets job's state, given job's JID, returns the state, -1 on failure */
+int get_job_state(job_list_t *job_list, int jid) {
+    if (job_list == NULL) {
+        return -1;
+    }
+
+    job_element_t *cur = job_list->head;
+    while (cur != NULL) {
+        if (cur->jid == jid) {
+            return (int)cur->state;
+        }
+
+        cur = cur->next;
+    }
+
+    return -1;
+}
+
+/*
+ * marks job as hidden (or not), given job's PID
+ * returns 0 on success, -1 on failure
+ */
+int set_job_hidden(job_list_t *job_list, pid_t pid, int hidden) {
+    if (job_list == NULL) {
+        return -1;
+    }
+
+    job_element_t *cur = job_list->head;
+    while (cur != NULL) {
+        if (cur->pid == pid) {
+            cur->hidden = hidden;
+            return 0;
+        }
+
+        cur = cur->next;
+    }
+
+    return -1;
+}
+
+/* returns 1 if job is hidden, 0 if not, -1 on failure, given job's PID */
+int get_job_hidden(job_list_t *job_list, pid_t pid) {
+    if (job_list == NULL) {
+        return -1;
+    }
+
+    job_element_t *cur = job_list->head;
+    while (cur != NULL) {
+        if (cur->pid == pid) {
+            return cur->hidden;
+        }
+
+        cur = cur->next;
+    }
+
+    return -1;
+}
+
+/*
+ * sets job's priority (a nice value: lower starts sooner), given job's JID
+ * returns 0 on success, -1 on failure
+ */
+int set_job_priority(job_list_t *job_list, int jid, int priority) {
+    if (job_list == NULL) {
+        return -1;
+    }
+
+    job_element_t *cur = job_list->head;
+    while (cur != NULL) {
+        if (cur->jid == jid) {
+            cur->priority = priority;
+            return 0;
+        }
+
+        cur = cur->next;
+    }
+
+    return -1;
+}
+
+/* gets job's priority, given job's JID, returns 0 if the job is not found */
+int get_job_priority(job_list_t *job_list, int jid) {
+    if (job_list == NULL) {
+        return 0;
+    }
+
+    job_element_t *cur = job_list->head;
+    while (cur != NULL) {
+        if (cur->jid == jid) {
+            return cur->priority;
+        }
+
+        cur = cur->next;
+    }
+
+    return 0;
+}
+
+/*
+ * records the CPU list (e.g. "0-3,8") job is pinned to, given job's JID
+ * NULL clears it
+ * returns 0 on success, -1 on failure
+ */
+int set_job_cpus(job_list_t *job_list, int jid, const char *cpus) {
+    if (job_list == NULL) {
+        return -1;
+    }
+
+    job_element_t *cur = job_list->head;
+    while (cur != NULL) {
+        if (cur->jid == jid) {
+            free(cur->cpus);
+            cur->cpus = NULL;
+            if (cpus != NULL) {
+                size_t len = strlen(cpus);
+                cur->cpus = (char *)malloc(len + 1);
+                memcpy(cur->cpus, cpus, len + 1);
+            }
+            return 0;
+        }
+
+        cur = cur->next;
+    }
+
+    return -1;
+}
+
+/*
+ * gets the CPU list job is pinned to, given job's JID
+ * returns NULL if the job is not pinned or not found
+ */
+const char *get_job_cpus(job_list_t *job_list, int jid) {
+    if (job_list == NULL) {
+        return NULL;
+    }
+
+    job_element_t *cur = job_list->head;
+    while (cur != NULL) {
+        if (cur->jid == jid) {
+            return cur->cpus;
+        }
+
+        cur = cur->next;
+    }
+
+    return NULL;
+}
+
+/*
+ * sets job's deadline, given job's JID; NULL clears it
+ * returns 0 on success, -1 on failure
+ */
+int set_job_timeout(job_list_t *job_list, int jid,
+                    const job_timeout_t *timeout) {
+    if (job_list == NULL) {
+        return -1;
+    }
+
+    job_element_t *cur = job_list->head;
+    while (cur != NULL) {
+        if (cur->jid == jid) {
+            if (timeout != NULL) {
+                cur->timeout = *timeout;
+            } else {
+                cur->timeout.duration_ms = 0;
+            }
+            return 0;
+        }
+
+        cur = cur->next;
+    }
+
+    return -1;
+}
+
+/*
+ * gets job's deadline into timeout, given job's JID
+ * returns 0 on success, -1 if the job has no deadline or is not found
+ */
+int get_job_timeout(job_list_t *job_list, int jid, job_timeout_t *timeout) {
+    if (job_list == NULL) {
+        return -1;
+    }
+
+    job_element_t *cur = job_list->head;
+    while (cur != NULL) {
+        if (cur->jid == jid) {
+            if (cur->timeout.duration_ms == 0) {
+                return -1;
+            }
+            *timeout = cur->timeout;
+            return 0;
+        }
+
+        cur = cur->next;
+    }
+
+    return -1;
+}
+
+/*
+ * sets job's restart policy and history, given job's JID; NULL makes the job
+ * unsupervised
+ * returns 0 on success, -1 on failure
+ */
+int set_job_supervise(job_list_t *job_list, int jid,
+                      const job_supervise_t *supervise) {
+    if (job_list == NULL) {
+        return -1;
+    }
+
+    job_element_t *cur = job_list->head;
+    while (cur != NULL) {
+        if (cur->jid == jid) {
+            cur->supervised = supervise != NULL;
+            if (supervise != NULL) {
+                cur->supervise = *supervise;
+            }
+            return 0;
+        }
+
+        cur = cur->next;
+    }
+
+    return -1;
+}
+
+/*
+ * gets job's restart policy and history into supervise, given job's JID
+ * returns 0 on success, -1 if the job is not supervised or not found
+ */
+int get_job_supervise(job_list_t *job_list, int jid,
+                      job_supervise_t *supervise) {
+    if (job_list == NULL) {
+        return -1;
+    }
+
+    job_element_t *cur = job_list->head;
+    while (cur != NULL) {
+        if (cur->jid == jid) {
+            if (!cur->supervised) {
+                return -1;
+            }
+            *supervise = cur->supervise;
+            return 0;
+        }
+
+        cur = cur->next;
+    }
+
+    return -1;
+}
+
+/* returns 1 if job element is queued and may be started */
+static int startable(job_element_t *job) {
+    return job->state == QUEUED && !(job->supervised && job->supervise.waiting);
+}
+
+/*
+ * gets JID of the queued job that should start next: the one with the lowest
+ * priority value, and of those the one added first (jobs waiting to be
+ * restarted are skipped)
+ * returns JID on success, -1 if no job is queued
+ */
+int get_next_queued(job_list_t *job_list) {
+    if (job_list == NULL) {
+        return -1;
+    }
+
+    job_element_t *best = NULL;
+    job_element_t *cur = job_list->head;
+    while (cur != NULL) {
+        // strictly lower, so ties go to the job added first
+        if (startable(cur) &&
+            (best == NULL || cur->priority < best->priority)) {
+            best = cur;
+        }
+
+        cur = cur->next;
+    }
+
+    return best != NULL ? best->jid : -1;
+}
+
+/* gets position of queued job element in the queue (1 starts next) */
+static int queue_position(job_list_t *job_list, job_element_t *job) {
+    // count the queued jobs that start before this one
+    int position = 1;
+    int before_job = 1;
+    job_element_t *cur = job_list->head;
+    while (cur != NULL) {
+        if (cur == job) {
+            before_job = 0;
+        } else if (startable(cur) &&
+                   (cur->priority < job->priority ||
+                    (cur->priority == job->priority && before_job))) {
+            position++;
+        }
+
+        cur = cur->next;
+    }
+
+    return position;
+}
+
+/*
+ * gets position of a queued job in the queue (1 starts next), given job's
+ * JID, returns position on success, -1 if the job is not queued
+ */
+int get_queue_position(job_list_t *job_list, int jid) {
+    if (job_list == NULL) {
+        return -1;
+    }
+
+    job_element_t *cur = job_list->head;
+    while (cur != NULL) {
+        if (cur->jid == jid) {
+            return startable(cur) ? queue_position(job_list, cur) : -1;
+        }
+
+        cur = cur->next;
+    }
+
+    return -1;
+}
+
+/* returns the number of jobs in the given state, not counting hidden jobs */
+int count_jobs(job_list_t *job_list, process_state_t state) {
+    if (job_list == NULL) {
+        return 0;
+    }
+
+    int count = 0;
+    job_element_t *cur = job_list->head;
+    while (cur != NULL) {
+        if (cur->state == state && !cur->hidden) {
+            count++;
+        }
+
+        cur = cur->next;
+    }
+
+    return count;
+}
+
+/* returns the number of supervised jobs */
+int count_supervised(job_list_t *job_list) {
+    if (job_list == NULL) {
+        return 0;
+    }
+
+    int count = 0;
+    job_element_t *cur = job_list->head;
+    while (cur != NULL) {
+        count += cur->supervised;
+        cur = cur->next;
+    }
+
+    return count;
+}
+
 /*
  * gets next PID in list
  * call this in a loop to get the PID of the next job in the list
  * returns the PID if there is one, -1 if the end of the list has been reached,
  * after which it will start at the head of the list again
+ * queued jobs have no process and are skipped
  */
 pid_t get_next_pid(job_list_t *job_list) {  // circular iterator
     if (job_list == NULL) {
         return -1;
     }
 
+    while (job_list->current != NULL && job_list->current->state == QUEUED) {
+        job_list->current = job_list->current->next;
+    }
+
     if (job_list->current == NULL) {
         job_list->current = job_list->head;
         return -1;
@@ -277,17 +678,52 @@ pid_t get_next_pid(job_list_t *job_list) {  // circular iterator
     }
 }
 
-/* jobs command, prints out the jobs list */
-void jobs(job_list_t *job_list) {
+/*
+ * prints the jobs list, with each job's priority, CPUs, deadline and restart
+ * count if long_format
+ */
+static void print_jobs(job_list_t *job_list, int long_format) {
     if (job_list == NULL) {
         return;
     }
 
     job_element_t *cur = job_list->head;
     while (cur != NULL) {
-        char *state_string = cur->state == RUNNING ? "Running" : "Stopped";
-        if (printf("[%d] (%d) %s %s\n", cur->jid, cur->pid, state_string,
-                   cur->command) < 0) {
+        if (cur->hidden) {
+            cur = cur->next;
+            continue;
+        }
+        int printed;
+        if (cur->state == QUEUED && !startable(cur)) {
+            printed = printf("[%d] (-) Restarting %s", cur->jid, cur->command);
+        } else if (cur->state == QUEUED) {
+            printed = printf("[%d] (-) Queued #%d %s", cur->jid,
+                             queue_position(job_list, cur), cur->command);
+        } else {
+            char *state_string = cur->state == RUNNING ? "Running" : "Stopped";
+            printed = printf("[%d] (%d) %s %s", cur->jid, cur->pid,
+                             state_string, cur->command);
+        }
+        if (printed >= 0 && long_format) {
+            printed = printf(" nice=%d", cur->priority);
+            if (printed >= 0 && cur->cpus != NULL) {
+                printed = printf(" cpus=%s", cur->cpus);
+            }
+            if (printed >= 0 && cur->timeout.duration_ms != 0) {
+                printed = printf(" timeout=%ldms", cur->timeout.duration_ms);
+            }
+            if (printed >= 0 && cur->supervised) {
+                printed = printf(" restarts=%d", cur->supervise.restarts);
+                if (printed >= 0 && cur->supervise.max_restarts >= 0) {
+                    printed = printf("/%d", cur->supervise.max_restarts);
+                }
+                if (printed >= 0 &&
+                    cur->supervise.crashes >= CRASH_LOOP_CRASHES) {
+                    printed = printf(" crash-loop");
+                }
+            }
+        }
+        if (printed < 0 || printf("\n") < 0) {
             fprintf(stderr, "error printing jobs list\n");
             cleanup_job_list(job_list);
             exit(1);
@@ -295,3 +731,12 @@ void jobs(job_list_t *job_list) {
         cur = cur->next;
     }
 }
+
+/* jobs command, prints out the jobs list */
+void jobs(job_list_t *job_list) { print_jobs(job_list, 0); }
+
+/*
+ * jobs -l command, prints out the jobs list with priorities, CPUs, deadlines
+ * and restart counts
+ */
+void jobs_long(job_list_t *job_list) { print_jobs(job_list, 1); }
@@ -1,13 +1,48 @@
 #ifndef JOBS_H_
 #define JOBS_H_
 
+#include <stdint.h>
 #include <sys/types.h>
 #include <unistd.h>
 
-typedef enum { RUNNING, STOPPED } process_state_t;
+/*
+ * QUEUED jobs are waiting for the scheduler to start them: they have no
+ * process yet, so their PID is 0 until set_job_pid() is called
+ */
+typedef enum { RUNNING, STOPPED, QUEUED } process_state_t;
 
 typedef struct job_list job_list_t;
 
+/*
+ * a job's deadline: signal is sent to the job's process group duration_ms
+ * after the job starts, then SIGKILL kill_after_ms after that (never if
+ * kill_after_ms is 0)
+ */
+struct job_timeout {
+    long duration_ms;
+    int signal;
+    long kill_after_ms;
+};
+typedef struct job_timeout job_timeout_t;
+
+/*
+ * a supervised job's restart policy and history: the job is restarted under
+ * the same JID when it exits abnormally, until it has been restarted
+ * max_restarts times; while it waits out its backoff it is QUEUED and
+ * waiting, and is not started by the scheduler
+ */
+struct job_supervise {
+    int max_restarts;     // -1 for no limit
+    long backoff_ms;      // delay before the second restart in a row
+    int restarts;         // times the job has been restarted
+    int crashes;          // abnormal exits in a row, each soon after a start
+    int waiting;          // 1 while a restart is waiting out its backoff
+    uint64_t started_ns;  // CLOCK_MONOTONIC time the job last started
+};
+typedef struct job_supervise job_supervise_t;
+
+#define CRASH_LOOP_CRASHES 5  // crashes in a row that make a crash loop
+
 /* initializes job list, returns pointer */
 job_list_t *init_job_list();
 /*
@@ -28,6 +63,9 @@ int remove_job_jid(job_list_t *job_list, int jid);
         returns 0 on success, -1 on failure */
 int remove_job_pid(job_list_t *job_list, pid_t pid);
 
+/* sets job's PID, given job's JID, returns 0 on success, -1 on failure */
+int set_job_pid(job_list_t *job_list, int jid, pid_t pid);
+
 /* updates job's state, given job's JID, returns 0 on success, -1 on failure */
 int update_job_jid(job_list_t *job_list, int jid, process_state_t state);
 /* updates job's state, given job's PID, returns 0 on success, -1 on failure */
@@ -37,16 +75,99 @@ int update_job_pid(job_list_t *job_list, pid_t pid, process_state_t state);
 pid_t get_job_pid(job_list_t *job_list, int jid);
 /* gets JID of job, given job's PID, returns JID on success, -1 on failure */
 int get_job_jid(job_list_t *job_list, pid_t pid);
+/* gets job's state, given job's JID, returns the state, -1 on failure */
+int get_job_state(job_list_t *job_list, int jid);
+
+/*
+ * marks job as hidden (or not), given job's PID
+ * hidden jobs are helper processes (e.g. process substitutions): they are not
+ * printed by jobs and are reaped silently
+ * returns 0 on success, -1 on failure
+ */
+int set_job_hidden(job_list_t *job_list, pid_t pid, int hidden);
+/* returns 1 if job is hidden, 0 if not, -1 on failure, given job's PID */
+int get_job_hidden(job_list_t *job_list, pid_t pid);
+
+/*
+ * sets job's priority (a nice value: lower starts sooner), given job's JID
+ * jobs are added with priority 0
+ * returns 0 on success, -1 on failure
+ */
+int set_job_priority(job_list_t *job_list, int jid, int priority);
+/* gets job's priority, given job's JID, returns 0 if the job is not found */
+int get_job_priority(job_list_t *job_list, int jid);
+
+/*
+ * records the CPU list (e.g. "0-3,8") job is pinned to, given job's JID
+ * NULL clears it
+ * returns 0 on success, -1 on failure
+ */
+int set_job_cpus(job_list_t *job_list, int jid, const char *cpus);
+/*
+ * gets the CPU list job is pinned to, given job's JID
+ * returns NULL if the job is not pinned or not found
+ */
+const char *get_job_cpus(job_list_t *job_list, int jid);
+
+/*
+ * sets job's deadline, given job's JID; NULL clears it
+ * returns 0 on success, -1 on failure
+ */
+int set_job_timeout(job_list_t *job_list, int jid,
+                    const job_timeout_t *timeout);
+/*
+ * gets job's deadline into timeout, given job's JID
+ * returns 0 on success, -1 if the job has no deadline or is not found
+ */
+int get_job_timeout(job_list_t *job_list, int jid, job_timeout_t *timeout);
+
+/*
+ * sets job's restart policy and history, given job's JID; NULL makes the job
+ * unsupervised
+ * returns 0 on success, -1 on failure
+ */
+int set_job_supervise(job_list_t *job_list, int jid,
+                      const job_supervise_t *supervise);
+/*
+ * gets job's restart policy and history into supervise, given job's JID
+ * returns 0 on success, -1 if the job is not supervised or not found
+ */
+int get_job_supervise(job_list_t *job_list, int jid,
+                      job_supervise_t *supervise);
+
+/*
+ * gets JID of the queued job that should start next: the one with the lowest
+ * priority value, and of those the one added first (jobs waiting to be
+ * restarted are skipped)
+ * returns JID on success, -1 if no job is queued
+ */
+int get_next_queued(job_list_t *job_list);
+/*
+ * gets position of a queued job in the queue (1 starts next), given job's
+ * JID, returns position on success, -1 if the job is not queued
+ */
+int get_queue_position(job_list_t *job_list, int jid);
+
+/* returns the number of jobs in the given state, not counting hidden jobs */
+int count_jobs(job_list_t *job_list, process_state_t state);
+/* returns the number of supervised jobs */
+int count_supervised(job_list_t *job_list);
 
 /*
  * gets next PID in list
  * call this in a loop to get the PID of the next job in the list
  * returns the PID if there is one, -1 if the end of the list has been reached,
  * after which it will start at the head of the list again
+ * queued jobs have no process and are skipped
  */
 pid_t get_next_pid(job_list_t *job_list);
 
 /* jobs command, prints out the jobs list */
 void jobs(job_list_t *job_list);
+/*
+ * jobs -l command, prints out the jobs list with priorities, CPUs, deadlines
+ * and restart counts
+ */
+void jobs_long(job_list_t *job_list);
 
 #endif  // JOBS_H_
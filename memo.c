@@ -0,0 +1,326 @@
+#define _GNU_SOURCE  // copy_file_range
+#include "./memo.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define READ_SIZE 65536  // bytes of a file hashed or copied at a time
+
+static const uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+
+static uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+/* murmur3's finalizer, so every input bit affects every output bit */
+static uint64_t fmix(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xFF51AFD7ED558CCDULL;
+    k ^= k >> 33;
+    k *= 0xC4CEB9FE1A85EC53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+static void fold(memo_hash_t *hash, uint64_t word) {
+    hash->a = rotl(hash->a ^ word * PRIME2, 31) * PRIME1;
+    hash->b = rotl(hash->b ^ word * PRIME1, 29) * PRIME2 + hash->a;
+}
+
+void memo_hash_init(memo_hash_t *hash) {
+    hash->a = PRIME1;
+    hash->b = PRIME2;
+    hash->len = 0;
+}
+
+void memo_hash_update(memo_hash_t *hash, const void *data, size_t len) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    size_t pending = hash->len % 8;
+    hash->len += len;
+    if (pending > 0) {
+        size_t take = 8 - pending < len ? 8 - pending : len;
+        memcpy(&hash->tail[pending], bytes, take);
+        bytes += take;
+        len -= take;
+        if (pending + take < 8) {
+            return;
+        }
+        uint64_t word;
+        memcpy(&word, hash->tail, 8);
+        fold(hash, word);
+    }
+    for (; len >= 8; bytes += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, 8);
+        fold(hash, word);
+    }
+    memcpy(hash->tail, bytes, len);
+}
+
+/* writes the hash of everything added as 32 hex digits */
+void memo_hash_hex(const memo_hash_t *hash, char hex[MEMO_HEX_SIZE]) {
+    memo_hash_t h = *hash;
+    uint64_t word = 0;
+    memcpy(&word, h.tail, h.len % 8);
+    fold(&h, word ^ h.len);
+    uint64_t a = fmix(h.a + h.b);
+    uint64_t b = fmix(h.b ^ a);
+    snprintf(hex, MEMO_HEX_SIZE, "%016llx%016llx", (unsigned long long)a,
+             (unsigned long long)b);
+}
+
+/* adds a tagged, length-prefixed string, so fields can't run together */
+static void add_field(memo_hash_t *hash, char tag, const char *value) {
+    uint64_t len = strlen(value);
+    memo_hash_update(hash, &tag, 1);
+    memo_hash_update(hash, &len, sizeof(len));
+    memo_hash_update(hash, value, len);
+}
+
+/* adds the parts of st that change when a file is replaced or modified */
+static void add_stat(memo_hash_t *hash, const struct stat *st) {
+    uint64_t parts[5] = {(uint64_t)st->st_size, (uint64_t)st->st_mtim.tv_sec,
+                         (uint64_t)st->st_mtim.tv_nsec, (uint64_t)st->st_ino,
+                         (uint64_t)st->st_dev};
+    memo_hash_update(hash, parts, sizeof(parts));
+}
+
+/* hashes the content of fd from offset 0, returns 0 on success */
+static int hash_file(int fd, char hex[MEMO_HEX_SIZE]) {
+    char *buf = (char *)malloc(READ_SIZE);
+    if (buf == NULL) {
+        return -1;
+    }
+    memo_hash_t hash;
+    memo_hash_init(&hash);
+    off_t off = 0;
+    ssize_t got;
+    while ((got = pread(fd, buf, READ_SIZE, off)) > 0) {
+        memo_hash_update(&hash, buf, (size_t)got);
+        off += got;
+    }
+    free(buf);
+    if (got < 0) {
+        return -1;
+    }
+    memo_hash_hex(&hash, hex);
+    return 0;
+}
+
+/*
+ * computes the cache key of running argv[0] with argv, given the values of
+ * the environment variables env_names and the input files inputs (hashed by
+ * content, or by size and mtime if by_mtime is set)
+ * returns 0 on success, -1 with an error printed if the executable or an
+ * input can't be read
+ */
+int memo_key(char *const argv[], int argc, char *const env_names[],
+             int env_num, char *const inputs[], int input_num, int by_mtime,
+             char key[MEMO_HEX_SIZE]) {
+    memo_hash_t hash;
+    memo_hash_init(&hash);
+    add_field(&hash, 'v', "psh memo 1");
+    for (int i = 0; i < argc; i++) {
+        add_field(&hash, 'a', argv[i]);
+    }
+
+    // a rebuilt or upgraded command may write something else
+    struct stat st;
+    if (stat(argv[0], &st) < 0) {
+        fprintf(stderr, "memo: %s: %s\n", argv[0], strerror(errno));
+        return -1;
+    }
+    add_stat(&hash, &st);
+
+    for (int i = 0; i < env_num; i++) {
+        char *value = getenv(env_names[i]);
+        add_field(&hash, value != NULL ? 'e' : 'u', env_names[i]);
+        if (value != NULL) {
+            add_field(&hash, '=', value);
+        }
+    }
+
+    for (int i = 0; i < input_num; i++) {
+        add_field(&hash, 'i', inputs[i]);
+        int fd = open(inputs[i], O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            fprintf(stderr, "memo: %s: %s\n", inputs[i], strerror(errno));
+            if (fd >= 0) {
+                close(fd);
+            }
+            return -1;
+        }
+        if (by_mtime) {
+            add_stat(&hash, &st);
+        } else {
+            char content[MEMO_HEX_SIZE];
+            if (hash_file(fd, content) < 0) {
+                fprintf(stderr, "memo: %s: can't read\n", inputs[i]);
+                close(fd);
+                return -1;
+            }
+            add_field(&hash, 'c', content);
+        }
+        close(fd);
+    }
+
+    memo_hash_hex(&hash, key);
+    return 0;
+}
+
+/* returns an fd for the cached output of key in dir, or -1 on a miss */
+int memo_lookup(const char *dir, const char *key) {
+    char path[4096];
+    if (snprintf(path, sizeof(path), "%s/keys/%s", dir, key) >=
+        (int)sizeof(path)) {
+        return -1;
+    }
+    return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+/* makes path and any missing parents, like mkdir -p */
+static int make_dirs(char *path) {
+    for (char *slash = strchr(&path[1], '/'); slash != NULL;
+         slash = strchr(&slash[1], '/')) {
+        *slash = '\0';
+        int failed = mkdir(path, 0755) < 0 && errno != EEXIST;
+        *slash = '/';
+        if (failed) {
+            return -1;
+        }
+    }
+    return mkdir(path, 0755) < 0 && errno != EEXIST ? -1 : 0;
+}
+
+/*
+ * creates dir if needed and an empty temporary file in it for a command's
+ * output, writing its path into tmp
+ * returns 0 on success, -1 with an error printed on failure
+ */
+int memo_begin(const char *dir, char *tmp, size_t size) {
+    char path[4096];
+    const char *subdirs[] = {"objects", "keys"};
+    for (int i = 0; i < 2; i++) {
+        if (snprintf(path, sizeof(path), "%s/%s", dir, subdirs[i]) >=
+                (int)sizeof(path) ||
+            make_dirs(path) < 0) {
+            fprintf(stderr, "memo: can't create %s: %s\n", path,
+                    strerror(errno));
+            return -1;
+        }
+    }
+
+    if (snprintf(tmp, size, "%s/objects/.tmp.XXXXXX", dir) >= (int)size) {
+        fprintf(stderr, "memo: %s: path too long\n", dir);
+        return -1;
+    }
+    int fd = mkstemp(tmp);
+    if (fd < 0) {
+        fprintf(stderr, "memo: %s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/*
+ * moves the output in tmp (made by memo_begin()) into dir's objects and
+ * points key at it; tmp is gone either way
+ * returns 0 on success, -1 with an error printed on failure
+ */
+int memo_store(const char *dir, const char *key, const char *tmp) {
+    char content[MEMO_HEX_SIZE];
+    int fd = open(tmp, O_RDONLY | O_CLOEXEC);
+    int hashed = fd >= 0 && hash_file(fd, content) == 0;
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (!hashed) {
+        fprintf(stderr, "memo: can't read %s\n", tmp);
+        unlink(tmp);
+        return -1;
+    }
+
+    // same content, same name: replacing an object changes nothing
+    char object[4096];
+    char link_tmp[4096];
+    char link_path[4096];
+    snprintf(object, sizeof(object), "%s/objects/%s", dir, content);
+    snprintf(link_tmp, sizeof(link_tmp), "%s/keys/.%s.%d", dir, key,
+             (int)getpid());
+    snprintf(link_path, sizeof(link_path), "%s/keys/%s", dir, key);
+    if (rename(tmp, object) < 0) {
+        fprintf(stderr, "memo: %s: %s\n", object, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    unlink(link_tmp);  // left over from a shell that died mid-store
+    if (link(object, link_tmp) < 0 || rename(link_tmp, link_path) < 0) {
+        fprintf(stderr, "memo: %s: %s\n", link_path, strerror(errno));
+        unlink(link_tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * copies everything in the regular file from to to, sharing extents (FICLONE)
+ * if to is an empty file on a filesystem that can, else with
+ * copy_file_range(), sendfile() or read()/write(), whichever works first
+ * returns 0 on success, -1 on failure
+ */
+int memo_serve(int from, int to) {
+    struct stat from_st;
+    struct stat to_st;
+    if (fstat(from, &from_st) < 0 || fstat(to, &to_st) < 0) {
+        return -1;
+    }
+    if (S_ISREG(to_st.st_mode) && to_st.st_size == 0 &&
+        ioctl(to, FICLONE, from) == 0) {
+        // FICLONE leaves to's offset alone; later writes go after the output
+        return lseek(to, 0, SEEK_END) < 0 ? -1 : 0;
+    }
+
+    off_t off = 0;
+    off_t size = from_st.st_size;
+    while (off < size) {
+        ssize_t copied =
+            copy_file_range(from, &off, to, NULL, (size_t)(size - off), 0);
+        if (copied <= 0) {
+            break;
+        }
+    }
+    while (off < size) {
+        ssize_t copied = sendfile(to, from, &off, (size_t)(size - off));
+        if (copied <= 0) {
+            break;
+        }
+    }
+
+    char *buf = off < size ? (char *)malloc(READ_SIZE) : NULL;
+    while (off < size && buf != NULL) {
+        ssize_t got = pread(from, buf, READ_SIZE, off);
+        if (got <= 0) {
+            break;
+        }
+        for (ssize_t done = 0; done < got;) {
+            ssize_t written = write(to, &buf[done], (size_t)(got - done));
+            if (written < 0 && errno != EINTR) {
+                free(buf);
+                return -1;
+            }
+            done += written > 0 ? written : 0;
+        }
+        off += got;
+    }
+    free(buf);
+    return off < size ? -1 : 0;
+}
@@ -0,0 +1,72 @@
+#ifndef MEMO_H_
+#define MEMO_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Result cache for the memo builtin. A cache directory holds
+ *   objects/HASH   a command's stdout, named by the hash of its content
+ *   keys/KEY       a hard link to the object a command with that key wrote
+ * KEY hashes the command's argv, the identity (size, mtime, inode) of the
+ * executable, the values of the environment variables named with -e, and
+ * the content (or with -m, the size and mtime) of each input file. Results
+ * are written to a temporary file in objects/ and renamed into place, so a
+ * reader never sees a partial object, and keys/KEY is replaced the same way.
+ * Hashes are 128-bit and not cryptographic: the cache guards against stale
+ * results, not against someone crafting collisions.
+ */
+
+#define MEMO_HEX_SIZE 33  // 32 hex digits and a NUL
+
+/* incremental 128-bit hash of a byte stream */
+struct memo_hash {
+    uint64_t a;
+    uint64_t b;
+    uint64_t len;           // bytes hashed so far
+    unsigned char tail[8];  // bytes not yet folded in, len % 8 of them
+};
+typedef struct memo_hash memo_hash_t;
+
+void memo_hash_init(memo_hash_t *hash);
+void memo_hash_update(memo_hash_t *hash, const void *data, size_t len);
+/* writes the hash of everything added as 32 hex digits */
+void memo_hash_hex(const memo_hash_t *hash, char hex[MEMO_HEX_SIZE]);
+
+/*
+ * computes the cache key of running argv[0] with argv, given the values of
+ * the environment variables env_names and the input files inputs (hashed by
+ * content, or by size and mtime if by_mtime is set)
+ * returns 0 on success, -1 with an error printed if the executable or an
+ * input can't be read
+ */
+int memo_key(char *const argv[], int argc, char *const env_names[],
+             int env_num, char *const inputs[], int input_num, int by_mtime,
+             char key[MEMO_HEX_SIZE]);
+
+/* returns an fd for the cached output of key in dir, or -1 on a miss */
+int memo_lookup(const char *dir, const char *key);
+
+/*
+ * creates dir if needed and an empty temporary file in it for a command's
+ * output, writing its path into tmp
+ * returns 0 on success, -1 with an error printed on failure
+ */
+int memo_begin(const char *dir, char *tmp, size_t size);
+
+/*
+ * moves the output in tmp (made by memo_begin()) into dir's objects and
+ * points key at it; tmp is gone either way
+ * returns 0 on success, -1 with an error printed on failure
+ */
+int memo_store(const char *dir, const char *key, const char *tmp);
+
+/*
+ * copies everything in the regular file from to to, sharing extents (FICLONE)
+ * if to is an empty file on a filesystem that can, else with
+ * copy_file_range(), sendfile() or read()/write(), whichever works first
+ * returns 0 on success, -1 on failure
+ */
+int memo_serve(int from, int to);
+
+#endif  // MEMO_H_
@@ -0,0 +1,273 @@
+#define _GNU_SOURCE  // pipe2
+#include "./perfstat.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 8
+
+struct event_spec {
+    uint32_t type;
+    uint64_t config;
+};
+typedef struct event_spec event_spec_t;
+
+// the first event of each group leads it
+static const event_spec_t hw_events[] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK}};
+enum { HW_CYCLES, HW_INSTR, HW_CACHE_REFS, HW_CACHE_MISSES, HW_BRANCHES,
+       HW_BRANCH_MISSES, HW_CSW, HW_TASK_CLOCK, HW_NUM };
+
+static const event_spec_t sw_events[] = {
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS}};
+enum { SW_TASK_CLOCK, SW_CSW, SW_MIGRATIONS, SW_FAULTS, SW_NUM };
+
+/* the counters open on one job */
+struct counter_group {
+    pid_t pid;
+    int hardware;    // 1 if fds follow hw_events, 0 if sw_events
+    int user_only;   // 1 if kernel time is excluded
+    int fds[MAX_EVENTS];
+    int fd_num;
+};
+typedef struct counter_group counter_group_t;
+
+static int enabled;
+static counter_group_t *groups;
+static int group_num;
+static int group_cap;
+static int warned;  // the counters were unavailable and we said so
+
+/* returns 1 if every job is counted (perfstat on), 0 if not */
+int perfstat_enabled(void) {
+    return enabled;
+}
+
+/* counts every job from now on if on is 1, only perfstat cmd if 0 */
+void perfstat_set_enabled(int on) {
+    enabled = on;
+}
+
+/*
+ * readies sync for a job that is about to be forked: makes the pipe if
+ * count is set, else sets its fds to -1
+ * returns 0 on success, -1 if the job can't be counted
+ */
+int perfstat_begin(perfstat_sync_t *sync, int count) {
+    sync->fds[0] = -1;
+    sync->fds[1] = -1;
+    if (count && pipe2(sync->fds, O_CLOEXEC) < 0) {
+        perror("perfstat: pipe");
+        sync->fds[0] = -1;
+        sync->fds[1] = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/* in the child: waits until the parent has opened the counters */
+void perfstat_child_wait(perfstat_sync_t *sync) {
+    if (sync->fds[0] < 0) {
+        return;
+    }
+    // with our copy of the write end closed, a parent that gives up is EOF
+    close(sync->fds[1]);
+    char go;
+    while (read(sync->fds[0], &go, 1) < 0 && errno == EINTR) {
+    }
+    close(sync->fds[0]);
+}
+
+/*
+ * opens specs as one group on pid, enabled when pid execs and inherited by
+ * its children
+ * returns the number of fds opened into fds, or -1 with errno set
+ */
+static int open_group(pid_t pid, const event_spec_t *specs, int spec_num,
+                      int user_only, int *fds) {
+    for (int i = 0; i < spec_num; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = specs[i].type;
+        attr.config = specs[i].config;
+        attr.read_format =
+            PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.disabled = i == 0;  // members follow the leader
+        attr.enable_on_exec = i == 0;
+        attr.inherit = 1;
+        if (user_only) {
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+        }
+        long fd = syscall(SYS_perf_event_open, &attr, pid, -1,
+                          i == 0 ? -1 : fds[0], PERF_FLAG_FD_CLOEXEC);
+        if (fd < 0) {
+            int err = errno;
+            for (int j = 0; j < i; j++) {
+                close(fds[j]);
+            }
+            errno = err;
+            return -1;
+        }
+        fds[i] = (int)fd;
+    }
+    return spec_num;
+}
+
+/*
+ * in the parent: opens the counters on pid (or does nothing if the fork
+ * failed, pid < 0) and lets the child go on; sync is reset either way
+ */
+void perfstat_attach(perfstat_sync_t *sync, pid_t pid) {
+    if (sync->fds[0] < 0) {
+        return;
+    }
+    close(sync->fds[0]);
+
+    counter_group_t group = {pid, 1, 0, {0}, -1};
+    // hardware, then hardware counting user space only (allowed at
+    // perf_event_paranoid 2), then the same for software
+    for (int attempt = 0; pid > 0 && attempt < 4 && group.fd_num < 0;
+         attempt++) {
+        group.hardware = attempt < 2;
+        group.user_only = attempt % 2;
+        group.fd_num = group.hardware
+                           ? open_group(pid, hw_events, HW_NUM,
+                                        group.user_only, group.fds)
+                           : open_group(pid, sw_events, SW_NUM,
+                                        group.user_only, group.fds);
+    }
+    if (pid > 0 && group.fd_num < 0 && !warned) {
+        fprintf(stderr, "perfstat: counters unavailable: %s\n",
+                strerror(errno));
+        warned = 1;
+    }
+    if (group.fd_num > 0) {
+        if (group_num == group_cap) {
+            int cap = group_cap > 0 ? group_cap * 2 : 16;
+            counter_group_t *grown = (counter_group_t *)realloc(
+                groups, (size_t)cap * sizeof(counter_group_t));
+            if (grown != NULL) {
+                groups = grown;
+                group_cap = cap;
+            }
+        }
+        if (group_num < group_cap) {
+            groups[group_num++] = group;
+        } else {
+            for (int i = 0; i < group.fd_num; i++) {
+                close(group.fds[i]);
+            }
+        }
+    }
+
+    // let the child exec
+    if (write(sync->fds[1], "", 1) < 0) {
+        perror("perfstat: write");
+    }
+    close(sync->fds[1]);
+    sync->fds[0] = -1;
+    sync->fds[1] = -1;
+}
+
+/*
+ * reads fd's count, scaled up if the group was multiplexed off the PMU for
+ * part of the time
+ */
+static uint64_t read_count(int fd, int *multiplexed) {
+    uint64_t values[3];  // value, time enabled, time running
+    if (read(fd, values, sizeof(values)) != (ssize_t)sizeof(values) ||
+        values[2] == 0) {
+        return 0;
+    }
+    if (values[2] < values[1]) {
+        *multiplexed = 1;
+        return (uint64_t)((double)values[0] * (double)values[1] /
+                          (double)values[2]);
+    }
+    return values[0];
+}
+
+static double percent(uint64_t part, uint64_t whole) {
+    return whole > 0 ? 100.0 * (double)part / (double)whole : 0.0;
+}
+
+/*
+ * prints the counts of pid, a counted job that has been reaped, and closes
+ * its counters; jid may be 0 for a foreground command
+ * does nothing if pid isn't counted
+ */
+void perfstat_report(int jid, pid_t pid) {
+    int g = 0;
+    while (g < group_num && groups[g].pid != pid) {
+        g++;
+    }
+    if (g == group_num) {
+        return;
+    }
+    counter_group_t *group = &groups[g];
+
+    uint64_t counts[MAX_EVENTS];
+    int multiplexed = 0;
+    for (int i = 0; i < group->fd_num; i++) {
+        counts[i] = read_count(group->fds[i], &multiplexed);
+        close(group->fds[i]);
+    }
+
+    char prefix[32] = "";
+    if (jid > 0) {
+        snprintf(prefix, sizeof(prefix), "[%d] ", jid);
+    }
+    const char *notes = group->user_only
+                            ? (multiplexed ? " (user only, multiplexed)"
+                                           : " (user only)")
+                            : (multiplexed ? " (multiplexed)" : "");
+    int printed;
+    if (group->hardware) {
+        printed = printf(
+            "%s(%d) perf: %llu cycles, %llu instructions, %.2f IPC, "
+            "cache misses %llu (%.2f%%), branch misses %llu (%.2f%%), "
+            "%llu context switches, %.3f ms CPU%s\n",
+            prefix, pid, (unsigned long long)counts[HW_CYCLES],
+            (unsigned long long)counts[HW_INSTR],
+            counts[HW_CYCLES] > 0
+                ? (double)counts[HW_INSTR] / (double)counts[HW_CYCLES]
+                : 0.0,
+            (unsigned long long)counts[HW_CACHE_MISSES],
+            percent(counts[HW_CACHE_MISSES], counts[HW_CACHE_REFS]),
+            (unsigned long long)counts[HW_BRANCH_MISSES],
+            percent(counts[HW_BRANCH_MISSES], counts[HW_BRANCHES]),
+            (unsigned long long)counts[HW_CSW],
+            (double)counts[HW_TASK_CLOCK] / 1e6, notes);
+    } else {
+        printed = printf(
+            "%s(%d) perf (software counters): %.3f ms CPU, "
+            "%llu context switches, %llu CPU migrations, %llu page faults%s\n",
+            prefix, pid, (double)counts[SW_TASK_CLOCK] / 1e6,
+            (unsigned long long)counts[SW_CSW],
+            (unsigned long long)counts[SW_MIGRATIONS],
+            (unsigned long long)counts[SW_FAULTS], notes);
+    }
+    if (printed < 0) {
+        fprintf(stderr, "Error printing");
+    }
+
+    groups[g] = groups[--group_num];
+}
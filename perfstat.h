@@ -0,0 +1,58 @@
+#ifndef PERFSTAT_H_
+#define PERFSTAT_H_
+
+#include <sys/types.h>
+
+/*
+ * Performance counters for jobs (perfstat cmd, or perfstat on for every
+ * job). Before a counted job execs, the shell opens a perf_event_open group
+ * on it: cycles, instructions, cache references and misses, branches and
+ * branch misses, plus context switches and task clock. The group is enabled
+ * on exec and inherited by the job's children, so the counts cover the whole
+ * command and none of the shell's work around it. If the hardware PMU can't
+ * be used (no PMU, as in many VMs, or a restrictive perf_event_paranoid),
+ * a software group is opened instead: task clock, context switches, CPU
+ * migrations and page faults. When the job is reaped its counts are printed,
+ * with IPC and miss rates for hardware counters.
+ *
+ * To open the group before the job execs, the child waits on a pipe:
+ *   perfstat_begin(&sync, count);  // before fork
+ *   perfstat_child_wait(&sync);    // in the child, before execv
+ *   perfstat_attach(&sync, pid);   // in the parent, after fork
+ */
+
+struct perfstat_sync {
+    int fds[2];  // pipe the child waits on, -1 if the job isn't counted
+};
+typedef struct perfstat_sync perfstat_sync_t;
+
+/* returns 1 if every job is counted (perfstat on), 0 if not */
+int perfstat_enabled(void);
+
+/* counts every job from now on if on is 1, only perfstat cmd if 0 */
+void perfstat_set_enabled(int on);
+
+/*
+ * readies sync for a job that is about to be forked: makes the pipe if
+ * count is set, else sets its fds to -1
+ * returns 0 on success, -1 if the job can't be counted
+ */
+int perfstat_begin(perfstat_sync_t *sync, int count);
+
+/* in the child: waits until the parent has opened the counters */
+void perfstat_child_wait(perfstat_sync_t *sync);
+
+/*
+ * in the parent: opens the counters on pid (or does nothing if the fork
+ * failed, pid < 0) and lets the child go on; sync is reset either way
+ */
+void perfstat_attach(perfstat_sync_t *sync, pid_t pid);
+
+/*
+ * prints the counts of pid, a counted job that has been reaped, and closes
+ * its counters; jid may be 0 for a foreground command
+ * does nothing if pid isn't counted
+ */
+void perfstat_report(int jid, pid_t pid);
+
+#endif  // PERFSTAT_H_
@@ -0,0 +1,74 @@
+#ifndef PSH_H_
+#define PSH_H_
+
+#include <sys/types.h>
+
+/*
+ * libpsh: runs psh command lines in-process, without a /bin/sh -c per call.
+ * A command line is parsed the way the shell parses it (command and process
+ * substitutions, <, > and >> redirections, a trailing &) and forked straight
+ * from the calling process. Commands are given by path, as in the shell;
+ * shell builtins are not available, since they would act on the caller.
+ *
+ * A command line's state (the job list, parsed tokens, substitution pipes)
+ * lives in a psh_ctx_t, so threads may run command lines at once, each with
+ * its own context. A context must not be used by two threads at a time. Each
+ * context waits only for its own children. The shell's timing statistics,
+ * job queue, timers, CPU placement, event log and SIGCHLD signalfd are still
+ * process-wide globals. Of those the library only touches the statistics,
+ * which it records into without locking, so concurrent contexts may lose
+ * timing samples. The library never changes the process's signal
+ * dispositions or mask; children get default dispositions and an empty mask
+ * before they exec, and leave with _exit() if they can't, so the caller's
+ * stdio buffers and atexit handlers only ever run in the caller. File
+ * descriptors the library opens are close-on-exec, so one thread's commands
+ * never hold another thread's pipes open.
+ *
+ * Build with make libpsh.a or make libpsh.so. Only the psh_ functions below
+ * are exported.
+ */
+
+#define PSH_API __attribute__((visibility("default")))
+
+typedef struct psh_ctx psh_ctx_t;
+
+/* returns a new context with an empty job list, or NULL on failure */
+PSH_API psh_ctx_t *psh_ctx_new(void);
+
+/* kills the context's remaining jobs, reaps them and frees the context */
+PSH_API void psh_ctx_free(psh_ctx_t *ctx);
+
+/*
+ * parses line as the context's current command line, running any command
+ * substitutions in it and starting any process substitutions
+ * returns 0 if there is a command to run, 1 if the line is blank, -1 on a
+ * syntax error or if the command is a shell builtin
+ */
+PSH_API int psh_parse(psh_ctx_t *ctx, const char *line);
+
+/*
+ * starts the command parsed by psh_parse() in its own process group and adds
+ * it to the context's job list; returns without waiting either way, and
+ * psh_background() says whether the line ended with &
+ * returns the command's pid on success, -1 on failure
+ */
+PSH_API pid_t psh_execute(psh_ctx_t *ctx);
+
+/* returns 1 if the command parsed by psh_parse() ended with &, 0 if not */
+PSH_API int psh_background(psh_ctx_t *ctx);
+
+/*
+ * waits for pid, a command started by psh_execute(), to exit and removes it
+ * from the job list; finished process substitutions are reaped too
+ * returns 0 and sets *status (as for waitpid) on success, -1 on failure
+ */
+PSH_API int psh_wait(psh_ctx_t *ctx, pid_t pid, int *status);
+
+/*
+ * parses, starts and waits for line (a trailing & is ignored)
+ * returns 0 and sets *status (as for waitpid) on success, 1 if the line is
+ * blank, -1 on failure
+ */
+PSH_API int psh_run(psh_ctx_t *ctx, const char *line, int *status);
+
+#endif  // PSH_H_
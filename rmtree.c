@@ -0,0 +1,307 @@
+#define _GNU_SOURCE  // getdents64
+#include "./rmtree.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DENTS_SIZE 32768  // bytes of directory entries read at a time
+// directories waiting per thread before another helper is started; a
+// helper only pays for itself when there are subtrees for it to take
+#define HELPER_BACKLOG 4
+
+/* a directory being emptied */
+struct dir_node {
+    struct dir_node *parent;  // NULL for the directory rm was given
+    struct dir_node *next;    // next in the queue
+    int fd;       // open once the directory is read, until it is removed
+    int pending;  // subdirectories not yet removed, + 1 while being read
+    int failed;   // something under it could not be removed
+    char name[];  // relative to the parent's fd (the root: to the cwd)
+};
+typedef struct dir_node dir_node_t;
+
+/* one rmtree_remove() call, shared by its threads */
+struct rm_state {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;  // signaled when queue gets a node or done is set
+    dir_node_t *queue;     // directories waiting to be read, newest first
+    int queued;
+    int done;  // the root has been removed, or failed to be
+    int failed;
+    int force;
+    int max_helpers;
+    int helper_num;  // helpers started or being started
+    pthread_t helpers[RMTREE_MAX_THREADS];
+    int started[RMTREE_MAX_THREADS];  // 1 if pthread_create succeeded
+};
+typedef struct rm_state rm_state_t;
+
+static void *run_helper(void *arg);
+
+/* writes node's path, from its name and its parents', into buf */
+static size_t node_path(const dir_node_t *node, char *buf, size_t size) {
+    size_t len = 0;
+    if (node->parent != NULL) {
+        len = node_path(node->parent, buf, size);
+    }
+    int added = snprintf(&buf[len], size - len, "%s%s",
+                         node->parent != NULL ? "/" : "", node->name);
+    len += added > 0 ? (size_t)added : 0;
+    return len < size ? len : size - 1;
+}
+
+static void report(const char *path, int err) {
+    fprintf(stderr, "rm: %s: %s\n", path, strerror(err));
+}
+
+/* reports err for name in node's directory, or for node if name is NULL */
+static void report_at(const dir_node_t *node, const char *name, int err) {
+    char path[4096];
+    size_t len = node_path(node, path, sizeof(path));
+    if (name != NULL) {
+        snprintf(&path[len], sizeof(path) - len, "/%s", name);
+    }
+    report(path, err);
+}
+
+/* queues node, starting another helper once the queue backs up */
+static void push(rm_state_t *state, dir_node_t *node) {
+    pthread_mutex_lock(&state->lock);
+    node->next = state->queue;
+    state->queue = node;
+    state->queued++;
+    int helper = -1;
+    if (state->queued >= HELPER_BACKLOG * (state->helper_num + 1) &&
+        state->helper_num < state->max_helpers) {
+        helper = state->helper_num++;
+    }
+    pthread_cond_signal(&state->ready);
+    pthread_mutex_unlock(&state->lock);
+
+    if (helper >= 0) {
+        int started = pthread_create(&state->helpers[helper], NULL,
+                                     run_helper, state) == 0;
+        pthread_mutex_lock(&state->lock);
+        state->started[helper] = started;
+        pthread_mutex_unlock(&state->lock);
+    }
+}
+
+/* returns the next directory to read, or NULL once the root is removed */
+static dir_node_t *pop(rm_state_t *state) {
+    pthread_mutex_lock(&state->lock);
+    while (state->queue == NULL && !state->done) {
+        pthread_cond_wait(&state->ready, &state->lock);
+    }
+    dir_node_t *node = state->queue;
+    if (node != NULL) {
+        state->queue = node->next;
+        state->queued--;
+    }
+    pthread_mutex_unlock(&state->lock);
+    return node;
+}
+
+/*
+ * drops one of node's pending counts; once none are left, the directory is
+ * empty, so removes it and does the same for its parent
+ */
+static void finish(rm_state_t *state, dir_node_t *node) {
+    while (__atomic_sub_fetch(&node->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        int failed = __atomic_load_n(&node->failed, __ATOMIC_ACQUIRE);
+        if (node->fd >= 0) {
+            close(node->fd);
+        }
+        // the parent's fd stays open until its last subdirectory is gone
+        dir_node_t *parent = node->parent;
+        if (!failed &&
+            unlinkat(parent != NULL ? parent->fd : AT_FDCWD, node->name,
+                     AT_REMOVEDIR) < 0 &&
+            !(state->force && errno == ENOENT)) {
+            report_at(node, NULL, errno);
+            failed = 1;
+        }
+        free(node);
+        if (parent == NULL) {
+            pthread_mutex_lock(&state->lock);
+            state->failed |= failed;
+            state->done = 1;
+            pthread_cond_broadcast(&state->ready);
+            pthread_mutex_unlock(&state->lock);
+            return;
+        }
+        if (failed) {
+            // the parent can't be emptied either; say why only once
+            __atomic_store_n(&parent->failed, 1, __ATOMIC_RELEASE);
+        }
+        node = parent;
+    }
+}
+
+/*
+ * reads node's directory, unlinking its files and queueing its
+ * subdirectories, then finishes the read
+ */
+static void empty_dir(rm_state_t *state, dir_node_t *node) {
+    // relative to the parent, so depth doesn't matter and a directory
+    // swapped for a symlink meanwhile isn't followed
+    int fd = openat(node->parent != NULL ? node->parent->fd : AT_FDCWD,
+                    node->name,
+                    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    node->fd = fd;
+    if (fd < 0) {
+        if (!(state->force && errno == ENOENT)) {
+            report_at(node, NULL, errno);
+            __atomic_store_n(&node->failed, 1, __ATOMIC_RELEASE);
+        }
+        finish(state, node);
+        return;
+    }
+
+    char buf[DENTS_SIZE] __attribute__((aligned(8)));
+    ssize_t len;
+    while ((len = getdents64(fd, buf, sizeof(buf))) > 0) {
+        for (ssize_t off = 0; off < len;) {
+            struct dirent64 *ent = (struct dirent64 *)&buf[off];
+            off += ent->d_reclen;
+            const char *name = ent->d_name;
+            if (name[0] == '.' &&
+                (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+
+            int is_dir = ent->d_type == DT_DIR;
+            struct stat st;
+            if (ent->d_type == DT_UNKNOWN &&
+                fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+                is_dir = S_ISDIR(st.st_mode);
+            }
+            if (!is_dir) {
+                if (unlinkat(fd, name, 0) < 0 &&
+                    !(state->force && errno == ENOENT)) {
+                    report_at(node, name, errno);
+                    __atomic_store_n(&node->failed, 1, __ATOMIC_RELEASE);
+                }
+                continue;
+            }
+
+            size_t name_len = strlen(name);
+            dir_node_t *child =
+                (dir_node_t *)malloc(sizeof(dir_node_t) + name_len + 1);
+            if (child == NULL) {
+                report_at(node, name, ENOMEM);
+                __atomic_store_n(&node->failed, 1, __ATOMIC_RELEASE);
+                continue;
+            }
+            memcpy(child->name, name, name_len + 1);
+            child->parent = node;
+            child->fd = -1;
+            child->pending = 1;
+            child->failed = 0;
+            __atomic_add_fetch(&node->pending, 1, __ATOMIC_ACQ_REL);
+            push(state, child);
+        }
+    }
+    if (len < 0) {
+        report_at(node, NULL, errno);
+        __atomic_store_n(&node->failed, 1, __ATOMIC_RELEASE);
+    }
+    finish(state, node);
+}
+
+static void *run_helper(void *arg) {
+    rm_state_t *state = (rm_state_t *)arg;
+    dir_node_t *node;
+    while ((node = pop(state)) != NULL) {
+        empty_dir(state, node);
+    }
+    return NULL;
+}
+
+/*
+ * removes path and, if it is a directory, everything under it, using up to
+ * threads threads (including the caller); errors are printed with an "rm: "
+ * prefix, and a missing path is not an error if force is set
+ * returns 0 on success, -1 if anything could not be removed
+ */
+int rmtree_remove(const char *path, int threads, int force) {
+    struct stat st;
+    if (lstat(path, &st) < 0) {
+        if (force && errno == ENOENT) {
+            return 0;
+        }
+        report(path, errno);
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        if (unlinkat(AT_FDCWD, path, 0) < 0) {
+            report(path, errno);
+            return -1;
+        }
+        return 0;
+    }
+
+    size_t path_len = strlen(path);
+    // strip trailing slashes, except from "/"
+    while (path_len > 1 && path[path_len - 1] == '/') {
+        path_len--;
+    }
+    dir_node_t *root = (dir_node_t *)malloc(sizeof(dir_node_t) + path_len + 1);
+    if (root == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    memcpy(root->name, path, path_len);
+    root->name[path_len] = '\0';
+    root->parent = NULL;
+    root->fd = -1;
+    root->pending = 1;
+    root->failed = 0;
+
+    rm_state_t *state = (rm_state_t *)calloc(1, sizeof(rm_state_t));
+    if (state == NULL) {
+        perror("calloc");
+        free(root);
+        return -1;
+    }
+    pthread_mutex_init(&state->lock, NULL);
+    pthread_cond_init(&state->ready, NULL);
+    state->force = force;
+    if (threads > RMTREE_MAX_THREADS) {
+        threads = RMTREE_MAX_THREADS;
+    }
+    state->max_helpers = threads > 1 ? threads - 1 : 0;
+
+    // the caller works the queue too; helpers start as it backs up
+    push(state, root);
+    run_helper(state);
+
+    pthread_mutex_lock(&state->lock);
+    int helper_num = state->helper_num;
+    pthread_mutex_unlock(&state->lock);
+    for (int i = 0; i < helper_num; i++) {
+        if (state->started[i]) {
+            pthread_join(state->helpers[i], NULL);
+        }
+    }
+    int failed = state->failed;
+    pthread_cond_destroy(&state->ready);
+    pthread_mutex_destroy(&state->lock);
+    free(state);
+    return failed ? -1 : 0;
+}
+
+/* returns the number of threads rm -r uses by default: one per CPU, capped */
+int rmtree_default_threads(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) {
+        return 1;
+    }
+    return cpus > RMTREE_MAX_THREADS ? RMTREE_MAX_THREADS : (int)cpus;
+}
@@ -0,0 +1,34 @@
+#ifndef RMTREE_H_
+#define RMTREE_H_
+
+/*
+ * Recursive removal for rm -r. Directories are read with getdents64 on an
+ * fd from openat, and their files removed with unlinkat on that fd. A
+ * directory is opened (O_NOFOLLOW) and removed relative to its parent's fd,
+ * which stays open until its last subdirectory is gone, so no path is
+ * resolved from the top: depth is limited by open fds, not PATH_MAX, and a
+ * directory swapped for a symlink is not followed. Each subdirectory found
+ * is pushed onto a queue shared by a small pool of worker threads, so
+ * separate subtrees are emptied in parallel. Helpers are only started as
+ * directories pile up in the queue: parallelism pays off on wide trees with
+ * many subdirectories, while a flat directory (whose unlinks all take the
+ * same directory lock) is emptied by the caller alone. A directory counts its
+ * subdirectories still being emptied; the worker that finishes the last one
+ * removes the directory itself and reports to its parent, so nothing waits
+ * on a directory that isn't empty yet.
+ */
+
+#define RMTREE_MAX_THREADS 8
+
+/*
+ * removes path and, if it is a directory, everything under it, using up to
+ * threads threads (including the caller); errors are printed with an "rm: "
+ * prefix, and a missing path is not an error if force is set
+ * returns 0 on success, -1 if anything could not be removed
+ */
+int rmtree_remove(const char *path, int threads, int force);
+
+/* returns the number of threads rm -r uses by default: one per CPU, capped */
+int rmtree_default_threads(void);
+
+#endif  // RMTREE_H_
@@ -0,0 +1,106 @@
+#include "./sched.h"
+#include <stdlib.h>
+#include <string.h>
+
+// max number of jobs running at once, 0 for no limit
+static int max_running;
+
+// saved commands of queued jobs, most recently saved first
+static sched_spec_t *specs;
+
+/* returns a malloc'd copy of str, or NULL if str is NULL */
+static char *copy_string(const char *str) {
+    if (str == NULL) {
+        return NULL;
+    }
+    size_t len = strlen(str);
+    char *copy = (char *)malloc(len + 1);
+    memcpy(copy, str, len + 1);
+    return copy;
+}
+
+/* sets the max number of jobs running at once, 0 for no limit */
+void sched_set_max(int max) { max_running = max < 0 ? 0 : max; }
+
+/* gets the max number of jobs running at once, 0 for no limit */
+int sched_get_max(void) { return max_running; }
+
+/* returns 1 if another job may start now, 0 if it has to wait */
+int sched_can_start(job_list_t *job_list) {
+    return max_running == 0 || count_jobs(job_list, RUNNING) < max_running;
+}
+
+/*
+ * saves a copy of queued job jid's command
+ * returns 0 on success, -1 on failure
+ */
+int sched_save(int jid, char *tokens[], int token_num, char *input_file,
+               char *output_file, int output_redirect_code) {
+    if (token_num < 1) {
+        return -1;
+    }
+
+    sched_spec_t *spec = (sched_spec_t *)malloc(sizeof(sched_spec_t));
+    spec->jid = jid;
+    spec->token_num = token_num;
+    spec->tokens = (char **)malloc(sizeof(char *) * (size_t)(token_num + 1));
+    for (int i = 0; i < token_num; i++) {
+        spec->tokens[i] = copy_string(tokens[i]);
+    }
+    spec->tokens[token_num] = NULL;
+    spec->input_file = copy_string(input_file);
+    spec->output_file = copy_string(output_file);
+    spec->output_redirect_code = output_redirect_code;
+
+    spec->next = specs;
+    specs = spec;
+    return 0;
+}
+
+/*
+ * removes queued job jid's saved command and returns it, NULL if there is
+ * none; free it with sched_free()
+ */
+sched_spec_t *sched_take(int jid) {
+    sched_spec_t *prev = NULL;
+    sched_spec_t *cur = specs;
+    while (cur != NULL) {
+        if (cur->jid == jid) {
+            if (prev != NULL) {
+                prev->next = cur->next;
+            } else {
+                specs = cur->next;
+            }
+            cur->next = NULL;
+            return cur;
+        }
+
+        prev = cur;
+        cur = cur->next;
+    }
+
+    return NULL;
+}
+
+/* frees a command returned by sched_take() */
+void sched_free(sched_spec_t *spec) {
+    if (spec == NULL) {
+        return;
+    }
+    for (int i = 0; i < spec->token_num; i++) {
+        free(spec->tokens[i]);
+    }
+    free(spec->tokens);
+    free(spec->input_file);
+    free(spec->output_file);
+    free(spec);
+}
+
+/* frees every saved command */
+void sched_cleanup(void) {
+    while (specs != NULL) {
+        sched_spec_t *next = specs->next;
+        sched_free(specs);
+        specs = next;
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef SCHED_H_
+#define SCHED_H_
+
+#include "./jobs.h"
+
+/*
+ * Admission control for background jobs. A background job is added to the
+ * job list as QUEUED and its command is saved here. The shell starts queued
+ * jobs (in get_next_queued() order) while fewer than the maximum number of
+ * jobs are RUNNING.
+ */
+
+/* a queued job's command, saved until the job is started */
+struct sched_spec {
+    int jid;
+    char **tokens;      // NULL-terminated copy of the command's tokens
+    int token_num;
+    char *input_file;   // NULL if input is not redirected
+    char *output_file;  // NULL if output is not redirected
+    int output_redirect_code;  // 1 if truncated, 2 if appended
+    struct sched_spec *next;
+};
+typedef struct sched_spec sched_spec_t;
+
+/* sets the max number of jobs running at once, 0 for no limit */
+void sched_set_max(int max);
+/* gets the max number of jobs running at once, 0 for no limit */
+int sched_get_max(void);
+
+/* returns 1 if another job may start now, 0 if it has to wait */
+int sched_can_start(job_list_t *job_list);
+
+/*
+ * saves a copy of queued job jid's command
+ * returns 0 on success, -1 on failure
+ */
+int sched_save(int jid, char *tokens[], int token_num, char *input_file,
+               char *output_file, int output_redirect_code);
+
+/*
+ * removes queued job jid's saved command and returns it, NULL if there is
+ * none; free it with sched_free()
+ */
+sched_spec_t *sched_take(int jid);
+
+/* frees a command returned by sched_take() */
+void sched_free(sched_spec_t *spec);
+
+/* frees every saved command */
+void sched_cleanup(void);
+
+#endif  // SCHED_H_
@@ -0,0 +1,596 @@
+#define _GNU_SOURCE  // accept4, pipe2
+#include "./serve.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "./evlog.h"
+#include "./stats.h"
+
+#define REQUEST_MAX 4096  // longest request line, including the verb
+#define READ_SIZE 65536   // bytes read from a socket or pipe at a time
+#define JOB_BUCKETS 4096  // power of two, jobs hashed by pid
+#define MAX_EVENTS 256
+
+/* what an epoll event's data.ptr points at */
+typedef enum { H_LISTEN, H_SIGCHLD, H_STOP, H_CLIENT, H_OUTPUT } handle_type_t;
+
+struct client {
+    handle_type_t type;  // H_CLIENT, first so epoll can point at it
+    int fd;
+    char *in;  // received bytes not yet part of a complete line
+    size_t in_len;
+    size_t in_cap;
+    char *out;  // replies not yet sent, from out_off to out_len
+    size_t out_off;
+    size_t out_len;
+    size_t out_cap;
+    int writing;      // 1 if waiting for the socket to be writable
+    uint32_t events;  // events fd is watched for, 0 if it isn't in epoll
+    int read_closed;  // 1 once the client has shut down its write side
+    int jobs;         // started jobs not yet reported
+    int closed;       // 1 once closed; freed after the current batch
+    struct client *next_closed;
+};
+typedef struct client client_t;
+
+struct serve_job {
+    handle_type_t type;  // H_OUTPUT, first so epoll can point at it
+    int jid;
+    pid_t pid;
+    client_t *client;  // NULL once the client is gone
+    int capture;       // 1 if the job's output is sent back
+    int out_fd;        // read end of the output pipe, -1 once closed
+    char *out;
+    size_t out_len;
+    size_t out_cap;
+    int reaped;
+    int status;  // wait status, once reaped
+    struct serve_job *next;  // in its pid bucket
+};
+typedef struct serve_job serve_job_t;
+
+static const handle_type_t listen_handle = H_LISTEN;
+static const handle_type_t sigchld_handle = H_SIGCHLD;
+static const handle_type_t stop_handle = H_STOP;
+
+static int epoll_fd = -1;
+static serve_job_t *job_buckets[JOB_BUCKETS];
+static client_t *closed_clients;  // to be freed after the current batch
+
+/* grows *buf (of *cap bytes) to hold at least need bytes */
+static void reserve(char **buf, size_t *cap, size_t need) {
+    if (need <= *cap) {
+        return;
+    }
+    size_t new_cap = *cap > 0 ? *cap : 256;
+    while (new_cap < need) {
+        new_cap *= 2;
+    }
+    *buf = (char *)realloc(*buf, new_cap);
+    *cap = new_cap;
+}
+
+static serve_job_t **bucket_of(pid_t pid) {
+    return &job_buckets[(unsigned)pid & (JOB_BUCKETS - 1)];
+}
+
+static serve_job_t *find_job(pid_t pid) {
+    serve_job_t *job = *bucket_of(pid);
+    while (job != NULL && job->pid != pid) {
+        job = job->next;
+    }
+    return job;
+}
+
+static void unlink_job(serve_job_t *job) {
+    serve_job_t **link = bucket_of(job->pid);
+    while (*link != job) {
+        link = &(*link)->next;
+    }
+    *link = job->next;
+}
+
+/* watches (or stops watching, if events is 0) fd for ptr's handle */
+static void watch(int fd, uint32_t events, const void *ptr, int op) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = (void *)(uintptr_t)ptr;
+    if (epoll_ctl(epoll_fd, op, fd, &ev) < 0) {
+        perror("serve: epoll_ctl");
+    }
+}
+
+/*
+ * watches the client's fd for reading until it shuts down and for writing
+ * while replies are waiting; a socket that is closed for reading and has
+ * nothing to send is taken out of epoll, since its hangup would be reported
+ * over and over
+ */
+static void client_watch(client_t *client) {
+    uint32_t events = (client->read_closed ? 0 : EPOLLIN) |
+                      (client->writing ? EPOLLOUT : 0);
+    if (events == client->events) {
+        return;
+    }
+    watch(client->fd, events, client,
+          events == 0 ? EPOLL_CTL_DEL
+                      : (client->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD));
+    client->events = events;
+}
+
+/* closes the client; the struct is freed after the current batch */
+static void client_close(client_t *client) {
+    if (client->closed) {
+        return;
+    }
+    client->closed = 1;
+    if (client->events != 0) {
+        watch(client->fd, 0, client, EPOLL_CTL_DEL);
+    }
+    close(client->fd);
+
+    // its jobs keep running, but there is no one to report them to
+    for (int i = 0; i < JOB_BUCKETS; i++) {
+        for (serve_job_t *job = job_buckets[i]; job != NULL; job = job->next) {
+            if (job->client == client) {
+                job->client = NULL;
+            }
+        }
+    }
+
+    client->next_closed = closed_clients;
+    closed_clients = client;
+}
+
+/* sends as many queued replies as the socket takes */
+static void client_flush(client_t *client) {
+    while (client->out_off < client->out_len) {
+        ssize_t sent =
+            send(client->fd, &client->out[client->out_off],
+                 client->out_len - client->out_off, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0 && errno == EAGAIN) {
+            break;
+        }
+        if (sent < 0) {
+            client_close(client);
+            return;
+        }
+        client->out_off += (size_t)sent;
+    }
+
+    if (client->out_off == client->out_len) {
+        client->out_off = 0;
+        client->out_len = 0;
+    }
+    // only ask for writability while replies are waiting
+    client->writing = client->out_len > 0;
+    client_watch(client);
+}
+
+/* queues len bytes of reply for the client */
+static void client_send(client_t *client, const char *data, size_t len) {
+    reserve(&client->out, &client->out_cap, client->out_len + len);
+    memcpy(&client->out[client->out_len], data, len);
+    client->out_len += len;
+}
+
+/* closes the client once it's done sending and has nothing left to get */
+static void client_check(client_t *client) {
+    if (!client->closed && client->read_closed && client->jobs == 0 &&
+        client->out_len == 0) {
+        client_close(client);
+    }
+}
+
+/* reports a finished job to its client and frees it */
+static void job_finish(serve_job_t *job) {
+    if (!job->reaped || job->out_fd >= 0) {
+        return;
+    }
+
+    client_t *client = job->client;
+    if (client != NULL) {
+        char line[128];
+        int is_exit = WIFEXITED(job->status);
+        int len = snprintf(line, sizeof(line), "done %d %s %d", job->jid,
+                           is_exit ? "exit" : "signal",
+                           is_exit ? WEXITSTATUS(job->status)
+                                   : WTERMSIG(job->status));
+        if (job->capture) {
+            len += snprintf(&line[len], sizeof(line) - (size_t)len, " %zu",
+                            job->out_len);
+        }
+        line[len++] = '\n';
+        client_send(client, line, (size_t)len);
+        if (job->capture) {
+            client_send(client, job->out, job->out_len);
+        }
+        client->jobs--;
+        client_flush(client);
+        client_check(client);
+    }
+
+    unlink_job(job);
+    free(job->out);
+    free(job);
+}
+
+/* reads a capturing job's output, finishing the job at EOF */
+static void job_read(serve_job_t *job) {
+    for (;;) {
+        reserve(&job->out, &job->out_cap, job->out_len + READ_SIZE);
+        ssize_t got = read(job->out_fd, &job->out[job->out_len], READ_SIZE);
+        if (got > 0) {
+            job->out_len += (size_t)got;
+            continue;
+        }
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got < 0 && errno == EAGAIN) {
+            return;
+        }
+        // EOF (or an error, treated the same)
+        watch(job->out_fd, 0, job, EPOLL_CTL_DEL);
+        close(job->out_fd);
+        job->out_fd = -1;
+        job_finish(job);
+        return;
+    }
+}
+
+/* reaps every child that has exited */
+static void reap(job_list_t *job_list, int sigchld_fd) {
+    struct signalfd_siginfo info;
+    while (read(sigchld_fd, &info, sizeof(info)) > 0) {
+    }
+
+    uint64_t reap_start = stats_now();
+    pid_t pid;
+    int status;
+    struct rusage usage;
+    while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+        evlog_record_wait(get_job_jid(job_list, pid), pid, status, &usage);
+        remove_job_pid(job_list, pid);
+        serve_job_t *job = find_job(pid);
+        if (job != NULL) {
+            job->reaped = 1;
+            job->status = status;
+            job_finish(job);
+        }
+    }
+    stats_record_stage(STAGE_REAP, stats_now() - reap_start);
+}
+
+/* handles one request line from the client */
+static void client_request(client_t *client, char *line, serve_spawn_t spawn,
+                           void *spawn_arg) {
+    char reply[256];
+    int capture;
+    char *cmd;
+    if (strncmp(line, "run ", 4) == 0) {
+        capture = 0;
+        cmd = &line[4];
+    } else if (strncmp(line, "capture ", 8) == 0) {
+        capture = 1;
+        cmd = &line[8];
+    } else {
+        int len = snprintf(reply, sizeof(reply), "error unknown request\n");
+        client_send(client, reply, (size_t)len);
+        return;
+    }
+
+    int pipe_fds[2] = {-1, -1};
+    if (capture && pipe2(pipe_fds, O_CLOEXEC) < 0) {
+        perror("serve: pipe2");
+        int len = snprintf(reply, sizeof(reply), "error pipe failed\n");
+        client_send(client, reply, (size_t)len);
+        return;
+    }
+
+    pid_t pid;
+    char err[128];
+    int jid = spawn(spawn_arg, cmd, pipe_fds[1], &pid, err, sizeof(err));
+    if (capture) {
+        close(pipe_fds[1]);
+    }
+    if (jid < 0) {
+        if (capture) {
+            close(pipe_fds[0]);
+        }
+        int len = snprintf(reply, sizeof(reply), "error %s\n", err);
+        client_send(client, reply, (size_t)len);
+        return;
+    }
+
+    serve_job_t *job = (serve_job_t *)calloc(1, sizeof(serve_job_t));
+    job->type = H_OUTPUT;
+    job->jid = jid;
+    job->pid = pid;
+    job->client = client;
+    job->capture = capture;
+    job->out_fd = pipe_fds[0];
+    job->next = *bucket_of(pid);
+    *bucket_of(pid) = job;
+    if (capture) {
+        fcntl(job->out_fd, F_SETFL, O_NONBLOCK);
+        watch(job->out_fd, EPOLLIN, job, EPOLL_CTL_ADD);
+    }
+    client->jobs++;
+
+    int len = snprintf(reply, sizeof(reply), "job %d %d\n", jid, pid);
+    client_send(client, reply, (size_t)len);
+}
+
+/* reads requests from the client and handles every complete line */
+static void client_read(client_t *client, serve_spawn_t spawn,
+                        void *spawn_arg) {
+    for (;;) {
+        reserve(&client->in, &client->in_cap, client->in_len + READ_SIZE);
+        ssize_t got = recv(client->fd, &client->in[client->in_len], READ_SIZE,
+                           MSG_DONTWAIT);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got < 0 && errno == EAGAIN) {
+            break;
+        }
+        if (got <= 0) {
+            // shut down (or reset): stop reading, but still reply
+            client->read_closed = 1;
+            client_watch(client);
+            break;
+        }
+        client->in_len += (size_t)got;
+    }
+
+    // handle complete lines, keeping a trailing partial line for later
+    size_t start = 0;
+    char *newline;
+    while ((newline = memchr(&client->in[start], '\n',
+                             client->in_len - start)) != NULL) {
+        char *line = &client->in[start];
+        start = (size_t)(newline - client->in) + 1;
+        *newline = '\0';
+        if (newline > line && newline[-1] == '\r') {
+            newline[-1] = '\0';
+        }
+        if (*line != '\0') {
+            client_request(client, line, spawn, spawn_arg);
+        }
+    }
+    memmove(client->in, &client->in[start], client->in_len - start);
+    client->in_len -= start;
+
+    if (client->in_len > REQUEST_MAX) {
+        const char *reply = "error request too long\n";
+        client_send(client, reply, strlen(reply));
+        client->in_len = 0;
+        client->read_closed = 1;
+    }
+
+    client_flush(client);
+    client_check(client);
+}
+
+/* accepts every pending connection */
+static void accept_clients(int listen_fd) {
+    int fd;
+    while ((fd = accept4(listen_fd, NULL, NULL,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        client_t *client = (client_t *)calloc(1, sizeof(client_t));
+        client->type = H_CLIENT;
+        client->fd = fd;
+        client_watch(client);
+    }
+    if (errno != EAGAIN && errno != EINTR) {
+        perror("serve: accept4");
+    }
+}
+
+/*
+ * removes path if it is still the socket this server bound (bound_st), and
+ * not something that replaced it since
+ */
+static void unlink_socket(const char *path, const struct stat *bound_st) {
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode) &&
+        st.st_dev == bound_st->st_dev && st.st_ino == bound_st->st_ino) {
+        unlink(path);
+    }
+}
+
+/*
+ * creates and binds the listening socket at path, replacing a stale socket
+ * left by a server that is no longer running; anything at path that isn't a
+ * socket is left alone. Writes the bound socket's inode to bound_st
+ * returns the socket on success, -1 on failure
+ */
+static int listen_at(const char *path, struct stat *bound_st) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "serve: socket path too long\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("serve: socket");
+        return -1;
+    }
+    int bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    if (!bound && errno == EADDRINUSE) {
+        struct stat st;
+        if (lstat(path, &st) == 0 && !S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "serve: %s is not a socket\n", path);
+            close(fd);
+            return -1;
+        }
+        // only replace the socket if nothing answers on it
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int alive =
+            connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0 ||
+            errno != ECONNREFUSED;
+        close(probe);
+        if (alive) {
+            fprintf(stderr, "serve: %s is in use\n", path);
+            close(fd);
+            return -1;
+        }
+        unlink(path);
+        bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    }
+    if (!bound) {
+        perror("serve: bind");
+        close(fd);
+        return -1;
+    }
+    if (lstat(path, bound_st) < 0) {
+        perror("serve: lstat");
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, SOMAXCONN) < 0) {
+        perror("serve: listen");
+        close(fd);
+        unlink_socket(path, bound_st);
+        return -1;
+    }
+    return fd;
+}
+
+/* frees the clients closed during the last batch */
+static void free_closed_clients(void) {
+    while (closed_clients != NULL) {
+        client_t *next = closed_clients->next_closed;
+        free(closed_clients->in);
+        free(closed_clients->out);
+        free(closed_clients);
+        closed_clients = next;
+    }
+}
+
+/*
+ * serves clients on a Unix socket at path until SIGINT, SIGTERM or SIGHUP,
+ * starting jobs with spawn(spawn_arg, ...) and reaping them (removing them
+ * from job_list) when sigchld_fd, a signalfd for SIGCHLD, is readable
+ * returns 0 on a clean shutdown, -1 on failure
+ */
+int serve(const char *path, job_list_t *job_list, int sigchld_fd,
+          serve_spawn_t spawn, void *spawn_arg) {
+    // stop signals are read from a signalfd, so a shutdown is never
+    // half-way through handling an event
+    sigset_t stop_mask;
+    sigemptyset(&stop_mask);
+    sigaddset(&stop_mask, SIGINT);
+    sigaddset(&stop_mask, SIGTERM);
+    sigaddset(&stop_mask, SIGHUP);
+    int stop_fd;
+    if (sigprocmask(SIG_BLOCK, &stop_mask, NULL) < 0 ||
+        (stop_fd = signalfd(-1, &stop_mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+        perror("serve: signalfd");
+        return -1;
+    }
+
+    struct stat bound_st;
+    int listen_fd = listen_at(path, &bound_st);
+    if (listen_fd < 0) {
+        close(stop_fd);
+        return -1;
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("serve: epoll_create1");
+        close(listen_fd);
+        close(stop_fd);
+        unlink_socket(path, &bound_st);
+        return -1;
+    }
+    watch(listen_fd, EPOLLIN, &listen_handle, EPOLL_CTL_ADD);
+    watch(sigchld_fd, EPOLLIN, &sigchld_handle, EPOLL_CTL_ADD);
+    watch(stop_fd, EPOLLIN, &stop_handle, EPOLL_CTL_ADD);
+
+    int stopping = 0;
+    struct epoll_event events[MAX_EVENTS];
+    while (!stopping) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            perror("serve: epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            handle_type_t type = *(handle_type_t *)events[i].data.ptr;
+            if (type == H_LISTEN) {
+                accept_clients(listen_fd);
+            } else if (type == H_SIGCHLD) {
+                reap(job_list, sigchld_fd);
+            } else if (type == H_STOP) {
+                stopping = 1;
+            } else if (type == H_OUTPUT) {
+                job_read((serve_job_t *)events[i].data.ptr);
+            } else {
+                client_t *client = (client_t *)events[i].data.ptr;
+                if (client->closed) {
+                    continue;
+                }
+                if (events[i].events & EPOLLOUT) {
+                    client_flush(client);
+                }
+                // a hangup after the client shut down was already handled
+                if (!client->closed && !client->read_closed &&
+                    (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                    client_read(client, spawn, spawn_arg);
+                }
+                if (!client->closed) {
+                    client_check(client);
+                }
+            }
+        }
+        free_closed_clients();
+    }
+
+    // jobs still running are left in job_list for the caller to end
+    for (int i = 0; i < JOB_BUCKETS; i++) {
+        while (job_buckets[i] != NULL) {
+            serve_job_t *job = job_buckets[i];
+            job_buckets[i] = job->next;
+            if (job->out_fd >= 0) {
+                close(job->out_fd);
+            }
+            if (job->client != NULL && !job->client->closed) {
+                client_close(job->client);
+            }
+            free(job->out);
+            free(job);
+        }
+    }
+    free_closed_clients();
+    close(epoll_fd);
+    epoll_fd = -1;
+    close(listen_fd);
+    close(stop_fd);
+    unlink_socket(path, &bound_st);
+    return 0;
+}
@@ -0,0 +1,45 @@
+#ifndef SERVE_H_
+#define SERVE_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "./jobs.h"
+
+/*
+ * Command server (psh --serve PATH). Clients connect to a Unix stream socket
+ * at PATH and send one request per line:
+ *   run CMDLINE       start CMDLINE as a job, output goes to psh's stdout
+ *   capture CMDLINE   start CMDLINE as a job and send back its stdout
+ * Each request is answered, in order, with
+ *   job JID PID       the job was started
+ *   error MESSAGE     it was not (bad command line, builtin, fork failure)
+ * and once a started job has exited (and, for capture, closed its stdout):
+ *   done JID exit STATUS [LEN]
+ *   done JID signal SIGNUM [LEN]
+ * where capture replies carry LEN bytes of output right after the newline.
+ * Requests may be pipelined; done lines come in the order jobs finish. Any
+ * number of jobs run at once; each is in the shell's job table while it runs.
+ * Jobs read /dev/null. A client that closes its write side still gets the
+ * replies for jobs it started.
+ */
+
+/*
+ * starts a job for the command server (arg is the one passed to serve()):
+ * parses line as a command line and forks it with stdout on out_fd (unless
+ * out_fd is -1) and stdin on /dev/null, adding it to the job list
+ * returns the job's JID and sets *pid on success, or returns -1 with a
+ * message in err
+ */
+typedef int (*serve_spawn_t)(void *arg, char *line, int out_fd, pid_t *pid,
+                             char *err, size_t err_size);
+
+/*
+ * serves clients on a Unix socket at path until SIGINT, SIGTERM or SIGHUP,
+ * starting jobs with spawn(spawn_arg, ...) and reaping them (removing them
+ * from job_list) when sigchld_fd, a signalfd for SIGCHLD, is readable
+ * returns 0 on a clean shutdown, -1 on failure
+ */
+int serve(const char *path, job_list_t *job_list, int sigchld_fd,
+          serve_spawn_t spawn, void *spawn_arg);
+
+#endif  // SERVE_H_
@@ -1,49 +1,137 @@
+#define _GNU_SOURCE
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include "affinity.h"
+#include "evlog.h"
+#include "frecency.h"
 #include "jobs.h"
+#include "memo.h"
+#include "perfstat.h"
+#include "psh.h"
+#include "rmtree.h"
+#include "sched.h"
+#include "serve.h"
+#include "stats.h"
+#include "timers.h"
 
 #define BUFFER_SIZE 1024
 #define TOKENS_SIZE 512
 #define ARGV_SIZE 512
 #define PATH_MAX 512
+#define SUBST_MAX 16
+#define CAPTURE_READ_SIZE 65536
+#define SHUTDOWN_GRACE_MS 3000  // default time jobs get to exit (see main())
+#define SUPERVISE_BACKOFF_MS 100        // default supervise --backoff
+#define SUPERVISE_MAX_BACKOFF_MS 60000  // longest wait before a restart
+#define SUPERVISE_STABLE_MS 10000  // uptime after which a crash starts afresh
 
-/* Global variables that are reset each iteration */
-char buffer[BUFFER_SIZE];
-char *tokens[TOKENS_SIZE];
-char *argv[ARGV_SIZE];
+/* State of one shell: the interactive shell, the command server, or a libpsh
+ * context (see psh.h). Nothing here is shared between contexts. */
+struct psh_ctx {
+    /* Reset for each command line (see reset_command_line()) */
+    char buffer[BUFFER_SIZE];
+    // 1 for each byte of buffer that a substitution produced; such text is
+    // only ever words, never redirections or &
+    char substituted[BUFFER_SIZE];
+    char *tokens[TOKENS_SIZE];
+    char *argv[ARGV_SIZE];
 
-// 0 if not redirecting input, 1 if redirecting
-int input_redirect_code;
+    // 0 if not redirecting input, 1 if redirecting
+    int input_redirect_code;
 
-// 0 if not redirecting output, 1 if truncated, 2 if appended
-int output_redirect_code;
+    // 0 if not redirecting output, 1 if truncated, 2 if appended
+    int output_redirect_code;
 
-// paths for redirection targets
-char *input_file;
-char *output_file;
+    // paths for redirection targets
+    char *input_file;
+    char *output_file;
 
-// 0 if foreground process or no child process, 1 if background process
-int bg_process_flag;
+    // 0 if foreground process or no child process, 1 if background process
+    int bg_process_flag;
 
-// number of tokens, not counting redirection tokens or '&' (bg process)
-int token_num;
+    // number of tokens, not counting redirection tokens or '&' (bg process)
+    int token_num;
 
-/* Global variables that persist as long as shell is running */
-// job list
-job_list_t *job_list;
+    // shell's ends of the pipes created by process substitution, passed to
+    // the command as /dev/fd/N and closed once the command has been started
+    int subst_fds[SUBST_MAX];
+    int subst_fd_num;
 
-// next available job id, incremented after each job is added to job_list
-int next_avail_jid = 1;
+    // CPUs the next background job is pinned to (see place_job()), applied
+    // by exec_child() if job_cpus_set is 1
+    cpu_set_t job_cpus;
+    int job_cpus_set;
 
-// pgid of shell, initialized at start of main
-pid_t shell_pgid;
+    // 1 if the next command started gets performance counters (perfstat
+    // cmd), and the pipe it waits on while they are opened (see perfstat.h)
+    int perf_count;
+    perfstat_sync_t perf_sync;
+
+    // 1 in a foreground command's child, which times its setup for the exec
+    // stage (see stats_exec_start())
+    int time_exec;
+
+    // time spent running substitutions' commands during parse(), left out of
+    // the parse stage
+    uint64_t subst_ns;
+
+    /* Persist as long as the shell is running */
+    job_list_t *job_list;
+
+    // next available job id, incremented after each job is added to job_list
+    int next_avail_jid;
+
+    // pgid of shell, initialized at start of main
+    pid_t shell_pgid;
+
+    // pid of the process that made the context; forked children (command
+    // substitutions) have another, and must not end its jobs
+    pid_t shell_pid;
+
+    // wait status of the last foreground command, set by handle_fg_process()
+    int fg_status;
+
+    // the foreground process wait_fg() is waiting for (0 if none), which
+    // reap_jobs() leaves to it
+    pid_t fg_pid;
+
+    // on exit, jobs are sent shutdown_signal and get shutdown_grace_ms to
+    // exit before they are killed (see shutdown_jobs())
+    int shutdown_signal;
+    long shutdown_grace_ms;
+
+    // 1 if builtins run as builtins; libpsh contexts exec every command
+    int builtins;
+};
+
+int is_builtin(char *name);
+int is_pure_builtin(char *name);
+int exec_builtin(psh_ctx_t *ctx, char *args[], int argc);
+int wait_jobs(psh_ctx_t *ctx, const int *jids, int jid_num, int any);
+void shutdown_jobs(psh_ctx_t *ctx);
+void shell_cleanup(psh_ctx_t *ctx);
+int restart_job(psh_ctx_t *ctx, int jid, int status);
+int reap_jobs(psh_ctx_t *ctx);
+int dispatch_jobs(psh_ctx_t *ctx);
+
+/* Global variables shared by every context in the process */
+// signalfd that becomes readable when a child changes state (SIGCHLD is
+// blocked in the shell), initialized at start of main
+int sigchld_fd = -1;
 
 /*
  * is_redirection_sym()
@@ -56,13 +144,509 @@ int is_redirection_sym(char *str) {
     return !(strcmp(str, "<") && strcmp(str, ">") && strcmp(str, ">>"));
 }
 
+/*
+ * restore_child_signals()
+ * - Description: Sets the signals ignored by the shell back to their default
+ * behavior. Called in every child process before execv. Exits on error.
+ */
+void restore_child_signals(void) {
+    if (signal(SIGTTOU, SIG_DFL) == SIG_ERR) {
+        perror("signal");
+        _exit(1);
+    }
+    if (signal(SIGINT, SIG_DFL) == SIG_ERR) {
+        perror("signal");
+        _exit(1);
+    }
+    if (signal(SIGTSTP, SIG_DFL) == SIG_ERR) {
+        perror("signal");
+        _exit(1);
+    }
+    if (signal(SIGQUIT, SIG_DFL) == SIG_ERR) {
+        perror("signal");
+        _exit(1);
+    }
+    // the shell blocks SIGCHLD to read it from sigchld_fd (and, serving,
+    // its stop signals too)
+    sigset_t empty_mask;
+    sigemptyset(&empty_mask);
+    if (sigprocmask(SIG_SETMASK, &empty_mask, NULL) < 0) {
+        perror("sigprocmask");
+        _exit(1);
+    }
+}
+
+/*
+ * close_subst_fds()
+ * - Description: Closes the shell's ends of all process substitution pipes.
+ * Called in the parent once the command using them has been forked (or has
+ * failed to start), so that the inner commands see EOF.
+ *
+ * - Arguments: ctx: the shell context
+ */
+void close_subst_fds(psh_ctx_t *ctx) {
+    for (int i = 0; i < ctx->subst_fd_num; i++) {
+        if (close(ctx->subst_fds[i]) < 0) {
+            perror("close");
+        }
+    }
+    ctx->subst_fd_num = 0;
+}
+
+/*
+ * start_proc_subst()
+ * - Description: Starts cmd in the background connected to a pipe. If
+ * reading is 1 (<(cmd)), the command's stdout is the write end of the pipe
+ * and the shell keeps the read end; otherwise (>(cmd)) the command's stdin is
+ * the read end and the shell keeps the write end. Built-ins run in the forked
+ * child. The inner command is added to the job list as a hidden job so that
+ * reap_jobs() collects it.
+ *
+ * - Arguments: ctx: the shell context, cmd: the command line between the
+ * parentheses (modified by tokenizing), reading: 1 for <(cmd), 0 for >(cmd)
+ *
+ * - Returns: the shell's end of the pipe on success, -1 on error
+ */
+int start_proc_subst(psh_ctx_t *ctx, char *cmd, int reading) {
+    char *sub_tokens[TOKENS_SIZE] = {0};
+    char *sub_argv[ARGV_SIZE] = {0};
+    int sub_token_num = 0;
+    char *save;
+    char *str = cmd;
+    char *token;
+
+    while ((token = strtok_r(str, " \t\n", &save)) != NULL &&
+           sub_token_num < TOKENS_SIZE - 1) {
+        sub_tokens[sub_token_num++] = token;
+        str = NULL;
+    }
+    if (sub_token_num == 0) {
+        fprintf(stderr, "syntax error: empty process substitution\n");
+        return -1;
+    }
+    if (ctx->subst_fd_num == SUBST_MAX) {
+        fprintf(stderr, "syntax error: too many process substitutions\n");
+        return -1;
+    }
+
+    char *last_slash = strrchr(sub_tokens[0], '/');
+    sub_argv[0] = last_slash != NULL ? &last_slash[1] : sub_tokens[0];
+    for (int i = 1; i < sub_token_num; i++) {
+        sub_argv[i] = sub_tokens[i];
+    }
+
+    // close-on-exec, so commands forked meanwhile by other threads (libpsh)
+    // don't hold the pipe open; exec_child() passes the shell's end on
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) < 0) {
+        perror("pipe");
+        return -1;
+    }
+    // shell keeps the read end for <(cmd), the write end for >(cmd)
+    int shell_end = reading ? pipe_fds[0] : pipe_fds[1];
+    int child_end = reading ? pipe_fds[1] : pipe_fds[0];
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        if (setpgid(getpid(), getpid()) < 0) {
+            perror("setpgid");
+            _exit(1);
+        }
+        restore_child_signals();
+
+        if (dup2(child_end, reading ? STDOUT_FILENO : STDIN_FILENO) < 0) {
+            perror("dup2");
+            _exit(1);
+        }
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        // don't hold other substitutions' pipes open, or their readers
+        // would never see EOF
+        for (int i = 0; i < ctx->subst_fd_num; i++) {
+            close(ctx->subst_fds[i]);
+        }
+
+        if (ctx->builtins && is_builtin(sub_tokens[0])) {
+            int ret = exec_builtin(ctx, sub_tokens, sub_token_num);
+            fflush(stdout);
+            _exit(ret < 0 ? 1 : 0);
+        }
+
+        execv(sub_tokens[0], sub_argv);
+
+        // only reach here if execv failed
+        perror("execv");
+        _exit(1);
+    }
+
+    if (close(child_end) < 0) {
+        perror("close");
+    }
+    ctx->subst_fds[ctx->subst_fd_num++] = shell_end;
+
+    evlog_record(EV_SPAWN, 0, pid, 0, NULL);
+    if (add_job(ctx->job_list, 0, pid, RUNNING, sub_tokens[0]) < 0 ||
+        set_job_hidden(ctx->job_list, pid, 1) < 0) {
+        fprintf(stderr, "Error adding process substitution job");
+    }
+
+    return shell_end;
+}
+
+/*
+ * capture_builtin()
+ * - Description: Runs a pure built-in command (see is_pure_builtin()) inside
+ * the shell with stdout temporarily pointed at a memfd, then reads the output
+ * back. No process is created.
+ *
+ * - Arguments: ctx: the shell context, args, argc: the command's tokens, out,
+ * out_len: set to a malloc'd buffer holding the output and its length
+ *
+ * - Returns: 0 on success, -1 on error
+ */
+int capture_builtin(psh_ctx_t *ctx, char *args[], int argc, char **out,
+                    size_t *out_len) {
+    int mem_fd = memfd_create("psh-capture", MFD_CLOEXEC);
+    if (mem_fd < 0) {
+        perror("memfd_create");
+        return -1;
+    }
+    if (fflush(stdout) < 0) {
+        fprintf(stderr, "Error flushing stdout");
+    }
+    int saved_stdout = dup(STDOUT_FILENO);
+    if (saved_stdout < 0 || dup2(mem_fd, STDOUT_FILENO) < 0) {
+        perror("dup");
+        close(mem_fd);
+        if (saved_stdout >= 0) {
+            close(saved_stdout);
+        }
+        return -1;
+    }
+
+    exec_builtin(ctx, args, argc);
+
+    if (fflush(stdout) < 0) {
+        fprintf(stderr, "Error flushing stdout");
+    }
+    if (dup2(saved_stdout, STDOUT_FILENO) < 0) {
+        perror("dup2");
+    }
+    close(saved_stdout);
+
+    off_t size = lseek(mem_fd, 0, SEEK_CUR);
+    if (size < 0) {
+        perror("lseek");
+        close(mem_fd);
+        return -1;
+    }
+    *out = (char *)malloc((size_t)size + 1);
+    if (*out == NULL) {
+        perror("malloc");
+        close(mem_fd);
+        return -1;
+    }
+    ssize_t got = pread(mem_fd, *out, (size_t)size, 0);
+    close(mem_fd);
+    if (got < 0) {
+        perror("pread");
+        free(*out);
+        return -1;
+    }
+    *out_len = (size_t)got;
+    return 0;
+}
+
+/*
+ * capture_command()
+ * - Description: Runs cmd and collects everything it writes to stdout, for
+ * command substitution. Pure built-ins run inside the shell (see
+ * capture_builtin()); anything else is forked with stdout connected to a
+ * pipe, which is read in large chunks into a growing buffer until EOF. Other
+ * built-ins run in the forked child, so e.g. $(cd dir) does not change the
+ * shell's directory.
+ *
+ * - Arguments: ctx: the shell context, cmd: the command line between the
+ * parentheses (modified by tokenizing), out, out_len: set to a malloc'd buffer
+ * holding the output and its length
+ *
+ * - Returns: 0 on success, -1 on error
+ */
+int capture_command(psh_ctx_t *ctx, char *cmd, char **out, size_t *out_len) {
+    char *sub_tokens[TOKENS_SIZE] = {0};
+    char *sub_argv[ARGV_SIZE] = {0};
+    int sub_token_num = 0;
+    char *save;
+    char *str = cmd;
+    char *token;
+
+    while ((token = strtok_r(str, " \t\n", &save)) != NULL &&
+           sub_token_num < TOKENS_SIZE - 1) {
+        sub_tokens[sub_token_num++] = token;
+        str = NULL;
+    }
+    if (sub_token_num == 0) {  // $() expands to nothing
+        *out = NULL;
+        *out_len = 0;
+        return 0;
+    }
+
+    if (ctx->builtins && is_pure_builtin(sub_tokens[0])) {
+        return capture_builtin(ctx, sub_tokens, sub_token_num, out, out_len);
+    }
+
+    char *last_slash = strrchr(sub_tokens[0], '/');
+    sub_argv[0] = last_slash != NULL ? &last_slash[1] : sub_tokens[0];
+    for (int i = 1; i < sub_token_num; i++) {
+        sub_argv[i] = sub_tokens[i];
+    }
+
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) < 0) {
+        perror("pipe");
+        return -1;
+    }
+    if (fflush(stdout) < 0) {
+        fprintf(stderr, "Error flushing stdout");
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        restore_child_signals();
+        if (dup2(pipe_fds[1], STDOUT_FILENO) < 0) {
+            perror("dup2");
+            _exit(1);
+        }
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+
+        if (ctx->builtins && is_builtin(sub_tokens[0])) {
+            int ret = exec_builtin(ctx, sub_tokens, sub_token_num);
+            fflush(stdout);
+            _exit(ret < 0 ? 1 : 0);
+        }
+
+        execv(sub_tokens[0], sub_argv);
+
+        // only reach here if execv failed
+        perror("execv");
+        _exit(1);
+    }
+
+    close(pipe_fds[1]);
+
+    size_t cap = CAPTURE_READ_SIZE;
+    size_t len = 0;
+    char *buf = (char *)malloc(cap);
+    ssize_t got = buf == NULL ? -1 : 0;
+    while (buf != NULL) {
+        if (cap - len < CAPTURE_READ_SIZE) {
+            char *grown = (char *)realloc(buf, cap * 2);
+            if (grown == NULL) {
+                free(buf);
+                buf = NULL;
+                break;
+            }
+            buf = grown;
+            cap *= 2;
+        }
+        got = read(pipe_fds[0], &buf[len], cap - len);
+        if (got > 0) {
+            len += (size_t)got;
+        } else if (got == 0 || errno != EINTR) {
+            break;
+        }
+    }
+    if (buf == NULL) {
+        perror("malloc");
+    } else if (got < 0) {
+        perror("read");
+    }
+    // the command gets SIGPIPE if it is still writing
+    close(pipe_fds[0]);
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0) {
+        perror("waitpid");
+    }
+
+    if (buf == NULL || got < 0) {
+        free(buf);
+        return -1;
+    }
+    *out = buf;
+    *out_len = len;
+    return 0;
+}
+
+/*
+ * expand_substitutions()
+ * - Description: Expands, left to right, every command substitution and
+ * process substitution in buffer:
+ *   $(cmd) is replaced by the output of cmd, without trailing newlines (see
+ *   capture_command()). It may appear anywhere in a token.
+ *   <(cmd) and >(cmd) are replaced by a /dev/fd/N path connected to cmd by a
+ *   pipe (see start_proc_subst()). They must start a token.
+ * Parentheses inside a substitution may nest, and the inner command is itself
+ * expanded before it is run.
+ *
+ * - Arguments: ctx: the shell context, line: a char array holding the
+ * command line, substituted: if not NULL, set to 1 for each byte of the
+ * expanded line that came from a substitution and 0 for the rest
+ *
+ * - Returns: 0 on success, -1 on error
+ *
+ * - Usage:
+ *      /usr/bin/diff <(/bin/ls a) <(/bin/ls b) ->
+ *      /usr/bin/diff /dev/fd/3 /dev/fd/4
+ *
+ *      /bin/ls $(pwd)/src -> /bin/ls /home/user/src
+ */
+int expand_substitutions(psh_ctx_t *ctx, char line[BUFFER_SIZE],
+                         char substituted[BUFFER_SIZE]) {
+    char expanded[BUFFER_SIZE];
+    size_t expanded_len = 0;
+    char *p = line;
+
+    while (*p != '\0') {
+        int at_token_start =
+            p == line || p[-1] == ' ' || p[-1] == '\t' || p[-1] == '\n';
+        int is_command_subst = p[0] == '$' && p[1] == '(';
+        int is_proc_subst =
+            at_token_start && (p[0] == '<' || p[0] == '>') && p[1] == '(';
+
+        if (is_command_subst || is_proc_subst) {
+            // find the matching close paren
+            char *end = p + 2;
+            int depth = 1;
+            while (*end != '\0' && depth > 0) {
+                if (*end == '(') {
+                    depth++;
+                } else if (*end == ')') {
+                    depth--;
+                }
+                end++;
+            }
+            if (depth > 0) {
+                fprintf(stderr, "syntax error: unterminated substitution\n");
+                return -1;
+            }
+
+            // end is one past the close paren
+            char inner[BUFFER_SIZE];
+            size_t inner_len = (size_t)(end - p) - 3;
+            memcpy(inner, p + 2, inner_len);
+            inner[inner_len] = '\0';
+
+            if (is_proc_subst) {
+                if (expand_substitutions(ctx, inner, NULL) < 0) {
+                    return -1;
+                }
+                uint64_t subst_start = stats_now();
+                int fd = start_proc_subst(ctx, inner, p[0] == '<');
+                ctx->subst_ns += stats_now() - subst_start;
+                p = end;
+                if (fd < 0) {
+                    return -1;
+                }
+                int written = snprintf(&expanded[expanded_len],
+                                       BUFFER_SIZE - expanded_len,
+                                       "/dev/fd/%d", fd);
+                if (written < 0 ||
+                    (size_t)written >= BUFFER_SIZE - expanded_len) {
+                    fprintf(stderr, "syntax error: input line too long\n");
+                    return -1;
+                }
+                if (substituted != NULL) {
+                    memset(&substituted[expanded_len], 1, (size_t)written);
+                }
+                expanded_len += (size_t)written;
+                continue;
+            }
+
+            p = end;
+            char *output;
+            size_t output_len;
+            if (expand_substitutions(ctx, inner, NULL) < 0) {
+                return -1;
+            }
+            uint64_t subst_start = stats_now();
+            int captured = capture_command(ctx, inner, &output, &output_len);
+            ctx->subst_ns += stats_now() - subst_start;
+            if (captured < 0) {
+                return -1;
+            }
+            // strip trailing newlines
+            while (output_len > 0 && output[output_len - 1] == '\n') {
+                output_len--;
+            }
+            if (expanded_len + output_len >= BUFFER_SIZE) {
+                fprintf(stderr, "syntax error: input line too long\n");
+                free(output);
+                return -1;
+            }
+            if (output_len > 0) {
+                memcpy(&expanded[expanded_len], output, output_len);
+                if (substituted != NULL) {
+                    memset(&substituted[expanded_len], 1, output_len);
+                }
+            }
+            expanded_len += output_len;
+            free(output);
+        } else {
+            if (expanded_len + 1 >= BUFFER_SIZE) {
+                fprintf(stderr, "syntax error: input line too long\n");
+                return -1;
+            }
+            if (substituted != NULL) {
+                substituted[expanded_len] = 0;
+            }
+            expanded[expanded_len++] = *p++;
+        }
+    }
+
+    expanded[expanded_len] = '\0';
+    memcpy(line, expanded, expanded_len + 1);
+    return 0;
+}
+
+/*
+ * is_typed()
+ * - Description: Says whether token, a token of the context's buffer, was
+ * typed as it is rather than produced (even in part) by a substitution. Only
+ * typed tokens can be redirection symbols or a trailing &.
+ *
+ * - Arguments: ctx: the shell context, token: a token in ctx->buffer
+ *
+ * - Returns: 1 if no byte of token came from a substitution, 0 otherwise
+ */
+int is_typed(psh_ctx_t *ctx, char *token) {
+    size_t start = (size_t)(token - ctx->buffer);
+    size_t len = strlen(token);
+    return memchr(&ctx->substituted[start], 1, len) == NULL;
+}
+
 /*
  * parse()
- * - Description: creates the token and argv arrays from the buffer character
- *   array. Handles input/output redirection by setting global variables.
+ * - Description: creates the context's token and argv arrays from its buffer
+ *   character array. Handles input/output redirection by setting the
+ *   context's redirection fields. Command and process substitutions are
+ *   expanded first (see expand_substitutions()). Uses strtok_r, so contexts
+ *   may be parsed in several threads at once.
  *
- * - Arguments: buffer: a char array representing user input, tokens: the
- * tokenized input, argv: the argument array eventually used for execv()
+ * - Arguments: ctx: the shell context, whose buffer holds the input line
  *
  * - Returns: 0 on success, -1 on error
  *
@@ -81,15 +665,22 @@ int is_redirection_sym(char *str) {
  *       argv[2] = world!';
  *       argv[3] = NULL;
  */
-int parse(char buffer[BUFFER_SIZE], char *tokens[512], char *argv[512]) {
-    char *str = buffer;
+int parse(psh_ctx_t *ctx) {
+    ctx->subst_ns = 0;
+    if (expand_substitutions(ctx, ctx->buffer, ctx->substituted) < 0) {
+        return -1;
+    }
+
+    char *str = ctx->buffer;
+    char *save;
     char *token;
 
-    while ((token = strtok(str, " \t\n")) != NULL) {
+    while ((token = strtok_r(str, " \t\n", &save)) != NULL &&
+           ctx->token_num < TOKENS_SIZE - 1) {
         // see sept 21 lecture on strtok
-        tokens[token_num] = token;
+        ctx->tokens[ctx->token_num] = token;
         str = NULL;
-        token_num++;
+        ctx->token_num++;
     }
 
     char *tokens_final[512] = {
@@ -99,21 +690,23 @@ int parse(char buffer[BUFFER_SIZE], char *tokens[512], char *argv[512]) {
     int input_redirected = 0;   // has input redirection symbol been parsed
     int output_redirected = 0;  // has output redirection symbol been parsed
 
-    for (int i = 0; i < token_num; i++) {
+    for (int i = 0; i < ctx->token_num; i++) {
         // Redirect input
-        if (strcmp(tokens[i], "<") == 0) {
-            if (tokens[i + 1] == NULL) {
+        if (strcmp(ctx->tokens[i], "<") == 0 &&
+            is_typed(ctx, ctx->tokens[i])) {
+            if (ctx->tokens[i + 1] == NULL) {
                 fprintf(stderr, "syntax error: no input file\n");
                 return -1;
             }
-            if (is_redirection_sym(tokens[i + 1])) {
+            if (is_redirection_sym(ctx->tokens[i + 1]) &&
+                is_typed(ctx, ctx->tokens[i + 1])) {
                 fprintf(stderr,
                         "syntax error: input file is a redirection symbol\n");
                 return -1;
             }
             if (!input_redirected) {
-                input_redirect_code = 1;  // redirect input
-                input_file = tokens[i + 1];
+                ctx->input_redirect_code = 1;  // redirect input
+                ctx->input_file = ctx->tokens[i + 1];
                 input_redirected = 1;
                 i++;  // skip token for input file
             } else {  // input has already been redirected
@@ -122,19 +715,21 @@ int parse(char buffer[BUFFER_SIZE], char *tokens[512], char *argv[512]) {
             }
         }
         // Redirect output with O_CREAT | O_TRUNC, mode=0666
-        else if (strcmp(tokens[i], ">") == 0) {
-            if (tokens[i + 1] == NULL) {
+        else if (strcmp(ctx->tokens[i], ">") == 0 &&
+                 is_typed(ctx, ctx->tokens[i])) {
+            if (ctx->tokens[i + 1] == NULL) {
                 fprintf(stderr, "syntax error: no output file\n");
                 return -1;
             }
-            if (is_redirection_sym(tokens[i + 1])) {
+            if (is_redirection_sym(ctx->tokens[i + 1]) &&
+                is_typed(ctx, ctx->tokens[i + 1])) {
                 fprintf(stderr,
                         "syntax error: output file is a redirection symbol\n");
                 return -1;
             }
             if (!output_redirected) {
-                output_redirect_code = 1;  // redirect output, truncate
-                output_file = tokens[i + 1];
+                ctx->output_redirect_code = 1;  // redirect output, truncate
+                ctx->output_file = ctx->tokens[i + 1];
                 output_redirected = 1;
                 i++;  // skip token for output file
             } else {  // output has already been redirected
@@ -143,19 +738,21 @@ int parse(char buffer[BUFFER_SIZE], char *tokens[512], char *argv[512]) {
             }
         }
         // Redirect output with O_CREAT | O_APPEND, mode=0666
-        else if (strcmp(tokens[i], ">>") == 0) {
-            if (tokens[i + 1] == NULL) {
+        else if (strcmp(ctx->tokens[i], ">>") == 0 &&
+                 is_typed(ctx, ctx->tokens[i])) {
+            if (ctx->tokens[i + 1] == NULL) {
                 fprintf(stderr, "syntax error: no output file\n");
                 return -1;
             }
-            if (is_redirection_sym(tokens[i + 1])) {
+            if (is_redirection_sym(ctx->tokens[i + 1]) &&
+                is_typed(ctx, ctx->tokens[i + 1])) {
                 fprintf(stderr,
                         "syntax error: output file is a redirection symbol\n");
                 return -1;
             }
             if (!output_redirected) {
-                output_redirect_code = 2;  // redirect output, append
-                output_file = tokens[i + 1];
+                ctx->output_redirect_code = 2;  // redirect output, append
+                ctx->output_file = ctx->tokens[i + 1];
                 output_redirected = 1;
                 i++;  // skip token for output file
             } else {  // output has already been redirected
@@ -165,57 +762,115 @@ int parse(char buffer[BUFFER_SIZE], char *tokens[512], char *argv[512]) {
         }
         // Token is not a redirection symbol or target
         else {
-            tokens_final[token_final_num] = tokens[i];
+            tokens_final[token_final_num] = ctx->tokens[i];
             token_final_num++;
         }
     }
 
     // clear tokens array
-    memset(tokens, 0, (size_t)token_num);
+    memset(ctx->tokens, 0, sizeof(char *) * (size_t)ctx->token_num);
 
     // populate tokens array with tokens, sans redirect symbols and input/output
     // files
     for (int i = 0; i < token_final_num; i++) {
-        tokens[i] = tokens_final[i];
+        ctx->tokens[i] = tokens_final[i];
     }
 
     // set token_num to number of non-redirect tokens
-    token_num = token_final_num;
+    ctx->token_num = token_final_num;
 
     // token_num may count "&"
-    if (token_num > 0) {
+    if (ctx->token_num > 0) {
         // handle background processes; remove "&" from tokens and token_num
-        if (strcmp(tokens[token_num - 1], "&") == 0) {
-            bg_process_flag = 1;
-            tokens[token_num - 1] = '\0';
-            token_num = token_num - 1;
+        if (strcmp(ctx->tokens[ctx->token_num - 1], "&") == 0 &&
+            is_typed(ctx, ctx->tokens[ctx->token_num - 1])) {
+            ctx->bg_process_flag = 1;
+            ctx->tokens[ctx->token_num - 1] = '\0';
+            ctx->token_num = ctx->token_num - 1;
         }
     }
 
     // token_num without "&"
-    if (token_num > 0) {
-        char *last_slash = strrchr(tokens[0], '/');
+    if (ctx->token_num > 0) {
+        char *last_slash = strrchr(ctx->tokens[0], '/');
 
         // set argv[0]
         if (last_slash != NULL) {
             char *binary_name = &last_slash[1];
-            argv[0] = binary_name;
+            ctx->argv[0] = binary_name;
         } else {
-            argv[0] = tokens[0];
+            ctx->argv[0] = ctx->tokens[0];
         }
 
         // set argv[1] through argv[argc - 1]
-        for (int i = 1; i < token_num; i++) {
-            argv[i] = tokens[i];
+        for (int i = 1; i < ctx->token_num; i++) {
+            ctx->argv[i] = ctx->tokens[i];
         }
 
         // set argv[argc] to NULL as specified
-        argv[token_num] = NULL;
+        ctx->argv[ctx->token_num] = NULL;
     }
 
     return 0;
 }
 
+/*
+ * drain_sigchld()
+ * - Description: Empties sigchld_fd. Several SIGCHLDs may have been merged
+ * into one, so callers must check every child they care about afterwards.
+ */
+void drain_sigchld(void) {
+    struct signalfd_siginfo info;
+    while (read(sigchld_fd, &info, sizeof(info)) > 0) {
+    }
+}
+
+/*
+ * wait_fg()
+ * - Description: wait4 on a foreground process (reporting stops too), firing
+ * job deadlines (see timers.h) that pass in the meantime. Background jobs
+ * that finish meanwhile are reaped, and queued jobs started in their slots.
+ *
+ * - Arguments: ctx: the shell context, pid: the process to wait for, status,
+ * usage: as for wait4
+ *
+ * - Returns: as wait4
+ */
+pid_t wait_fg(psh_ctx_t *ctx, pid_t pid, int *status, struct rusage *usage) {
+    ctx->fg_pid = pid;
+    while (sigchld_fd >= 0) {
+        // drain first, so a SIGCHLD after the wait4 below wakes the poll
+        drain_sigchld();
+        pid_t got = wait4(pid, status, WNOHANG | WUNTRACED, usage);
+        if (got != 0) {
+            ctx->fg_pid = 0;
+            return got;
+        }
+
+        struct pollfd fds[2] = {
+            {sigchld_fd, POLLIN, 0},
+            {timers_pending() ? timers_fd() : -1, POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            timers_expire();
+        }
+        if (fds[0].revents & POLLIN) {
+            uint64_t reap_start = stats_now();
+            reap_jobs(ctx);
+            stats_record_stage(STAGE_REAP, stats_now() - reap_start);
+        }
+        dispatch_jobs(ctx);
+    }
+    ctx->fg_pid = 0;
+    return wait4(pid, status, WUNTRACED, usage);
+}
+
 /*
  * handle_fg_process()
  * - Description: Pass terminal control to child process, then call waitpid to
@@ -227,8 +882,8 @@ int parse(char buffer[BUFFER_SIZE], char *tokens[512], char *argv[512]) {
  * if command != NULL, this is the first time this job is being run.
  * Add job to job list if suspended.
  *
- * - Arguments: child_pid: the pid of the fg process, command: the name of the
- * command or NULL
+ * - Arguments: ctx: the shell context, child_pid: the pid of the fg process,
+ * command: the name of the command or NULL
  *
  * - Returns: 0 on success, -1 on error
  *
@@ -237,7 +892,7 @@ int parse(char buffer[BUFFER_SIZE], char *tokens[512], char *argv[512]) {
  *      handle_fg_process(17792, "/bin/sleep");
  */
 
-int handle_fg_process(pid_t child_pid, char *command) {
+int handle_fg_process(psh_ctx_t *ctx, pid_t child_pid, char *command) {
     // Give foreground child process group terminal control
     if (tcsetpgrp(STDIN_FILENO, child_pid) < 0) {
         perror("tcsetpgrp");
@@ -246,20 +901,49 @@ int handle_fg_process(pid_t child_pid, char *command) {
 
     /* Wait for fg process to finish */
     int fg_status;
-    waitpid(child_pid, &fg_status, WUNTRACED);
+    struct rusage fg_usage;
+    uint64_t wait_start = stats_now();
+    wait_fg(ctx, child_pid, &fg_status, &fg_usage);
+    stats_record_stage(STAGE_WAIT, stats_now() - wait_start);
+    ctx->fg_status = fg_status;
+    // a new job only gets a jid if it is suspended
+    evlog_record_wait(command == NULL
+                          ? get_job_jid(ctx->job_list, child_pid)
+                          : (WIFSTOPPED(fg_status) ? ctx->next_avail_jid : 0),
+                      child_pid, fg_status, &fg_usage);
+
+    // a finished job's deadline is dropped; say if it is why the job ended
+    char reason[128] = "";
+    if (WIFEXITED(fg_status) || WIFSIGNALED(fg_status)) {
+        timers_finish(child_pid, reason, sizeof(reason));
+        perfstat_report(
+            command == NULL ? get_job_jid(ctx->job_list, child_pid) : 0,
+            child_pid);
+    }
 
     /* Job is already on job list (called during fg subroutine) */
     if (command == NULL) {
         // get jid
         int fg_jid;
-        if ((fg_jid = get_job_jid(job_list, child_pid)) < 0) {
+        if ((fg_jid = get_job_jid(ctx->job_list, child_pid)) < 0) {
             fprintf(stderr, "Error getting jid");
             return -1;
         }
+        job_supervise_t supervise;
+        int supervised =
+            get_job_supervise(ctx->job_list, fg_jid, &supervise) == 0;
         // Exited normally
         if (WIFEXITED(fg_status)) {
-            /* Remove job from job list */
-            if (remove_job_pid(job_list, child_pid) < 0) {
+            // only worth a message if the job's deadline passed, or if it is
+            // supervised and may be restarted
+            if ((reason[0] != '\0' || supervised) &&
+                printf("[%d] (%d) terminated with exit status %d%s\n", fg_jid,
+                       child_pid, WEXITSTATUS(fg_status), reason) < 0) {
+                fprintf(stderr, "Error printing");
+            }
+            /* Remove job from job list, unless it is restarted */
+            if (!restart_job(ctx, fg_jid, fg_status) &&
+                remove_job_pid(ctx->job_list, child_pid) < 0) {
                 fprintf(stderr, "Error removing job");
             }
         }
@@ -267,13 +951,14 @@ int handle_fg_process(pid_t child_pid, char *command) {
         if (WIFSIGNALED(fg_status)) {
             int signum = WTERMSIG(fg_status);
             // print message with current jid
-            if (printf("[%d] (%d) terminated by signal %d\n", fg_jid, child_pid,
-                       signum) < 0) {
+            if (printf("[%d] (%d) terminated by signal %d%s\n", fg_jid,
+                       child_pid, signum, reason) < 0) {
                 fprintf(stderr, "Error printing");
                 return -1;
             }
-            /* Remove job from job list */
-            if (remove_job_pid(job_list, child_pid) < 0) {
+            /* Remove job from job list, unless it is restarted */
+            if (!restart_job(ctx, fg_jid, fg_status) &&
+                remove_job_pid(ctx->job_list, child_pid) < 0) {
                 fprintf(stderr, "Error removing job");
                 return -1;
             }
@@ -287,7 +972,7 @@ int handle_fg_process(pid_t child_pid, char *command) {
                 fprintf(stderr, "Error printing");
                 return -1;
             }
-            if (update_job_pid(job_list, child_pid, STOPPED) < 0) {
+            if (update_job_pid(ctx->job_list, child_pid, STOPPED) < 0) {
                 fprintf(stderr, "Error updating job state");
                 return -1;
             }
@@ -296,12 +981,21 @@ int handle_fg_process(pid_t child_pid, char *command) {
     }
     /* Job is being run for the first time. Add to job list if suspended. */
     else {
+        // Exited normally after its deadline passed
+        if (WIFEXITED(fg_status) && reason[0] != '\0') {
+            if (printf("[%d] (%d) terminated with exit status %d%s\n",
+                       ctx->next_avail_jid, child_pid, WEXITSTATUS(fg_status),
+                       reason) < 0) {
+                fprintf(stderr, "Error printing");
+                return -1;
+            }
+        }
         // Foreground process terminated by signal
         if (WIFSIGNALED(fg_status)) {
             int signum = WTERMSIG(fg_status);
             // print message with next available jid (arbitrary)
-            if (printf("[%d] (%d) terminated by signal %d\n", next_avail_jid,
-                       child_pid, signum) < 0) {
+            if (printf("[%d] (%d) terminated by signal %d%s\n",
+                       ctx->next_avail_jid, child_pid, signum, reason) < 0) {
                 fprintf(stderr, "Error printing");
                 return -1;
             }
@@ -310,22 +1004,22 @@ int handle_fg_process(pid_t child_pid, char *command) {
         if (WIFSTOPPED(fg_status)) {
             int signum = WSTOPSIG(fg_status);
             // print message with next_avail_jid (arbitrary)
-            if (printf("[%d] (%d) suspended by signal %d\n", next_avail_jid,
-                       child_pid, signum) < 0) {
+            if (printf("[%d] (%d) suspended by signal %d\n",
+                       ctx->next_avail_jid, child_pid, signum) < 0) {
                 fprintf(stderr, "Error printing");
                 return -1;
             }
-            if (add_job(job_list, next_avail_jid, child_pid, STOPPED, command) <
-                0) {
+            if (add_job(ctx->job_list, ctx->next_avail_jid, child_pid, STOPPED,
+                        command) < 0) {
                 fprintf(stderr, "Error adding job");
                 return -1;
             }
-            next_avail_jid++;
+            ctx->next_avail_jid++;
         }
     }
 
     /* Pass terminal control back to parent (shell) */
-    if (tcsetpgrp(STDIN_FILENO, shell_pgid) < 0) {
+    if (tcsetpgrp(STDIN_FILENO, ctx->shell_pgid) < 0) {
         perror("tcsetpgrp");
         return -1;
     }
@@ -339,392 +1033,2136 @@ int handle_fg_process(pid_t child_pid, char *command) {
  * handlers, and does file redirection. Calls execv. If in parent process, does
  * nothing.
  *
- * - Arguments: child_pid: the process id of the child process
+ * - Arguments: ctx: the shell context, child_pid: the process id of the child
+ * process
  */
-void exec_child(pid_t child_pid) {
+void exec_child(psh_ctx_t *ctx, pid_t child_pid) {
     // Child Process
     if (child_pid == 0) {
+        uint64_t child_start = stats_now();
+
         /* Set child's pgid to its pid (to make distinct from parent's pgid) */
         if (setpgid(getpid(), getpid()) < 0) {
             perror("setpgid");
-            exit(1);
+            _exit(1);
         }
 
         /* Set previously ignored signals back to default behavior for
          * child */
-        if (signal(SIGTTOU, SIG_DFL) == SIG_ERR) {
-            perror("signal");
-            exit(1);
-        }
-        if (signal(SIGINT, SIG_DFL) == SIG_ERR) {
-            perror("signal");
-            exit(1);
-        }
-        if (signal(SIGTSTP, SIG_DFL) == SIG_ERR) {
-            perror("signal");
-            exit(1);
+        restore_child_signals();
+
+        /* Pin background job to the CPUs picked by place_job() */
+        if (ctx->job_cpus_set &&
+            sched_setaffinity(0, sizeof(ctx->job_cpus), &ctx->job_cpus) < 0) {
+            perror("sched_setaffinity");
         }
-        if (signal(SIGQUIT, SIG_DFL) == SIG_ERR) {
-            perror("signal");
-            exit(1);
+
+        /* Pass the process substitution pipes on to the command */
+        for (int i = 0; i < ctx->subst_fd_num; i++) {
+            if (fcntl(ctx->subst_fds[i], F_SETFD, 0) < 0) {
+                perror("fcntl");
+            }
         }
 
         /* I/O Redirection */
-        if (input_redirect_code == 1) {  // input
+        if (ctx->input_redirect_code == 1) {  // input
             if (close(STDIN_FILENO) < 0) {
                 perror("close");
             }
-            if (open(input_file, O_RDONLY, 0) < 0) {
+            if (open(ctx->input_file, O_RDONLY, 0) < 0) {
                 perror("open");
             }
         }
 
-        if (output_redirect_code == 1) {  // output truncated
+        if (ctx->output_redirect_code == 1) {  // output truncated
             if (close(STDOUT_FILENO) < 0) {
                 perror("close");
             }
-            if (open(output_file, O_RDWR | O_CREAT | O_TRUNC, 0666) <
+            if (open(ctx->output_file, O_RDWR | O_CREAT | O_TRUNC, 0666) <
                 0) {  // read write mode is 0666
                 perror("open");
             }
-        } else if (output_redirect_code == 2) {  // output appended
+        } else if (ctx->output_redirect_code == 2) {  // output appended
             if (close(STDOUT_FILENO) < 0) {
                 perror("close");
             }
-            if (open(output_file, O_RDWR | O_CREAT | O_APPEND, 0666) <
+            if (open(ctx->output_file, O_RDWR | O_CREAT | O_APPEND, 0666) <
                 0) {  // read write mode is 0666
                 perror("open");
             }
         }
 
-        execv(tokens[0], argv);
+        // the wait below is on the shell, so it is left out of the exec stage
+        if (ctx->time_exec) {
+            stats_exec_mark(child_start);
+        }
+
+        /* Wait for the shell to open the job's performance counters */
+        perfstat_child_wait(&ctx->perf_sync);
+
+        execv(ctx->tokens[0], ctx->argv);
 
         // only reach here if execv failed
         perror("execv");
-        exit(1);
+        _exit(1);
     }
 }
 
 /*
- * reap_jobs()
- * - Description: waitpid on all jobs in job list, printing and updating job
- * list as needed.
+ * set_command()
+ * - Description: Points tokens, argv and token_num at the command args, for
+ * exec_child(). args may point into tokens.
+ *
+ * - Arguments: ctx: the shell context, args: the command's tokens, argc: the
+ * number of tokens
  */
-void reap_jobs(void) {
-    pid_t current_pid;
-    while ((current_pid = get_next_pid(job_list)) > 0) {
-        // get jid
-        int current_jid;
-        if ((current_jid = get_job_jid(job_list, current_pid)) < 0) {
-            fprintf(stderr, "Error getting job jid");
-        }
+void set_command(psh_ctx_t *ctx, char *args[], int argc) {
+    for (int i = 0; i < argc; i++) {
+        ctx->tokens[i] = args[i];
+    }
+    ctx->tokens[argc] = NULL;
 
-        int status;
-        /* If current child process changed state, update job list and print
-         * explanation */
-        if (waitpid(current_pid, &status, WNOHANG | WUNTRACED | WCONTINUED) >
-            0) {
-            // Exited normally
-            if (WIFEXITED(status)) {
-                int exit_status = WEXITSTATUS(status);
-                if (printf("[%d] (%d) terminated with exit status %d\n",
-                           current_jid, current_pid, exit_status) < 0) {
-                    fprintf(stderr, "Error printing");
-                }
-                /* Remove job from job list */
-                if (remove_job_pid(job_list, current_pid) < 0) {
-                    fprintf(stderr, "Error removing job");
-                }
-            }
-            // Terminated by signal
-            else if (WIFSIGNALED(status)) {
-                int signum = WTERMSIG(status);
-                // print message
-                if (printf("[%d] (%d) terminated by signal %d\n", current_jid,
-                           current_pid, signum) < 0) {
-                    fprintf(stderr, "Error printing");
-                }
-                /* Remove job from job list */
-                if (remove_job_pid(job_list, current_pid) < 0) {
-                    fprintf(stderr, "Error removing job");
-                }
-            }
-            // Suspended via signal
-            else if (WIFSTOPPED(status)) {
-                if (update_job_pid(job_list, current_pid, STOPPED) < 0) {
-                    fprintf(stderr, "Error updating job state");
+    char *last_slash = strrchr(ctx->tokens[0], '/');
+    ctx->argv[0] = last_slash != NULL ? &last_slash[1] : ctx->tokens[0];
+    for (int i = 1; i < argc; i++) {
+        ctx->argv[i] = ctx->tokens[i];
+    }
+    ctx->argv[argc] = NULL;
+    ctx->token_num = argc;
+}
+
+/*
+ * place_job()
+ * - Description: Picks the CPUs background job jid will run on under the
+ * affinity policy, for exec_child() to apply in the child. Call before fork,
+ * and call record_job_cpus() in the parent after.
+ *
+ * - Arguments: ctx: the shell context, jid: the job id of the job about to be
+ * forked
+ */
+void place_job(psh_ctx_t *ctx, int jid) {
+    ctx->job_cpus_set = affinity_place(ctx->job_list, jid, &ctx->job_cpus) == 0;
+}
+
+/*
+ * record_job_cpus()
+ * - Description: Records the CPUs picked by place_job() in job jid's entry in
+ * the job list, for jobs -l.
+ *
+ * - Arguments: ctx: the shell context, jid: the job id of the job that was just
+ * forked
+ */
+void record_job_cpus(psh_ctx_t *ctx, int jid) {
+    if (ctx->job_cpus_set) {
+        char cpus[256];
+        if (affinity_format(&ctx->job_cpus, cpus, sizeof(cpus)) == 0) {
+            set_job_cpus(ctx->job_list, jid, cpus);
+        }
+        ctx->job_cpus_set = 0;
+    }
+}
+
+/*
+ * start_queued_job()
+ * - Description: Forks and execs the saved command of queued job jid (see
+ * sched.h) at the job's priority, marks the job RUNNING and prints its job id
+ * and process id. Does not check the running job limit.
+ *
+ * - Arguments: ctx: the shell context, jid: the job id of a queued job
+ *
+ * - Returns: 0 on success, -1 on error
+ */
+int start_queued_job(psh_ctx_t *ctx, int jid) {
+    sched_spec_t *spec = sched_take(jid);
+    if (spec == NULL) {
+        // nothing can ever start this job
+        fprintf(stderr, "Error starting queued job");
+        remove_job_jid(ctx->job_list, jid);
+        return -1;
+    }
+    int priority = get_job_priority(ctx->job_list, jid);
+
+    place_job(ctx, jid);
+    perfstat_begin(&ctx->perf_sync, perfstat_enabled());
+    uint64_t fork_start = stats_now();
+    pid_t child_pid = fork();
+    if (child_pid < 0) {
+        perror("fork");
+        perfstat_attach(&ctx->perf_sync, child_pid);
+        ctx->job_cpus_set = 0;
+        // keep the job queued to be tried again later
+        sched_save(jid, spec->tokens, spec->token_num, spec->input_file,
+                   spec->output_file, spec->output_redirect_code);
+        sched_free(spec);
+        return -1;
+    }
+
+    if (child_pid == 0) {
+        // nice() may return -1 on success, so check errno instead
+        errno = 0;
+        if (priority != 0 && nice(priority) == -1 && errno != 0) {
+            perror("nice");
+        }
+
+        /* Point the command line globals at the saved command */
+        set_command(ctx, spec->tokens, spec->token_num);
+        ctx->input_redirect_code = spec->input_file != NULL;
+        ctx->input_file = spec->input_file;
+        ctx->output_redirect_code = spec->output_redirect_code;
+        ctx->output_file = spec->output_file;
+
+        exec_child(ctx, child_pid);
+    }
+
+    stats_record_stage(STAGE_FORK, stats_now() - fork_start);
+    perfstat_attach(&ctx->perf_sync, child_pid);
+    evlog_record(EV_SPAWN, jid, child_pid, 0, NULL);
+    // a supervised job's command is kept to restart it with
+    job_supervise_t supervise;
+    if (get_job_supervise(ctx->job_list, jid, &supervise) == 0) {
+        sched_save(jid, spec->tokens, spec->token_num, spec->input_file,
+                   spec->output_file, spec->output_redirect_code);
+        // fg or bg may start it before its backoff is over
+        timers_cancel_restart(jid);
+        supervise.waiting = 0;
+        supervise.started_ns = stats_now();
+        set_job_supervise(ctx->job_list, jid, &supervise);
+    }
+    sched_free(spec);
+
+    record_job_cpus(ctx, jid);
+    if (set_job_pid(ctx->job_list, jid, child_pid) < 0 ||
+        update_job_jid(ctx->job_list, jid, RUNNING) < 0) {
+        fprintf(stderr, "Error updating job state");
+        return -1;
+    }
+    // the deadline counts from when the job starts, not from when it queued
+    job_timeout_t timeout;
+    if (get_job_timeout(ctx->job_list, jid, &timeout) == 0) {
+        timers_add(jid, child_pid, &timeout);
+    }
+    if (printf("[%d] (%d)\n", jid, child_pid) < 0) {
+        fprintf(stderr, "Error printing job id and pid of background process");
+    }
+    return 0;
+}
+
+/*
+ * dispatch_jobs()
+ * - Description: Starts queued jobs, best priority first, while the running
+ * job limit allows. Supervised jobs whose backoff is over are queued again
+ * first.
+ *
+ * - Arguments: ctx: the shell context
+ *
+ * - Returns: the number of jobs started
+ */
+int dispatch_jobs(psh_ctx_t *ctx) {
+    int started = 0;
+    int jid;
+    while ((jid = timers_next_restart()) > 0) {
+        job_supervise_t supervise;
+        if (get_job_supervise(ctx->job_list, jid, &supervise) == 0) {
+            supervise.waiting = 0;
+            set_job_supervise(ctx->job_list, jid, &supervise);
+        }
+    }
+    while (sched_can_start(ctx->job_list) &&
+           (jid = get_next_queued(ctx->job_list)) > 0) {
+        if (start_queued_job(ctx, jid) < 0) {
+            break;
+        }
+        started++;
+    }
+    return started;
+}
+
+/*
+ * submit_job()
+ * - Description: Adds a background job for the command args (redirected as
+ * the current input line says) to the job list as QUEUED with the given
+ * priority, deadline and restart policy, then starts queued jobs the running
+ * job limit allows.
+ *
+ * - Arguments: ctx: the shell context, args: the command's tokens, argc: the
+ * number of tokens, priority: the job's nice value; lower values start first,
+ * timeout: the job's deadline or NULL, supervise: the job's restart policy,
+ * or NULL if it is not supervised
+ *
+ * - Returns: 0 on success, -1 on error
+ */
+int submit_job(psh_ctx_t *ctx, char *args[], int argc, int priority,
+               const job_timeout_t *timeout,
+               const job_supervise_t *supervise) {
+    int jid = ctx->next_avail_jid;
+    if (add_job(ctx->job_list, jid, 0, QUEUED, args[0]) < 0) {
+        fprintf(stderr, "Error adding background job");
+        return -1;
+    }
+    ctx->next_avail_jid++;
+    set_job_priority(ctx->job_list, jid, priority);
+    set_job_timeout(ctx->job_list, jid, timeout);
+    set_job_supervise(ctx->job_list, jid, supervise);
+    if (sched_save(jid, args, argc, ctx->input_file, ctx->output_file,
+                   ctx->output_redirect_code) < 0) {
+        fprintf(stderr, "Error queueing background job");
+        remove_job_jid(ctx->job_list, jid);
+        return -1;
+    }
+
+    dispatch_jobs(ctx);
+    if (get_job_pid(ctx->job_list, jid) == 0 &&
+        printf("[%d] (-) queued #%d\n", jid,
+               get_queue_position(ctx->job_list, jid)) < 0) {
+        fprintf(stderr, "Error printing job id of queued process");
+    }
+    return 0;
+}
+
+/*
+ * run_command()
+ * - Description: Forks and execs the command in tokens and argv, redirected
+ * as the current input line says. A background command is added to the job
+ * list right away; a foreground command is waited for with
+ * handle_fg_process().
+ *
+ * - Arguments: ctx: the shell context, timeout: the command's deadline, or NULL
+ * for none
+ */
+void run_command(psh_ctx_t *ctx, const job_timeout_t *timeout) {
+    if (ctx->bg_process_flag) {
+        place_job(ctx, ctx->next_avail_jid);
+    }
+    perfstat_begin(&ctx->perf_sync, ctx->perf_count || perfstat_enabled());
+    ctx->perf_count = 0;
+    if (!ctx->bg_process_flag) {
+        stats_exec_start();
+        ctx->time_exec = 1;
+    }
+    uint64_t fork_start = stats_now();
+    int child_pid = fork();
+    if (child_pid > 0) {
+        stats_record_stage(STAGE_FORK, stats_now() - fork_start);
+    }
+    // only this child times its setup, not the jobs the shell forks later
+    if (child_pid != 0) {
+        ctx->time_exec = 0;
+        perfstat_attach(&ctx->perf_sync, child_pid);
+    }
+    if (child_pid > 0) {
+        evlog_record(EV_SPAWN, ctx->bg_process_flag ? ctx->next_avail_jid : 0,
+                     child_pid, 0, NULL);
+        if (timeout != NULL) {
+            timers_add(ctx->bg_process_flag ? ctx->next_avail_jid : 0,
+                       child_pid, timeout);
+        }
+    }
+
+    /* exec_child contains all logic for if (child_pid == 0) */
+    exec_child(ctx, child_pid);
+
+    // the child has its own copies of the substitution pipes
+    close_subst_fds(ctx);
+
+    /* For bg processes: add to job list, print job id and process id */
+    if (ctx->bg_process_flag) {
+        if (add_job(ctx->job_list, ctx->next_avail_jid, child_pid, RUNNING,
+                    ctx->tokens[0]) < 0) {
+            fprintf(stderr, "Error adding background job");
+        }
+        record_job_cpus(ctx, ctx->next_avail_jid);
+        set_job_timeout(ctx->job_list, ctx->next_avail_jid, timeout);
+        if (printf("[%d] (%d)\n", ctx->next_avail_jid, child_pid) < 0) {
+            fprintf(stderr,
+                    "Error printing job id and pid of background process");
+        }
+        ctx->next_avail_jid++;
+    }
+    /* For fg processes: waitpid until process finishes */
+    else {
+        if (handle_fg_process(ctx, child_pid, ctx->tokens[0]) < 0) {
+            fprintf(stderr, "Error handling foreground process");
+            cleanup_job_list(ctx->job_list);
+            exit(1);
+        }
+        stats_exec_record();
+        // a suspended command joined the job list; keep its deadline there
+        if (WIFSTOPPED(ctx->fg_status)) {
+            set_job_timeout(ctx->job_list, ctx->next_avail_jid - 1, timeout);
+        }
+        stats_record_command(ctx->tokens[0], stats_now() - fork_start);
+    }
+}
+
+/*
+ * is_builtin()
+ * - Description: Returns 1 if name is a built-in command, 0 otherwise.
+ *
+ * - Arguments: name: the first token of a command
+ */
+int is_builtin(char *name) {
+    return !(strcmp(name, "exit") && strcmp(name, "cd") &&
+             strcmp(name, "ln") && strcmp(name, "rm") && strcmp(name, "fg") &&
+             strcmp(name, "bg") && strcmp(name, "jobs") &&
+             strcmp(name, "echo") && strcmp(name, "pwd") &&
+             strcmp(name, "stats") && strcmp(name, "batch") &&
+             strcmp(name, "sched") && strcmp(name, "affinity") &&
+             strcmp(name, "timeout") && strcmp(name, "wait") &&
+             strcmp(name, "z") && strcmp(name, "memo") &&
+             strcmp(name, "perfstat") && strcmp(name, "supervise"));
+}
+
+/*
+ * is_pure_builtin()
+ * - Description: Returns 1 if name is a built-in command whose only effect is
+ * writing to stdout, so it can be run inside the shell for command
+ * substitution. Returns 0 otherwise.
+ *
+ * - Arguments: name: the first token of a command
+ */
+int is_pure_builtin(char *name) {
+    return !(strcmp(name, "echo") && strcmp(name, "pwd") &&
+             strcmp(name, "jobs") && strcmp(name, "stats") &&
+             strcmp(name, "sched"));
+}
+
+/*
+ * jump_dir()
+ * - Description: Changes to the directory the frecency database ranks highest
+ * among those matching terms (see frecency_query()), other than the current
+ * one. Directories that can no longer be entered are forgotten and the next
+ * best is tried. Prints an error message if none matches.
+ *
+ * - Arguments: terms: the patterns to match, term_num: the number of patterns
+ *
+ * - Returns: 0 on success, -1 on error
+ */
+int jump_dir(char *terms[], int term_num) {
+    char cwd[PATH_MAX];
+    const char *exclude = getcwd(cwd, PATH_MAX);
+    char dir[PATH_MAX];
+    while (frecency_query(terms, term_num, exclude, dir, PATH_MAX) == 0) {
+        if (chdir(dir) == 0) {
+            frecency_visit(dir);
+            return 0;
+        }
+        frecency_forget(dir);
+    }
+    fprintf(stderr, "cd: no directory matches\n");
+    return -1;
+}
+
+/*
+ * link_files()
+ * - Description: Runs ln TARGET LINK, which makes LINK a hard link to
+ * TARGET, or ln TARGET... DIR, which links each TARGET into the existing
+ * directory DIR under its own name. Prints an error message for each link
+ * that fails and carries on with the rest.
+ *
+ * - Arguments: args: the command's tokens, argc: the number of tokens
+ *
+ * - Returns: 0 on success, -1 on error
+ */
+int link_files(char *args[], int argc) {
+    if (argc < 3) {
+        fprintf(stderr, "ln: syntax error\n");
+        return -1;
+    }
+    char *dir = args[argc - 1];
+    struct stat st;
+    if (stat(dir, &st) < 0 || !S_ISDIR(st.st_mode)) {
+        if (argc > 3) {
+            fprintf(stderr, "ln: %s: not a directory\n", dir);
+            return -1;
+        }
+        if (link(args[1], dir) < 0) {
+            perror("link");
+            return -1;
+        }
+        return 0;
+    }
+
+    int failed = 0;
+    for (int i = 1; i < argc - 1; i++) {
+        char *name = strrchr(args[i], '/');
+        name = name != NULL ? name + 1 : args[i];
+        char path[PATH_MAX];
+        if (snprintf(path, PATH_MAX, "%s/%s", dir, name) >= PATH_MAX) {
+            fprintf(stderr, "ln: %s/%s: path too long\n", dir, name);
+            failed = 1;
+        } else if (link(args[i], path) < 0) {
+            fprintf(stderr, "ln: %s: %s\n", path, strerror(errno));
+            failed = 1;
+        }
+    }
+    return failed ? -1 : 0;
+}
+
+/*
+ * remove_files()
+ * - Description: Runs rm [-r] [-f] FILE..., which unlinks each FILE. With
+ * -r (or -R), directories are removed with everything under them, by
+ * rmtree_remove() on up to one thread per CPU. With -f, files that don't
+ * exist are not errors. Refuses to remove /, . and .. recursively. Prints an
+ * error message for each file that can't be removed and carries on with the
+ * rest.
+ *
+ * - Arguments: args: the command's tokens, argc: the number of tokens
+ *
+ * - Returns: 0 on success, -1 on error
+ */
+int remove_files(char *args[], int argc) {
+    int recursive = 0;
+    int force = 0;
+    int first = 1;
+    for (; first < argc && args[first][0] == '-' && args[first][1] != '\0';
+         first++) {
+        if (strcmp(args[first], "--") == 0) {
+            first++;
+            break;
+        }
+        for (char *flag = &args[first][1]; *flag != '\0'; flag++) {
+            if (*flag == 'r' || *flag == 'R') {
+                recursive = 1;
+            } else if (*flag == 'f') {
+                force = 1;
+            } else {
+                fprintf(stderr, "rm: syntax error\n");
+                return -1;
+            }
+        }
+    }
+    if (first == argc && !force) {
+        fprintf(stderr, "rm: syntax error\n");
+        return -1;
+    }
+
+    int failed = 0;
+    for (int i = first; i < argc; i++) {
+        if (!recursive) {
+            if (unlink(args[i]) < 0 && !(force && errno == ENOENT)) {
+                fprintf(stderr, "rm: %s: %s\n", args[i], strerror(errno));
+                failed = 1;
+            }
+            continue;
+        }
+        // find the last component, ignoring trailing slashes
+        size_t end = strlen(args[i]);
+        while (end > 0 && args[i][end - 1] == '/') {
+            end--;
+        }
+        size_t start = end;
+        while (start > 0 && args[i][start - 1] != '/') {
+            start--;
+        }
+        if (end == 0 || strncmp(&args[i][start], ".", end - start) == 0 ||
+            strncmp(&args[i][start], "..", end - start) == 0) {
+            fprintf(stderr, "rm: refusing to remove %s\n", args[i]);
+            failed = 1;
+        } else if (rmtree_remove(args[i], rmtree_default_threads(), force) <
+                   0) {
+            failed = 1;
+        }
+    }
+    return failed ? -1 : 0;
+}
+
+/*
+ * open_output()
+ * - Description: Opens the output the current command line redirects to, as
+ * exec_child() would, or returns stdout if it doesn't redirect.
+ *
+ * - Arguments: ctx: the shell context
+ *
+ * - Returns: the fd, or -1 on error
+ */
+int open_output(psh_ctx_t *ctx) {
+    if (ctx->output_redirect_code == 0) {
+        return STDOUT_FILENO;
+    }
+    int flags = ctx->output_redirect_code == 1 ? O_TRUNC : O_APPEND;
+    int fd = open(ctx->output_file, O_WRONLY | O_CREAT | O_CLOEXEC | flags,
+                  0666);
+    if (fd < 0) {
+        perror("open");
+    }
+    return fd;
+}
+
+/*
+ * serve_output()
+ * - Description: Copies the file at path (or the open file fd, if path is
+ * NULL) to where the current command line sends output (see memo_serve()).
+ *
+ * - Arguments: ctx: the shell context, fd: an open file or -1, path: the
+ * file to open if fd is -1
+ *
+ * - Returns: 0 on success, -1 on error
+ */
+int serve_output(psh_ctx_t *ctx, int fd, const char *path) {
+    int from = fd >= 0 ? fd : open(path, O_RDONLY | O_CLOEXEC);
+    int to = from >= 0 ? open_output(ctx) : -1;
+    // anything the shell printed must come first
+    fflush(stdout);
+    int failed = to < 0 || memo_serve(from, to) < 0;
+    if (failed) {
+        fprintf(stderr, "memo: error writing output\n");
+    }
+    if (to > STDOUT_FILENO) {
+        close(to);
+    }
+    if (from >= 0) {
+        close(from);
+    }
+    return failed ? -1 : 0;
+}
+
+/*
+ * memo_command()
+ * - Description: Runs memo [-i FILE]... [-e VAR]... [-m] cmd args..., which
+ * serves cmd's stdout from the cache in PSH_MEMO_DIR (default
+ * ~/.cache/psh-memo) if it was run before with the same argv, executable,
+ * values of the -e variables, and content of the -i files and the < file
+ * (with -m, their sizes and mtimes). Otherwise runs cmd in the foreground
+ * with stdout going to a new cache file, then copies the file to stdout (or
+ * the > file) and keeps it in the cache if cmd exited with status 0. Output
+ * of a miss appears when cmd finishes.
+ *
+ * - Arguments: ctx: the shell context, args: the command's tokens, argc: the
+ * number of tokens
+ *
+ * - Returns: 0 on success, -1 on error
+ */
+int memo_command(psh_ctx_t *ctx, char *args[], int argc) {
+    char *inputs[TOKENS_SIZE];
+    char *env_names[TOKENS_SIZE];
+    int input_num = 0;
+    int env_num = 0;
+    int by_mtime = 0;
+    int first = 1;  // index of the command
+    for (; first < argc && args[first][0] == '-'; first++) {
+        if (strcmp(args[first], "-m") == 0) {
+            by_mtime = 1;
+        } else if (strcmp(args[first], "-i") == 0 && first + 1 < argc) {
+            inputs[input_num++] = args[++first];
+        } else if (strcmp(args[first], "-e") == 0 && first + 1 < argc) {
+            env_names[env_num++] = args[++first];
+        } else {
+            break;
+        }
+    }
+    if (first >= argc || args[first][0] == '-') {
+        fprintf(stderr,
+                "memo: usage: memo [-i FILE]... [-e VAR]... [-m] cmd\n");
+        return -1;
+    }
+    if (is_builtin(args[first])) {
+        fprintf(stderr, "memo: %s is a shell builtin\n", args[first]);
+        return -1;
+    }
+    if (ctx->bg_process_flag || ctx->subst_fd_num > 0) {
+        fprintf(stderr, "memo: can't run in the background or with <(...)\n");
+        return -1;
+    }
+    if (ctx->input_redirect_code == 1) {
+        inputs[input_num++] = ctx->input_file;
+    }
+
+    char dir[PATH_MAX];
+    char *memo_dir = getenv("PSH_MEMO_DIR");
+    char *home = getenv("HOME");
+    if (memo_dir != NULL && *memo_dir != '\0') {
+        snprintf(dir, PATH_MAX, "%s", memo_dir);
+    } else if (home != NULL && *home != '\0') {
+        snprintf(dir, PATH_MAX, "%s/.cache/psh-memo", home);
+    } else {
+        fprintf(stderr, "memo: set PSH_MEMO_DIR or HOME\n");
+        return -1;
+    }
+
+    char key[MEMO_HEX_SIZE];
+    if (memo_key(&args[first], argc - first, env_names, env_num, inputs,
+                 input_num, by_mtime, key) < 0) {
+        return -1;
+    }
+    int cached = memo_lookup(dir, key);
+    if (cached >= 0) {
+        return serve_output(ctx, cached, NULL);
+    }
+
+    // run the command into a cache file instead of the line's > file
+    char tmp[PATH_MAX];
+    if (memo_begin(dir, tmp, PATH_MAX) < 0) {
+        return -1;
+    }
+    int output_redirect_code = ctx->output_redirect_code;
+    char *output_file = ctx->output_file;
+    set_command(ctx, &args[first], argc - first);
+    ctx->output_redirect_code = 1;
+    ctx->output_file = tmp;
+    ctx->fg_status = 0;
+    run_command(ctx, NULL);
+    ctx->output_redirect_code = output_redirect_code;
+    ctx->output_file = output_file;
+
+    if (WIFSTOPPED(ctx->fg_status)) {
+        // its output goes to a file nobody will read
+        fprintf(stderr, "memo: output of a stopped command is lost\n");
+        unlink(tmp);
+        return -1;
+    }
+    int failed = serve_output(ctx, -1, tmp) < 0;
+    if (WIFEXITED(ctx->fg_status) && WEXITSTATUS(ctx->fg_status) == 0) {
+        failed |= memo_store(dir, key, tmp) < 0;
+    } else {
+        unlink(tmp);
+    }
+    return failed ? -1 : 0;
+}
+
+/*
+ * exec_builtin()
+ * - Description: Runs the built-in command args[0] with arguments args[1]
+ * through args[argc - 1]. Prints an error message on failure.
+ *
+ * - Arguments: ctx: the shell context, args: the command's tokens, argc: the
+ * number of tokens
+ *
+ * - Returns: 0 on success, -1 on error
+ */
+int exec_builtin(psh_ctx_t *ctx, char *args[], int argc) {
+    // exit
+    if (strcmp(args[0], "exit") == 0) {
+        // in a substitution's child, leave the shell's jobs and the host's
+        // stdio buffers and atexit handlers alone
+        if (getpid() != ctx->shell_pid) {
+            fflush(stdout);
+            _exit(0);
+        }
+        shell_cleanup(ctx);
+        exit(0);
+    }
+    // cd
+    else if (strcmp(args[0], "cd") == 0) {
+        if (argc > 2 && strcmp(args[1], "-j") == 0) {
+            return jump_dir(&args[2], argc - 2);
+        } else if (argc == 2) {  // check arg number
+            if (chdir(args[1]) < 0) {
+                perror("chdir");
+                return -1;
+            }
+            char cwd[PATH_MAX];
+            if (getcwd(cwd, PATH_MAX) != NULL) {
+                frecency_visit(cwd);
+            }
+        } else {
+            fprintf(stderr, "cd: syntax error\n");
+            return -1;
+        }
+    }
+    // z
+    else if (strcmp(args[0], "z") == 0) {
+        if (argc < 2) {
+            fprintf(stderr, "z: syntax error\n");
+            return -1;
+        }
+        return jump_dir(&args[1], argc - 1);
+    }
+    // ln
+    else if (strcmp(args[0], "ln") == 0) {
+        return link_files(args, argc);
+    }
+    // rm
+    else if (strcmp(args[0], "rm") == 0) {
+        return remove_files(args, argc);
+    }
+    // fg
+    else if (strcmp(args[0], "fg") == 0) {
+        if (argc == 2) {              // check arg number
+            if (*(args[1]) == '%') {  // jid should start with %
+                // skip %, pass to atoi
+                int jid_to_resume = atoi((args[1]) + 1);
+                pid_t pid_to_resume;
+                // check that jid refers to valid job
+                if (jid_to_resume < 1 ||
+                    (pid_to_resume =
+                         get_job_pid(ctx->job_list, jid_to_resume)) < 0) {
+                    fprintf(stderr, "fg: job not found\n");
+                    return -1;
+                } else {  // jid is valid
+                    // a queued job is started right away, ignoring the limit
+                    if (pid_to_resume == 0) {
+                        if (start_queued_job(ctx, jid_to_resume) < 0) {
+                            return -1;
+                        }
+                        pid_to_resume =
+                            get_job_pid(ctx->job_list, jid_to_resume);
+                    }
+                    // send SIGCONT to job
+                    else if (killpg(pid_to_resume, SIGCONT) < 0) {
+                        perror("killpg");
+                        return -1;
+                    } else {
+                        // the wait in handle_fg_process doesn't report
+                        // continues, so log it here
+                        evlog_record(EV_CONT, jid_to_resume, pid_to_resume, 0,
+                                     NULL);
+                    }
+                    // set job to RUNNING
+                    if (update_job_pid(ctx->job_list, pid_to_resume,
+                                       RUNNING) < 0) {
+                        fprintf(stderr, "Error updating job state");
+                        return -1;
+                    }
+                    // give job terminal control, call waitpid and handle
+                    // status
+                    if (handle_fg_process(ctx, pid_to_resume, NULL) < 0) {
+                        fprintf(stderr, "Error handling fg process");
+                        return -1;
+                    }
+                }
+            } else {  // first argument did not start with %
+                fprintf(stderr, "fg: job input does not begin with %%\n");
+                return -1;
+            }
+        } else {  // wrong number of args
+            fprintf(stderr, "fg: syntax error\n");
+            return -1;
+        }
+    }
+    // bg
+    else if (strcmp(args[0], "bg") == 0) {
+        if (argc == 2) {              // check arg number
+            if (*(args[1]) == '%') {  // jid should start with %
+                // skip %, pass to atoi
+                int jid_to_resume = atoi((args[1]) + 1);
+                pid_t pid_to_resume;
+                // check that jid refers to valid job
+                if (jid_to_resume < 1 ||
+                    (pid_to_resume =
+                         get_job_pid(ctx->job_list, jid_to_resume)) < 0) {
+                    fprintf(stderr, "bg: job not found\n");
+                    return -1;
+                }
+                // a queued job is started right away, ignoring the limit
+                else if (pid_to_resume == 0) {
+                    if (start_queued_job(ctx, jid_to_resume) < 0) {
+                        return -1;
+                    }
+                    pid_to_resume = get_job_pid(ctx->job_list, jid_to_resume);
+                } else {
+                    // send SIGCONT to job
+                    if (killpg(pid_to_resume, SIGCONT) < 0) {
+                        perror("killpg");
+                        return -1;
+                    }
+                    // set job to RUNNING
+                    if (update_job_pid(ctx->job_list, pid_to_resume,
+                                       RUNNING) < 0) {
+                        fprintf(stderr, "Error updating job state");
+                        return -1;
+                    }
+                }
+            } else {  // first argument did not start with %
+                fprintf(stderr, "bg: job input does not begin with %%\n");
+                return -1;
+            }
+        } else {  // wrong number of args
+            fprintf(stderr, "bg: syntax error\n");
+            return -1;
+        }
+    }
+    // jobs (print all jobs)
+    else if (strcmp(args[0], "jobs") == 0) {
+        if (argc == 1) {
+            jobs(ctx->job_list);
+        } else if (argc == 2 && strcmp(args[1], "-l") == 0) {
+            jobs_long(ctx->job_list);
+        } else {  // wrong number of args
+            fprintf(stderr, "jobs: syntax error\n");
+            return -1;
+        }
+    }
+    // echo (print arguments separated by spaces)
+    else if (strcmp(args[0], "echo") == 0) {
+        for (int i = 1; i < argc; i++) {
+            if (printf(i < argc - 1 ? "%s " : "%s", args[i]) < 0) {
+                fprintf(stderr, "echo: error printing\n");
+                return -1;
+            }
+        }
+        if (printf("\n") < 0) {
+            fprintf(stderr, "echo: error printing\n");
+            return -1;
+        }
+    }
+    // pwd (print current working directory)
+    else if (strcmp(args[0], "pwd") == 0) {
+        if (argc == 1) {
+            char cwd[PATH_MAX];
+            if (getcwd(cwd, PATH_MAX) == NULL) {
+                perror("getcwd");
+                return -1;
+            }
+            if (printf("%s\n", cwd) < 0) {
+                fprintf(stderr, "pwd: error printing\n");
+                return -1;
+            }
+        } else {  // wrong number of args
+            fprintf(stderr, "pwd: syntax error\n");
+            return -1;
+        }
+    }
+    // stats (print latency histograms of the shell's stages and commands)
+    else if (strcmp(args[0], "stats") == 0) {
+        if (argc == 1 || (argc == 2 && strcmp(args[1], "--json") == 0)) {
+            if (stats_print(argc == 2) < 0) {
+                fprintf(stderr, "stats: error printing\n");
+                return -1;
+            }
+        } else if (argc == 2 && strcmp(args[1], "--reset") == 0) {
+            stats_reset();
+        } else {  // wrong args
+            fprintf(stderr, "stats: syntax error\n");
+            return -1;
+        }
+    }
+    // batch (queue a background job, optionally with a nice value)
+    else if (strcmp(args[0], "batch") == 0) {
+        int priority = 0;
+        int first = 1;  // index of the command
+        if (argc >= 3 && strcmp(args[1], "-p") == 0) {
+            char *end;
+            long value = strtol(args[2], &end, 10);
+            if (*end != '\0' || value < -20 || value > 19) {
+                fprintf(stderr, "batch: priority must be from -20 to 19\n");
+                return -1;
+            }
+            priority = (int)value;
+            first = 3;
+        }
+        if (first >= argc) {
+            fprintf(stderr, "batch: syntax error\n");
+            return -1;
+        }
+        if (is_builtin(args[first])) {
+            fprintf(stderr, "batch: %s is a shell builtin\n", args[first]);
+            return -1;
+        }
+        // the substitution pipes are closed once this line is done
+        if (ctx->subst_fd_num > 0) {
+            fprintf(stderr, "batch: process substitution cannot be queued\n");
+            return -1;
+        }
+        return submit_job(ctx, &args[first], argc - first, priority, NULL,
+                          NULL);
+    }
+    // sched (print or set the max number of running background jobs)
+    else if (strcmp(args[0], "sched") == 0) {
+        if (argc == 1) {
+            if (printf("max %d running %d queued %d\n", sched_get_max(),
+                       count_jobs(ctx->job_list, RUNNING),
+                       count_jobs(ctx->job_list, QUEUED)) < 0) {
+                fprintf(stderr, "sched: error printing\n");
+                return -1;
+            }
+        } else if (argc == 3 && strcmp(args[1], "-j") == 0) {
+            char *end;
+            long value = strtol(args[2], &end, 10);
+            if (*end != '\0' || value < 0 || value > 1 << 20) {
+                fprintf(stderr, "sched: bad job limit\n");
+                return -1;
+            }
+            sched_set_max((int)value);
+            // raising the limit may let queued jobs start
+            dispatch_jobs(ctx);
+        } else {  // wrong args
+            fprintf(stderr, "sched: syntax error\n");
+            return -1;
+        }
+    }
+    // timeout (run a command that is signaled if it runs past a deadline)
+    else if (strcmp(args[0], "timeout") == 0) {
+        job_timeout_t timeout = {0, SIGTERM, 0};
+        int first = 1;  // index of the duration, then of the command
+        while (first + 1 < argc && args[first][0] == '-') {
+            if (strcmp(args[first], "-s") == 0 &&
+                timers_parse_signal(args[first + 1], &timeout.signal) == 0) {
+                first += 2;
+            } else if (strcmp(args[first], "-k") == 0 &&
+                       timers_parse_duration(args[first + 1],
+                                             &timeout.kill_after_ms) == 0 &&
+                       timeout.kill_after_ms > 0) {
+                first += 2;
+            } else {
+                break;
+            }
+        }
+        // a zero deadline would mean none to a job, so durations must be
+        // positive
+        if (first + 1 >= argc ||
+            timers_parse_duration(args[first], &timeout.duration_ms) < 0 ||
+            timeout.duration_ms == 0) {
+            fprintf(stderr,
+                    "timeout: usage: timeout [-s SIG] [-k KILL_AFTER] "
+                    "DURATION cmd\n");
+            return -1;
+        }
+        first++;
+        if (is_builtin(args[first])) {
+            fprintf(stderr, "timeout: %s is a shell builtin\n", args[first]);
+            return -1;
+        }
+
+        // run the rest of the line as the command, with the deadline
+        set_command(ctx, &args[first], argc - first);
+        if (ctx->bg_process_flag && ctx->subst_fd_num == 0) {
+            return submit_job(ctx, ctx->tokens, ctx->token_num, 0, &timeout,
+                              NULL);
+        }
+        run_command(ctx, &timeout);
+    }
+    // supervise (run a background job that is restarted when it crashes)
+    else if (strcmp(args[0], "supervise") == 0) {
+        job_supervise_t supervise = {-1, SUPERVISE_BACKOFF_MS, 0, 0, 0, 0};
+        int first = 1;  // index of the command
+        while (first + 1 < argc && strncmp(args[first], "--", 2) == 0) {
+            char *end;
+            long value = strtol(args[first + 1], &end, 10);
+            if (*end != '\0' || value < 0 || value > 1 << 30) {
+                break;
+            }
+            if (strcmp(args[first], "--max-restarts") == 0) {
+                supervise.max_restarts = (int)value;
+            } else if (strcmp(args[first], "--backoff") == 0) {
+                supervise.backoff_ms = value;
+            } else {
+                break;
+            }
+            first += 2;
+        }
+        if (first >= argc || strncmp(args[first], "--", 2) == 0) {
+            fprintf(stderr, "supervise: usage: supervise [--max-restarts N] "
+                            "[--backoff MS] cmd &\n");
+            return -1;
+        }
+        if (is_builtin(args[first])) {
+            fprintf(stderr, "supervise: %s is a shell builtin\n",
+                    args[first]);
+            return -1;
+        }
+        if (!ctx->bg_process_flag) {
+            fprintf(stderr, "supervise: only background jobs are supervised "
+                            "(supervise cmd &)\n");
+            return -1;
+        }
+        if (ctx->subst_fd_num > 0) {
+            fprintf(stderr,
+                    "supervise: process substitution cannot be restarted\n");
+            return -1;
+        }
+        return submit_job(ctx, &args[first], argc - first, 0, NULL,
+                          &supervise);
+    }
+    // perfstat (run a command with performance counters, or count every job)
+    else if (strcmp(args[0], "perfstat") == 0) {
+        if (argc == 1) {
+            if (printf("perfstat %s\n", perfstat_enabled() ? "on" : "off") <
+                0) {
+                fprintf(stderr, "perfstat: error printing\n");
+                return -1;
+            }
+        } else if (argc == 2 && (strcmp(args[1], "on") == 0 ||
+                                 strcmp(args[1], "off") == 0)) {
+            perfstat_set_enabled(strcmp(args[1], "on") == 0);
+        } else if (is_builtin(args[1])) {
+            fprintf(stderr, "perfstat: %s is a shell builtin\n", args[1]);
+            return -1;
+        } else {
+            // a counted background job starts now rather than queueing
+            set_command(ctx, &args[1], argc - 1);
+            ctx->perf_count = 1;
+            run_command(ctx, NULL);
+        }
+    }
+    // memo (run a command, or serve its cached output)
+    else if (strcmp(args[0], "memo") == 0) {
+        return memo_command(ctx, args, argc);
+    }
+    // wait (block until background jobs, or the first of them, finish)
+    else if (strcmp(args[0], "wait") == 0) {
+        int any = argc > 1 && strcmp(args[1], "-n") == 0;
+        int jids[TOKENS_SIZE];
+        int jid_num = 0;
+        for (int i = 1 + any; i < argc; i++) {
+            int jid = args[i][0] == '%' ? atoi(&args[i][1]) : 0;
+            int state = jid < 1 ? -1 : get_job_state(ctx->job_list, jid);
+            if (state < 0) {
+                fprintf(stderr, "wait: %s: job not found\n", args[i]);
+                return -1;
+            }
+            if (state == STOPPED) {
+                fprintf(stderr, "wait: %s: job is stopped\n", args[i]);
+            }
+            jids[jid_num++] = jid;
+        }
+        return wait_jobs(ctx, jids, jid_num, any);
+    }
+    // affinity (print or set the CPU placement policy for background jobs)
+    else if (strcmp(args[0], "affinity") == 0) {
+        affinity_policy_t policy;
+        if (argc == 1) {
+            if (affinity_print(ctx->job_list) < 0) {
+                fprintf(stderr, "affinity: error printing\n");
+                return -1;
+            }
+        } else if (argc == 2 && affinity_parse_policy(args[1], &policy) == 0) {
+            if (affinity_set_policy(policy) < 0) {
+                return -1;
+            }
+        } else {  // wrong args
+            fprintf(stderr,
+                    "affinity: usage: affinity "
+                    "[none|compact|spread|numa-spread]\n");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * restart_job()
+ * - Description: Decides what happens to job jid, which has just ended with
+ * status, if it is supervised. A job that exited with a nonzero status or was
+ * killed by a signal other than SIGHUP, SIGINT, SIGTERM or SIGPIPE is queued
+ * again under the same JID, unless it has been restarted max_restarts times.
+ * The first restart after the job ran for SUPERVISE_STABLE_MS is immediate;
+ * each further crash in a row doubles the wait, starting from the job's
+ * backoff, up to SUPERVISE_MAX_BACKOFF_MS. CRASH_LOOP_CRASHES crashes in a
+ * row are reported as a crash loop. A job that is not restarted has its saved
+ * command dropped.
+ *
+ * - Arguments: ctx: the shell context, jid: the job's id, status: its wait
+ * status
+ *
+ * - Returns: 1 if the job will be restarted and must stay in the job list, 0
+ * if not
+ */
+int restart_job(psh_ctx_t *ctx, int jid, int status) {
+    job_supervise_t supervise;
+    if (get_job_supervise(ctx->job_list, jid, &supervise) < 0) {
+        return 0;
+    }
+    int signum = WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+    int crashed = WIFEXITED(status)
+                      ? WEXITSTATUS(status) != 0
+                      : signum != SIGHUP && signum != SIGINT &&
+                            signum != SIGTERM && signum != SIGPIPE;
+    if (!crashed || supervise.restarts == supervise.max_restarts) {
+        if (crashed && printf("[%d] not restarted: restarted %d times\n",
+                              jid, supervise.restarts) < 0) {
+            fprintf(stderr, "Error printing");
+        }
+        sched_free(sched_take(jid));
+        return 0;
+    }
+
+    // crashing soon after starting extends the run of crashes
+    uint64_t uptime_ms = (stats_now() - supervise.started_ns) / 1000000;
+    supervise.crashes =
+        uptime_ms < SUPERVISE_STABLE_MS ? supervise.crashes + 1 : 1;
+    long delay_ms = 0;
+    if (supervise.crashes > 1) {
+        delay_ms = supervise.backoff_ms;
+        for (int i = 2; i < supervise.crashes &&
+                        delay_ms < SUPERVISE_MAX_BACKOFF_MS;
+             i++) {
+            delay_ms *= 2;
+        }
+        if (delay_ms > SUPERVISE_MAX_BACKOFF_MS) {
+            delay_ms = SUPERVISE_MAX_BACKOFF_MS;
+        }
+    }
+    supervise.restarts++;
+    supervise.waiting = delay_ms > 0 && timers_add_restart(jid, delay_ms) == 0;
+    if (set_job_supervise(ctx->job_list, jid, &supervise) < 0 ||
+        set_job_pid(ctx->job_list, jid, 0) < 0 ||
+        update_job_jid(ctx->job_list, jid, QUEUED) < 0) {
+        fprintf(stderr, "Error updating job state");
+        return 0;
+    }
+    set_job_cpus(ctx->job_list, jid, NULL);  // placed again when it starts
+
+    if (printf("[%d] restarting in %ldms (restart %d%s)\n", jid,
+               supervise.waiting ? delay_ms : 0, supervise.restarts,
+               supervise.crashes >= CRASH_LOOP_CRASHES ? ", crash loop" : "") <
+        0) {
+        fprintf(stderr, "Error printing");
+    }
+    return 1;
+}
+
+/*
+ * update_job_status()
+ * - Description: Records a wait status just collected for job pid, printing
+ * and updating the job list as needed: finished jobs are removed, stopped and
+ * resumed ones updated. Hidden jobs (process substitutions) are removed
+ * without a message once they are gone.
+ *
+ * - Arguments: ctx: the shell context, jid: the job's id, pid: its process id,
+ * status, usage: as returned by wait4
+ *
+ * - Returns: 1 if a state change was printed, 0 if not
+ */
+int update_job_status(psh_ctx_t *ctx, int jid, pid_t pid, int status,
+                      struct rusage *usage) {
+    evlog_record_wait(jid, pid, status, usage);
+    int hidden = get_job_hidden(ctx->job_list, pid) == 1;
+    // a finished job's deadline is dropped; say if it is why the job ended
+    char reason[128] = "";
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+        timers_finish(pid, reason, sizeof(reason));
+        perfstat_report(jid, pid);
+    }
+    // Hidden jobs (process substitutions) are removed without a message once
+    // they are gone
+    if (hidden) {
+        if ((WIFEXITED(status) || WIFSIGNALED(status)) &&
+            remove_job_pid(ctx->job_list, pid) < 0) {
+            fprintf(stderr, "Error removing job");
+        }
+    }
+    // Exited normally
+    else if (WIFEXITED(status)) {
+        int exit_status = WEXITSTATUS(status);
+        if (printf("[%d] (%d) terminated with exit status %d%s\n", jid, pid,
+                   exit_status, reason) < 0) {
+            fprintf(stderr, "Error printing");
+        }
+        /* Remove job from job list, unless it is restarted */
+        if (!restart_job(ctx, jid, status) &&
+            remove_job_pid(ctx->job_list, pid) < 0) {
+            fprintf(stderr, "Error removing job");
+        }
+    }
+    // Terminated by signal
+    else if (WIFSIGNALED(status)) {
+        int signum = WTERMSIG(status);
+        // print message
+        if (printf("[%d] (%d) terminated by signal %d%s\n", jid, pid, signum,
+                   reason) < 0) {
+            fprintf(stderr, "Error printing");
+        }
+        /* Remove job from job list, unless it is restarted */
+        if (!restart_job(ctx, jid, status) &&
+            remove_job_pid(ctx->job_list, pid) < 0) {
+            fprintf(stderr, "Error removing job");
+        }
+    }
+    // Suspended via signal
+    else if (WIFSTOPPED(status)) {
+        if (update_job_pid(ctx->job_list, pid, STOPPED) < 0) {
+            fprintf(stderr, "Error updating job state");
+        }
+        int signum = WSTOPSIG(status);
+        if (printf("[%d] (%d) suspended by signal %d\n", jid, pid, signum) <
+            0) {
+            fprintf(stderr, "Error printing");
+        }
+    }
+    // Resumed via signal
+    else if (WIFCONTINUED(status)) {
+        if (update_job_pid(ctx->job_list, pid, RUNNING) < 0) {
+            fprintf(stderr, "Error updating job state");
+        }
+        if (printf("[%d] (%d) resumed\n", jid, pid) < 0) {
+            fprintf(stderr, "Error printing");
+        }
+    }
+    return !hidden;
+}
+
+/*
+ * reap_jobs()
+ * - Description: waitpid on all jobs in job list, printing and updating job
+ * list as needed (see update_job_status()).
+ *
+ * - Arguments: ctx: the shell context
+ *
+ * - Returns: the number of state changes printed
+ */
+int reap_jobs(psh_ctx_t *ctx) {
+    int changes = 0;
+    pid_t current_pid;
+    while ((current_pid = get_next_pid(ctx->job_list)) > 0) {
+        if (current_pid == ctx->fg_pid) {
+            continue;  // wait_fg() collects it
+        }
+        // get jid
+        int current_jid;
+        if ((current_jid = get_job_jid(ctx->job_list, current_pid)) < 0) {
+            fprintf(stderr, "Error getting job jid");
+        }
+
+        int status;
+        struct rusage usage;
+        /* If current child process changed state, update job list and print
+         * explanation */
+        if (wait4(current_pid, &status, WNOHANG | WUNTRACED | WCONTINUED,
+                  &usage) > 0) {
+            changes += update_job_status(ctx, current_jid, current_pid, status,
+                                         &usage);
+        }
+    }
+    return changes;
+}
+
+/*
+ * wait_jobs()
+ * - Description: Blocks until background jobs finish: the jobs in jids, or
+ * every job if jid_num is 0. With any set, returns once the first of them
+ * finishes instead. Each running job is watched through a pidfd, so waiting
+ * costs nothing while idle, and since the job is not reaped until its pidfd
+ * is readable, a reused pid can't be mistaken for it. Finished jobs are
+ * reported and removed as reap_jobs() does. Queued jobs are started as
+ * running jobs finish and then waited for; stopped jobs are not waited for.
+ * Other jobs are reaped and deadlines fired meanwhile, and CTRL-C ends the
+ * wait.
+ *
+ * - Arguments: ctx: the shell context, jids: the job ids to wait for,
+ * jid_num: the number of jids, any: 1 to wait for only the first job to
+ * finish (wait -n)
+ *
+ * - Returns: 0 on success, -1 on error or if interrupted
+ */
+int wait_jobs(psh_ctx_t *ctx, const int *jids, int jid_num, int any) {
+    // the shell ignores SIGINT; while waiting, it is blocked and read from a
+    // signalfd instead, so that CTRL-C ends the wait
+    sigset_t int_mask;
+    sigemptyset(&int_mask);
+    sigaddset(&int_mask, SIGINT);
+    int int_fd = -1;
+    if (sigprocmask(SIG_BLOCK, &int_mask, NULL) < 0 ||
+        signal(SIGINT, SIG_DFL) == SIG_ERR ||
+        (int_fd = signalfd(-1, &int_mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+        perror("signalfd");
+    }
+
+    // running jobs being waited for, parallel arrays
+    int watch_cap = 16;
+    int watch_num = 0;
+    int *watch_jids = (int *)malloc(sizeof(int) * (size_t)watch_cap);
+    pid_t *watch_pids = (pid_t *)malloc(sizeof(pid_t) * (size_t)watch_cap);
+    // their pidfds, then sigchld_fd, the SIGINT signalfd and the timerfd
+    struct pollfd *fds = (struct pollfd *)malloc(sizeof(struct pollfd) *
+                                                 (size_t)(watch_cap + 3));
+
+    int result = 0;
+    int finished = 0;
+    for (;;) {
+        // drop the jobs that are gone, whoever reaped them
+        for (int i = 0; i < watch_num; i++) {
+            if (get_job_pid(ctx->job_list, watch_jids[i]) != watch_pids[i]) {
+                close(fds[i].fd);
+                watch_num--;
+                watch_jids[i] = watch_jids[watch_num];
+                watch_pids[i] = watch_pids[watch_num];
+                fds[i] = fds[watch_num];
+                finished++;
+                i--;
+            }
+        }
+        if (any && finished > 0) {
+            break;
+        }
+
+        // watch the selected jobs that are running; count all those that are
+        // still to finish (queued jobs aren't listed by get_next_pid())
+        int pending = jid_num == 0 ? count_jobs(ctx->job_list, QUEUED) : 0;
+        int next = 0;
+        for (;;) {
+            int jid;
+            if (jid_num > 0) {
+                if (next == jid_num) {
+                    break;
                 }
-                int signum = WSTOPSIG(status);
-                if (printf("[%d] (%d) suspended by signal %d\n", current_jid,
-                           current_pid, signum) < 0) {
-                    fprintf(stderr, "Error printing");
+                jid = jids[next++];
+            } else {
+                pid_t next_pid = get_next_pid(ctx->job_list);
+                if (next_pid <= 0) {
+                    break;
+                }
+                if (get_job_hidden(ctx->job_list, next_pid) == 1) {
+                    continue;
                 }
+                jid = get_job_jid(ctx->job_list, next_pid);
+            }
+
+            int state = get_job_state(ctx->job_list, jid);
+            if (state == QUEUED && jid_num > 0) {
+                pending++;
+            }
+            if (state != RUNNING) {
+                continue;
+            }
+            pending++;
+            pid_t pid = get_job_pid(ctx->job_list, jid);
+            int watched = 0;
+            for (int j = 0; j < watch_num && !watched; j++) {
+                watched = watch_jids[j] == jid;
+            }
+            if (watched) {
+                continue;
+            }
+
+            int pid_fd = (int)syscall(SYS_pidfd_open, pid, 0);
+            if (pid_fd < 0) {
+                perror("pidfd_open");
+                result = -1;
+                continue;
+            }
+            if (watch_num == watch_cap) {
+                watch_cap *= 2;
+                watch_jids = (int *)realloc(watch_jids,
+                                            sizeof(int) * (size_t)watch_cap);
+                watch_pids = (pid_t *)realloc(
+                    watch_pids, sizeof(pid_t) * (size_t)watch_cap);
+                fds = (struct pollfd *)realloc(
+                    fds, sizeof(struct pollfd) * (size_t)(watch_cap + 3));
+            }
+            watch_jids[watch_num] = jid;
+            watch_pids[watch_num] = pid;
+            fds[watch_num].fd = pid_fd;
+            fds[watch_num].events = POLLIN;
+            watch_num++;
+        }
+        if (pending == 0 || result < 0) {
+            break;
+        }
+
+        fds[watch_num].fd = sigchld_fd;
+        fds[watch_num + 1].fd = int_fd;
+        fds[watch_num + 2].fd = timers_pending() ? timers_fd() : -1;
+        for (int i = watch_num; i < watch_num + 3; i++) {
+            fds[i].events = POLLIN;
+        }
+        if (poll(fds, (nfds_t)watch_num + 3, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
             }
-            // Resumed via signal
-            else if (WIFCONTINUED(status)) {
-                if (update_job_pid(job_list, current_pid, RUNNING) < 0) {
-                    fprintf(stderr, "Error updating job state");
-                }
-                if (printf("[%d] (%d) resumed\n", current_jid, current_pid) <
-                    0) {
-                    fprintf(stderr, "Error printing");
-                }
+            perror("poll");
+            result = -1;
+            break;
+        }
+
+        if (fds[watch_num + 1].revents & POLLIN) {
+            result = -1;  // interrupted
+            break;
+        }
+        if (fds[watch_num + 2].revents & POLLIN) {
+            timers_expire();
+        }
+        // a readable pidfd means the job has exited
+        for (int i = 0; i < watch_num; i++) {
+            int status;
+            struct rusage usage;
+            if ((fds[i].revents & POLLIN) &&
+                wait4(watch_pids[i], &status, WNOHANG, &usage) > 0) {
+                update_job_status(ctx, watch_jids[i], watch_pids[i], status,
+                                  &usage);
+            }
+        }
+        if (fds[watch_num].revents & POLLIN) {
+            drain_sigchld();
+            reap_jobs(ctx);
+        }
+        dispatch_jobs(ctx);
+    }
+
+    for (int i = 0; i < watch_num; i++) {
+        close(fds[i].fd);
+    }
+    free(watch_jids);
+    free(watch_pids);
+    free(fds);
+    if (int_fd >= 0) {
+        close(int_fd);
+    }
+    // ignoring SIGINT again discards one that is pending
+    signal(SIGINT, SIG_IGN);
+    sigprocmask(SIG_UNBLOCK, &int_mask, NULL);
+    return result;
+}
+
+/*
+ * reap_exited()
+ * - Description: Reaps every child that has exited, recording each job's end
+ * in the event log and removing it from the job list without printing it.
+ *
+ * - Arguments: ctx: the shell context, block: 1 to wait for at least one
+ * child
+ *
+ * - Returns: the number of jobs reaped, or -1 if there are no children left
+ */
+int reap_exited(psh_ctx_t *ctx, int block) {
+    int reaped = 0;
+    int status;
+    struct rusage usage;
+    pid_t pid;
+    while ((pid = wait4(-1, &status, block && reaped == 0 ? 0 : WNOHANG,
+                        &usage)) > 0) {
+        int jid = get_job_jid(ctx->job_list, pid);
+        if (jid < 0) {
+            continue;  // not in the job list (process substitutions are,
+                       // as hidden jobs with jid 0)
+        }
+        evlog_record_wait(jid, pid, status, &usage);
+        if (remove_job_pid(ctx->job_list, pid) == 0) {
+            reaped++;
+        }
+    }
+    return pid < 0 && errno == ECHILD && reaped == 0 ? -1 : reaped;
+}
+
+/*
+ * shutdown_jobs()
+ * - Description: Ends every job when the shell exits. All the jobs' process
+ * groups are sent ctx->shutdown_signal at once (and SIGCONT, so stopped jobs
+ * see it), then the shell reaps them as SIGCHLD reports them until they are
+ * gone or ctx->shutdown_grace_ms has passed. The jobs left are sent SIGKILL
+ * and reaped. Queued jobs are dropped. Prints how many jobs there were and
+ * how long they took to end. Does nothing in a forked child of the shell
+ * (e.g. exit in a command substitution): the jobs are the shell's.
+ *
+ * - Arguments: ctx: the shell context
+ */
+void shutdown_jobs(psh_ctx_t *ctx) {
+    if (getpid() != ctx->shell_pid) {
+        return;
+    }
+    uint64_t start = stats_now();
+    int job_num = 0;
+    pid_t pid;
+    while ((pid = get_next_pid(ctx->job_list)) > 0) {
+        if (killpg(pid, ctx->shutdown_signal) < 0 && errno != ESRCH) {
+            perror("killpg");
+        }
+        if (killpg(pid, SIGCONT) < 0 && errno != ESRCH) {
+            perror("killpg");
+        }
+        job_num++;
+    }
+    if (job_num == 0) {
+        return;
+    }
+
+    int left = job_num;
+    uint64_t deadline = start + (uint64_t)ctx->shutdown_grace_ms * 1000000;
+    for (;;) {
+        // drain first, so a SIGCHLD after the reaping below wakes the poll
+        if (sigchld_fd >= 0) {
+            drain_sigchld();
+        }
+        int reaped = reap_exited(ctx, 0);
+        if (reaped < 0) {
+            left = 0;
+            break;
+        }
+        left -= reaped;
+        uint64_t now = stats_now();
+        if (left <= 0 || now >= deadline) {
+            break;
+        }
+
+        // without sigchld_fd, look again every 10ms
+        int wait_ms = (int)((deadline - now + 999999) / 1000000);
+        struct pollfd fds[1] = {{sigchld_fd, POLLIN, 0}};
+        if (poll(fds, sigchld_fd >= 0 ? 1 : 0,
+                 sigchld_fd >= 0 || wait_ms < 10 ? wait_ms : 10) < 0 &&
+            errno != EINTR) {
+            perror("poll");
+            break;
+        }
+    }
+
+    int killed = 0;
+    if (left > 0) {
+        while ((pid = get_next_pid(ctx->job_list)) > 0) {
+            if (killpg(pid, SIGKILL) < 0 && errno != ESRCH) {
+                perror("killpg");
+            }
+            killed++;
+        }
+        for (int reaped = 0; reaped < killed;) {
+            int got = reap_exited(ctx, 1);
+            if (got < 0) {
+                break;
+            }
+            reaped += got;
+        }
+    }
+
+    if (printf("psh: %d job%s ended in %.1f ms (%d killed)\n", job_num,
+               job_num == 1 ? "" : "s", (double)(stats_now() - start) / 1e6,
+               killed) < 0) {
+        fprintf(stderr, "Error printing");
+    }
+}
+
+/*
+ * shell_cleanup()
+ * - Description: Ends the shell's jobs (see shutdown_jobs()), frees the
+ * context and releases the process-wide state: saved commands, placement,
+ * deadlines, the frecency database and the event log. Called once the shell
+ * is exiting, from exit, at EOF, or when the server stops.
+ *
+ * - Arguments: ctx: the shell context, not to be used afterwards
+ */
+void shell_cleanup(psh_ctx_t *ctx) {
+    shutdown_jobs(ctx);
+    cleanup_job_list(ctx->job_list);
+    free(ctx);
+    sched_cleanup();
+    affinity_cleanup();
+    timers_cleanup();
+    frecency_close();
+    evlog_close();
+}
+
+/*
+ * print_prompt()
+ * - Description: Prints the prompt if the shell was built with PROMPT.
+ *
+ * - Returns: 0 on success, -1 on error
+ */
+int print_prompt(void) {
+#ifdef PROMPT
+    uint64_t prompt_start = stats_now();
+    char cwd[PATH_MAX];
+    getcwd(cwd, PATH_MAX);
+    if (printf("psh: %s$ ", cwd) < 0) {
+        fprintf(stderr, "Error while printing prompt.");
+        return -1;
+    }
+    if (fflush(stdout) < 0) {
+        fprintf(stderr, "Error while flushing prompt.");
+        return -1;
+    }
+    stats_record_stage(STAGE_PROMPT, stats_now() - prompt_start);
+#endif
+    return 0;
+}
+
+/*
+ * wait_for_input()
+ * - Description: Returns once there is input to read. While jobs are queued
+ * or have deadlines, reaps jobs and starts queued ones each time a child
+ * changes state instead of waiting for the next line, printing the prompt
+ * again if anything was reported. Signals jobs whose deadlines pass.
+ *
+ * - Arguments: ctx: the shell context
+ */
+void wait_for_input(psh_ctx_t *ctx) {
+    while (sigchld_fd >= 0 &&
+           (count_jobs(ctx->job_list, QUEUED) > 0 || timers_pending() ||
+            count_supervised(ctx->job_list) > 0)) {
+        struct pollfd fds[3] = {{STDIN_FILENO, POLLIN, 0},
+                                {sigchld_fd, POLLIN, 0},
+                                {timers_fd(), POLLIN, 0}};
+        if (poll(fds, 3, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
             }
+            perror("poll");
+            return;
+        }
+        if (fds[0].revents != 0) {
+            return;
+        }
+        // signal jobs whose deadlines passed; they are reaped once they exit
+        // (and restarts that are due are started below)
+        int changes = 0;
+        if (fds[2].revents & POLLIN) {
+            timers_expire();
+        }
+        if (fds[1].revents & POLLIN) {
+            drain_sigchld();
+            uint64_t reap_start = stats_now();
+            changes += reap_jobs(ctx);
+            stats_record_stage(STAGE_REAP, stats_now() - reap_start);
+        }
+        changes += dispatch_jobs(ctx);
+        if (changes > 0 && print_prompt() < 0) {
+            return;
+        }
+    }
+}
+
+/*
+ * reset_command_line()
+ * - Description: Clears the context's per-line fields (redirections,
+ * background flag, buffer, tokens and argv) before a new command line is read
+ * and parsed.
+ *
+ * - Arguments: ctx: the shell context
+ */
+void reset_command_line(psh_ctx_t *ctx) {
+    close_subst_fds(ctx);
+    ctx->input_redirect_code = 0;
+    ctx->output_redirect_code = 0;
+    ctx->input_file = NULL;
+    ctx->output_file = NULL;
+    ctx->bg_process_flag = 0;
+    ctx->token_num = 0;
+
+    memset(ctx->buffer, 0, BUFFER_SIZE);
+    memset(ctx->tokens, 0, TOKENS_SIZE * sizeof(char *));
+    memset(ctx->argv, 0, ARGV_SIZE * sizeof(char *));
+}
+
+/*
+ * serve_spawn()
+ * - Description: Starts a job for the command server (see serve.h). Parses
+ * line like an input line and forks it as a background job, placed by the
+ * affinity policy, with stdin on /dev/null and stdout on out_fd unless out_fd
+ * is -1. Builtins are refused, since they would run in the server itself.
+ * The job is added to the job list as RUNNING; the server reaps it.
+ *
+ * - Arguments: arg: the shell context, line: the command line, out_fd: the
+ * job's stdout or -1, pid: set to the job's process id, err: set to a message
+ * on failure, err_size: the size of err
+ *
+ * - Returns: the job id on success, -1 on error
+ */
+int serve_spawn(void *arg, char *line, int out_fd, pid_t *pid, char *err,
+                size_t err_size) {
+    psh_ctx_t *ctx = (psh_ctx_t *)arg;
+    reset_command_line(ctx);
+    if (strlen(line) + 1 >= BUFFER_SIZE) {
+        snprintf(err, err_size, "command line too long");
+        return -1;
+    }
+    strcpy(ctx->buffer, line);
+    strcat(ctx->buffer, "\n");
+
+    if (parse(ctx) < 0 || ctx->tokens[0] == NULL) {
+        close_subst_fds(ctx);
+        snprintf(err, err_size, "bad command line");
+        return -1;
+    }
+    if (is_builtin(ctx->tokens[0])) {
+        close_subst_fds(ctx);
+        snprintf(err, err_size, "%s is a builtin", ctx->tokens[0]);
+        return -1;
+    }
+
+    int jid = ctx->next_avail_jid;
+    place_job(ctx, jid);
+    uint64_t fork_start = stats_now();
+    pid_t child_pid = fork();
+    if (child_pid < 0) {
+        perror("fork");
+        ctx->job_cpus_set = 0;
+        close_subst_fds(ctx);
+        snprintf(err, err_size, "fork failed");
+        return -1;
+    }
+
+    if (child_pid == 0) {
+        // the server's stdin is not the job's to read
+        int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (null_fd < 0 || dup2(null_fd, STDIN_FILENO) < 0) {
+            perror("/dev/null");
+            _exit(1);
+        }
+        if (out_fd >= 0 && dup2(out_fd, STDOUT_FILENO) < 0) {
+            perror("dup2");
+            _exit(1);
+        }
+        exec_child(ctx, child_pid);
+    }
+
+    stats_record_stage(STAGE_FORK, stats_now() - fork_start);
+    evlog_record(EV_SPAWN, jid, child_pid, 0, NULL);
+    close_subst_fds(ctx);
+
+    if (add_job(ctx->job_list, jid, child_pid, RUNNING, ctx->tokens[0]) < 0) {
+        fprintf(stderr, "Error adding background job");
+    }
+    record_job_cpus(ctx, jid);
+    ctx->next_avail_jid++;
+    *pid = child_pid;
+    return jid;
+}
+
+/*
+ * psh_ctx_new()
+ * - Description: Creates a shell context with an empty job list (see psh.h).
+ * Builtins are off; main() turns them on for the interactive shell.
+ *
+ * - Returns: the context, or NULL on error
+ */
+psh_ctx_t *psh_ctx_new(void) {
+    psh_ctx_t *ctx = (psh_ctx_t *)calloc(1, sizeof(psh_ctx_t));
+    if (ctx == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    ctx->job_list = init_job_list();
+    ctx->next_avail_jid = 1;
+    ctx->shell_pid = getpid();
+    ctx->perf_sync.fds[0] = -1;
+    ctx->perf_sync.fds[1] = -1;
+    ctx->shutdown_signal = SIGTERM;
+    ctx->shutdown_grace_ms = SHUTDOWN_GRACE_MS;
+    return ctx;
+}
+
+/*
+ * psh_ctx_free()
+ * - Description: Kills the context's remaining jobs with SIGKILL, reaps them,
+ * and frees the context.
+ *
+ * - Arguments: ctx: the shell context
+ */
+void psh_ctx_free(psh_ctx_t *ctx) {
+    close_subst_fds(ctx);
+    pid_t pid;
+    while ((pid = get_next_pid(ctx->job_list)) > 0) {
+        if (killpg(pid, SIGKILL) < 0 && errno != ESRCH) {
+            perror("killpg");
+        }
+        if (waitpid(pid, NULL, 0) < 0) {
+            perror("waitpid");
+        }
+        if (remove_job_pid(ctx->job_list, pid) < 0) {
+            fprintf(stderr, "Error removing job");
+        }
+    }
+    cleanup_job_list(ctx->job_list);
+    free(ctx);
+}
+
+/*
+ * psh_parse()
+ * - Description: Parses line as the context's command line (see parse()).
+ * Builtins are refused, since they would act on the calling process.
+ *
+ * - Arguments: ctx: the shell context, line: the command line
+ *
+ * - Returns: 0 if there is a command to run, 1 if the line is blank, -1 on
+ * error
+ */
+int psh_parse(psh_ctx_t *ctx, const char *line) {
+    reset_command_line(ctx);
+    if (strlen(line) >= BUFFER_SIZE) {
+        fprintf(stderr, "syntax error: input line too long\n");
+        return -1;
+    }
+    strcpy(ctx->buffer, line);
+
+    if (parse(ctx) < 0) {
+        close_subst_fds(ctx);
+        return -1;
+    }
+    if (ctx->token_num == 0) {
+        return 1;
+    }
+    if (is_builtin(ctx->tokens[0])) {
+        fprintf(stderr, "psh: %s is a shell builtin\n", ctx->tokens[0]);
+        close_subst_fds(ctx);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * psh_execute()
+ * - Description: Forks and execs the command parsed by psh_parse() and adds
+ * it to the context's job list. Does not wait for it.
+ *
+ * - Arguments: ctx: the shell context
+ *
+ * - Returns: the command's pid on success, -1 on error
+ */
+pid_t psh_execute(psh_ctx_t *ctx) {
+    if (ctx->token_num == 0) {
+        fprintf(stderr, "psh: no command to execute\n");
+        return -1;
+    }
+
+    pid_t child_pid = fork();
+    if (child_pid < 0) {
+        perror("fork");
+        close_subst_fds(ctx);
+        return -1;
+    }
+    exec_child(ctx, child_pid);
+
+    // set the process group here too, so that it exists for killpg even if
+    // the child hasn't run yet (fails harmlessly once the child has exec'd)
+    setpgid(child_pid, child_pid);
+
+    // the child has its own copies of the substitution pipes
+    close_subst_fds(ctx);
+    if (add_job(ctx->job_list, ctx->next_avail_jid, child_pid, RUNNING,
+                ctx->tokens[0]) < 0) {
+        fprintf(stderr, "Error adding job");
+    }
+    ctx->next_avail_jid++;
+    ctx->token_num = 0;  // each parsed command runs once
+    return child_pid;
+}
+
+/*
+ * psh_background()
+ * - Description: Returns 1 if the command parsed by psh_parse() ended with &,
+ * 0 if not.
+ *
+ * - Arguments: ctx: the shell context
+ */
+int psh_background(psh_ctx_t *ctx) { return ctx->bg_process_flag; }
+
+/*
+ * psh_wait()
+ * - Description: Waits for pid, a command started by psh_execute(), to exit,
+ * and removes it from the job list. Reaps finished process substitutions
+ * without blocking. Only the context's own children are waited for, so other
+ * threads' commands are left alone.
+ *
+ * - Arguments: ctx: the shell context, pid: the command's pid, status: set to
+ * its wait status
+ *
+ * - Returns: 0 on success, -1 on error
+ */
+int psh_wait(psh_ctx_t *ctx, pid_t pid, int *status) {
+    if (get_job_jid(ctx->job_list, pid) < 0) {
+        fprintf(stderr, "psh: %d is not a job\n", pid);
+        return -1;
+    }
+    while (waitpid(pid, status, 0) < 0) {
+        if (errno != EINTR) {
+            perror("waitpid");
+            return -1;
+        }
+    }
+    if (remove_job_pid(ctx->job_list, pid) < 0) {
+        fprintf(stderr, "Error removing job");
+    }
+
+    pid_t hidden_pid;
+    while ((hidden_pid = get_next_pid(ctx->job_list)) > 0) {
+        if (get_job_hidden(ctx->job_list, hidden_pid) == 1 &&
+            waitpid(hidden_pid, NULL, WNOHANG) > 0 &&
+            remove_job_pid(ctx->job_list, hidden_pid) < 0) {
+            fprintf(stderr, "Error removing job");
         }
     }
+    return 0;
+}
+
+/*
+ * psh_run()
+ * - Description: Parses, starts and waits for line. A trailing & is ignored.
+ *
+ * - Arguments: ctx: the shell context, line: the command line, status: set to
+ * the command's wait status
+ *
+ * - Returns: 0 on success, 1 if the line is blank, -1 on error
+ */
+int psh_run(psh_ctx_t *ctx, const char *line, int *status) {
+    int parsed = psh_parse(ctx, line);
+    if (parsed != 0) {
+        return parsed;
+    }
+    pid_t pid = psh_execute(ctx);
+    if (pid < 0) {
+        return -1;
+    }
+    return psh_wait(ctx, pid, status);
 }
 
-int main() {
-    job_list = init_job_list();  // create job list
+// libpsh is built from these sources with LIBPSH defined, leaving out main
+#ifndef LIBPSH
+int main(int argc, char *argv[]) {
+    psh_ctx_t *ctx = psh_ctx_new();  // create job list
+    if (ctx == NULL) {
+        exit(1);
+    }
+    ctx->builtins = 1;
+
+    // record job lifecycle events if PSH_EVLOG names a log file
+    char *evlog_path = getenv("PSH_EVLOG");
+    if (evlog_path != NULL && *evlog_path != '\0') {
+        char *evlog_records = getenv("PSH_EVLOG_RECORDS");
+        uint64_t capacity = evlog_records != NULL
+                                ? strtoull(evlog_records, NULL, 10)
+                                : EVLOG_DEFAULT_CAPACITY;
+        if (evlog_open(evlog_path, capacity) < 0) {
+            fprintf(stderr, "psh: not recording job events to %s\n",
+                    evlog_path);
+        }
+    }
+
+    // rank visited directories for cd -j in PSH_FRECENCY, if set
+    char *frecency_path = getenv("PSH_FRECENCY");
+    if (frecency_path != NULL && *frecency_path != '\0') {
+        char *frecency_entries = getenv("PSH_FRECENCY_ENTRIES");
+        uint32_t capacity =
+            frecency_entries != NULL
+                ? (uint32_t)strtoul(frecency_entries, NULL, 10)
+                : FRECENCY_DEFAULT_CAPACITY;
+        if (frecency_open(frecency_path, capacity) < 0) {
+            fprintf(stderr, "psh: not ranking directories in %s\n",
+                    frecency_path);
+        }
+    }
+    // on exit, send jobs PSH_SHUTDOWN_SIGNAL (default SIGTERM) and give them
+    // PSH_SHUTDOWN_TIMEOUT (default 3s, 0 to kill them at once) to exit
+    char *shutdown_signal = getenv("PSH_SHUTDOWN_SIGNAL");
+    if (shutdown_signal != NULL && *shutdown_signal != '\0' &&
+        timers_parse_signal(shutdown_signal, &ctx->shutdown_signal) < 0) {
+        fprintf(stderr, "psh: bad PSH_SHUTDOWN_SIGNAL %s\n", shutdown_signal);
+    }
+    char *shutdown_timeout = getenv("PSH_SHUTDOWN_TIMEOUT");
+    if (shutdown_timeout != NULL && *shutdown_timeout != '\0' &&
+        timers_parse_duration(shutdown_timeout, &ctx->shutdown_grace_ms) <
+            0) {
+        fprintf(stderr, "psh: bad PSH_SHUTDOWN_TIMEOUT %s\n",
+                shutdown_timeout);
+    }
     ssize_t chars_read;          // set by read()
-    shell_pgid = getpgrp();
+    ctx->shell_pgid = getpgrp();
+
+    // place background jobs by the policy PSH_AFFINITY names, if any
+    char *affinity_name = getenv("PSH_AFFINITY");
+    if (affinity_name != NULL && *affinity_name != '\0') {
+        affinity_policy_t policy;
+        if (affinity_parse_policy(affinity_name, &policy) < 0 ||
+            affinity_set_policy(policy) < 0) {
+            fprintf(stderr, "psh: not placing jobs by policy %s\n",
+                    affinity_name);
+        }
+    }
+
+    // block SIGCHLD and read it from a signalfd so that queued jobs can be
+    // started as soon as a running job finishes
+    sigset_t chld_mask;
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &chld_mask, NULL) < 0 ||
+        (sigchld_fd = signalfd(-1, &chld_mask, SFD_NONBLOCK | SFD_CLOEXEC)) <
+            0) {
+        perror("signalfd");
+        sigchld_fd = -1;
+    }
+
+    // psh --serve PATH runs commands sent over a socket instead of stdin
+    if (argc == 3 && strcmp(argv[1], "--serve") == 0) {
+        int failed =
+            sigchld_fd < 0 ||
+            serve(argv[2], ctx->job_list, sigchld_fd, serve_spawn, ctx) < 0;
+        shell_cleanup(ctx);
+        return failed;
+    } else if (argc > 1) {
+        fprintf(stderr, "usage: %s [--serve SOCKET_PATH]\n", argv[0]);
+        cleanup_job_list(ctx->job_list);
+        free(ctx);
+        return 2;
+    }
 
     do {
         /* Ignore signals in parent process */
         if (signal(SIGTTOU, SIG_IGN) == SIG_ERR) {
             perror("signal");
-            cleanup_job_list(job_list);
+            cleanup_job_list(ctx->job_list);
             exit(1);
         }
         if (signal(SIGINT, SIG_IGN) == SIG_ERR) {
             perror("signal");
-            cleanup_job_list(job_list);
+            cleanup_job_list(ctx->job_list);
             exit(1);
         }
         if (signal(SIGTSTP, SIG_IGN) == SIG_ERR) {
             perror("signal");
-            cleanup_job_list(job_list);
+            cleanup_job_list(ctx->job_list);
             exit(1);
         }
         if (signal(SIGQUIT, SIG_IGN) == SIG_ERR) {
             perror("signal");
-            cleanup_job_list(job_list);
+            cleanup_job_list(ctx->job_list);
             exit(1);
         }
 
         /* Reaping the Jobs List */
-        reap_jobs();
-
-#ifdef PROMPT /* Print prompt */
-        char cwd[PATH_MAX];
-        getcwd(cwd, PATH_MAX);
-        if (printf("psh: %s$ ", cwd) < 0) {
-            fprintf(stderr, "Error while printing prompt.");
-            cleanup_job_list(job_list);
-            exit(1);
-        }
-        if (fflush(stdout) < 0) {
-            fprintf(stderr, "Error while flushing prompt.");
-            cleanup_job_list(job_list);
+        uint64_t reap_start = stats_now();
+        reap_jobs(ctx);
+        stats_record_stage(STAGE_REAP, stats_now() - reap_start);
+        dispatch_jobs(ctx);
+
+        /* Print prompt */
+        if (print_prompt() < 0) {
+            cleanup_job_list(ctx->job_list);
             exit(1);
         }
-#endif
 
         // Reset these for each iteration (new line of input)
-        input_redirect_code = 0;
-        output_redirect_code = 0;
-        input_file = NULL;
-        output_file = NULL;
-        bg_process_flag = 0;
-        token_num = 0;
-
-        // clear buffer, tokens, argv
-        memset(buffer, 0, BUFFER_SIZE);
-        memset(tokens, 0, TOKENS_SIZE * sizeof(char *));
-        memset(argv, 0, ARGV_SIZE * sizeof(char *));
+        reset_command_line(ctx);
 
         // Read input from user into buffer
-        chars_read = read(STDIN_FILENO, buffer, BUFFER_SIZE);
+        wait_for_input(ctx);
+        chars_read = read(STDIN_FILENO, ctx->buffer, BUFFER_SIZE);
         if (chars_read == -1) {
             perror("read");
-            cleanup_job_list(job_list);
+            cleanup_job_list(ctx->job_list);
             exit(1);
         }
 
         // Null terminate the buffer
-        buffer[chars_read] = '\0';
+        ctx->buffer[chars_read] = '\0';
 
         // Parse buffered input
-        if (parse(buffer, tokens, argv) < 0) {
+        uint64_t parse_start = stats_now();
+        if (parse(ctx) < 0) {
             // parse exited abnormally due to user error
             continue;
         }
+        stats_record_stage(STAGE_PARSE,
+                           stats_now() - parse_start - ctx->subst_ns);
 
         // Continue if no non-whitespace input
-        if (strlen(buffer) == strspn(buffer, " \t\n")) {
+        if (strlen(ctx->buffer) == strspn(ctx->buffer, " \t\n")) {
             continue;
         }
 
         /* Built-in Commands */
-        // exit
-        else if (strcmp(tokens[0], "exit") == 0) {
-            cleanup_job_list(job_list);
-            exit(0);
-        }
-        // cd
-        else if (strcmp(tokens[0], "cd") == 0) {
-            if (token_num == 2) {  // check arg number
-                if (chdir(tokens[1]) < 0) {
-                    perror("chdir");
-                    continue;
-                }
-            } else {
-                fprintf(stderr, "cd: syntax error\n");
-                continue;
-            }
-        }
-        // ln
-        else if (strcmp(tokens[0], "ln") == 0) {
-            if (token_num == 3) {  // check arg number
-                if (link(tokens[1], tokens[2]) < 0) {
-                    perror("link");
-                    continue;
-                }
-            } else {
-                fprintf(stderr, "ln: syntax error\n");
-                continue;
-            }
-        }
-        // rm
-        else if (strcmp(tokens[0], "rm") == 0) {
-            if (token_num == 2) {  // check arg number
-                if (unlink(tokens[1]) < 0) {
-                    perror("unlink");
-                    continue;
-                }
-            } else {
-                fprintf(stderr, "rm: syntax error\n");
-                continue;
-            }
+        else if (is_builtin(ctx->tokens[0])) {
+            char *name = ctx->tokens[0];  // timeout replaces the tokens
+            uint64_t builtin_start = stats_now();
+            exec_builtin(ctx, ctx->tokens, ctx->token_num);
+            uint64_t builtin_ns = stats_now() - builtin_start;
+            stats_record_stage(STAGE_BUILTIN, builtin_ns);
+            stats_record_command(name, builtin_ns);
         }
-        // fg
-        else if (strcmp(tokens[0], "fg") == 0) {
-            if (token_num == 2) {           // check arg number
-                if (*(tokens[1]) == '%') {  // jid should start with %
-                    int jid_to_resume =
-                        atoi((tokens[1]) + 1);  // skip %, pass to atoi
-                    pid_t pid_to_resume;
-                    // check that jid refers to valid job
-                    if ((pid_to_resume = get_job_pid(job_list, jid_to_resume)) <
-                        0) {
-                        fprintf(stderr, "fg: job not found\n");
-                        continue;
-                    } else {  // jid is valid
-                        // send SIGCONT to job
-                        if (killpg(pid_to_resume, SIGCONT) < 0) {
-                            perror("killpg");
-                            continue;
-                        }
-                        // set job to RUNNING
-                        if (update_job_pid(job_list, pid_to_resume, RUNNING) <
-                            0) {
-                            fprintf(stderr, "Error updating job state");
-                            continue;
-                        }
-                        // give job terminal control, call waitpid and handle
-                        // status
-                        if (handle_fg_process(pid_to_resume, NULL) < 0) {
-                            fprintf(stderr, "Error handling fg process");
-                            continue;
-                        }
-                    }
-                } else {  // first argument did not start with %
-                    fprintf(stderr, "fg: job input does not begin with %%\n");
-                    continue;
-                }
-            } else {  // wrong number of args
-                fprintf(stderr, "fg: syntax error\n");
-                continue;
-            }
-        }
-        // bg
-        else if (strcmp(tokens[0], "bg") == 0) {
-            if (token_num == 2) {           // check arg number
-                if (*(tokens[1]) == '%') {  // jid should start with %
-                    int jid_to_resume =
-                        atoi((tokens[1]) + 1);  // skip %, pass to atoi
-                    pid_t pid_to_resume;
-                    // check that jid refers to valid job
-                    if ((pid_to_resume = get_job_pid(job_list, jid_to_resume)) <
-                        0) {
-                        fprintf(stderr, "bg: job not found\n");
-                        continue;
-                    }
 
-                    else {
-                        // send SIGCONT to job
-                        if (killpg(pid_to_resume, SIGCONT) < 0) {
-                            perror("killpg");
-                            continue;
-                        }
-                        // set job to RUNNING
-                        if (update_job_pid(job_list, pid_to_resume, RUNNING) <
-                            0) {
-                            fprintf(stderr, "Error updating job state");
-                            continue;
-                        }
-                    }
-                } else {  // first argument did not start with %
-                    fprintf(stderr, "bg: job input does not begin with %%\n");
-                    continue;
-                }
-            } else {  // wrong number of args
-                fprintf(stderr, "bg: syntax error\n");
-                continue;
-            }
-        }
-        // jobs (print all jobs)
-        else if (strcmp(tokens[0], "jobs") == 0) {
-            if (token_num == 1) {
-                jobs(job_list);
-            } else {  // wrong number of args
-                fprintf(stderr, "jobs: syntax error\n");
-                continue;
-            }
+        /* Background jobs wait in the queue until the scheduler starts them
+         * (jobs with process substitutions start now; their pipes can't wait)
+         */
+        else if (ctx->bg_process_flag && ctx->subst_fd_num == 0) {
+            submit_job(ctx, ctx->tokens, ctx->token_num, 0, NULL, NULL);
         }
 
         /* Handling Child Processes */
         else {
-            int child_pid = fork();
-
-            /* exec_child contains all logic for if (child_pid == 0) */
-            exec_child(child_pid);
-
-            /* For bg processes: add to job list, print job id and process id */
-            if (bg_process_flag) {
-                if (add_job(job_list, next_avail_jid, child_pid, RUNNING,
-                            tokens[0]) < 0) {
-                    fprintf(stderr, "Error adding background job");
-                }
-                if (printf("[%d] (%d)\n", next_avail_jid, child_pid) < 0) {
-                    fprintf(
-                        stderr,
-                        "Error printing job id and pid of background process");
-                }
-                next_avail_jid++;
-            }
-            /* For fg processes: waitpid until process finishes */
-            else {
-                if (handle_fg_process(child_pid, tokens[0]) < 0) {
-                    fprintf(stderr, "Error handling foreground process");
-                    cleanup_job_list(job_list);
-                    exit(1);
-                }
-            }
+            run_command(ctx, NULL);
         }
 
     } while (chars_read != 0);  // while not EOF (CTRL-D)
 
     /* Terminate all bg processes upon receiving EOF */
-    pid_t pid_to_term;
-    while ((pid_to_term = get_next_pid(job_list)) > 0) {
-        if (killpg(pid_to_term, SIGINT) < 0) {
-            perror("killpg");
-            continue;
-        }
-    }
-
-    cleanup_job_list(job_list);
+    shell_cleanup(ctx);
 
     return 0;
-}
\ No newline at end of file
+}
+#endif  // LIBPSH
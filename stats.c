@@ -0,0 +1,296 @@
+#include "./stats.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+/*
+ * Latency histograms are log-linear (HDR-style): values below 2^SUB_BITS
+ * nanoseconds get a bucket each, and every power of two above that is split
+ * into 2^SUB_BITS equal sub-buckets, so any recorded value is off by at most
+ * 1/2^SUB_BITS (12.5%). Recording a sample is a count-leading-zeros, a shift
+ * and three adds; nothing is allocated.
+ */
+#define SUB_BITS 3
+#define SUB_COUNT (1 << SUB_BITS)
+#define BUCKET_NUM ((64 - SUB_BITS + 1) * SUB_COUNT)
+
+#define COMMANDS_SIZE 64  // power of two, open-addressed by name hash
+#define COMMAND_NAME_SIZE 32
+
+struct histogram {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[BUCKET_NUM];
+};
+typedef struct histogram histogram_t;
+
+struct command_stats {
+    char name[COMMAND_NAME_SIZE];  // empty if slot is unused
+    histogram_t hist;
+};
+typedef struct command_stats command_stats_t;
+
+static const char *stage_names[STAGE_NUM] = {
+    "parse", "builtin", "fork", "exec", "wait", "reap", "prompt"};
+
+static histogram_t stages[STAGE_NUM];
+static command_stats_t commands[COMMANDS_SIZE];
+static histogram_t other_commands;
+
+// nanoseconds the last timed child took to reach execv() (0 if it hasn't),
+// in a page shared with children; NULL until first used or if mmap failed
+static uint64_t *exec_ns;
+static int exec_mapped;
+
+/* returns the bucket holding value */
+static inline unsigned bucket_index(uint64_t value) {
+    if (value < SUB_COUNT) {
+        return (unsigned)value;
+    }
+    unsigned msb = 63 - (unsigned)__builtin_clzll(value);
+    unsigned sub = (unsigned)(value >> (msb - SUB_BITS)) & (SUB_COUNT - 1);
+    return (msb - SUB_BITS + 1) * SUB_COUNT + sub;
+}
+
+/* returns the largest value that falls in bucket index */
+static uint64_t bucket_upper_bound(unsigned index) {
+    if (index < SUB_COUNT) {
+        return index;
+    }
+    unsigned msb = index / SUB_COUNT + SUB_BITS - 1;
+    uint64_t sub = index % SUB_COUNT;
+    uint64_t lower = (SUB_COUNT + sub) << (msb - SUB_BITS);
+    return lower + ((uint64_t)1 << (msb - SUB_BITS)) - 1;
+}
+
+static inline void histogram_record(histogram_t *hist, uint64_t value) {
+    hist->buckets[bucket_index(value)]++;
+    hist->count++;
+    if (value > hist->max) {
+        hist->max = value;
+    }
+}
+
+/* returns the value at quantile q (0 < q <= 1), never more than the max */
+static uint64_t histogram_quantile(const histogram_t *hist, double q) {
+    if (hist->count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(q * (double)hist->count + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < BUCKET_NUM; i++) {
+        seen += hist->buckets[i];
+        if (seen >= rank) {
+            uint64_t bound = bucket_upper_bound(i);
+            return bound < hist->max ? bound : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+/* returns the current CLOCK_MONOTONIC time in nanoseconds */
+uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* records a latency sample of ns nanoseconds for stage */
+void stats_record_stage(stats_stage_t stage, uint64_t ns) {
+    histogram_record(&stages[stage], ns);
+}
+
+/*
+ * records a latency sample of ns nanoseconds for the command with the given
+ * name (argv[0]); names that don't fit in the table are counted as "(other)"
+ */
+void stats_record_command(const char *name, uint64_t ns) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (const char *c = name; *c != '\0'; c++) {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+
+    for (unsigned probe = 0; probe < COMMANDS_SIZE; probe++) {
+        command_stats_t *slot =
+            &commands[(hash + probe) & (COMMANDS_SIZE - 1)];
+        if (slot->name[0] == '\0') {
+            strncpy(slot->name, name, COMMAND_NAME_SIZE - 1);
+            histogram_record(&slot->hist, ns);
+            return;
+        }
+        if (strncmp(slot->name, name, COMMAND_NAME_SIZE - 1) == 0) {
+            histogram_record(&slot->hist, ns);
+            return;
+        }
+    }
+    histogram_record(&other_commands, ns);
+}
+
+/* clears the shared page before a timed child is forked */
+void stats_exec_start(void) {
+    if (!exec_mapped) {
+        exec_mapped = 1;
+        void *page = mmap(NULL, sizeof(uint64_t), PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        exec_ns = page == MAP_FAILED ? NULL : (uint64_t *)page;
+    }
+    if (exec_ns != NULL) {
+        __atomic_store_n(exec_ns, 0, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * in the child: publishes how long it took since child_start, stats_now()
+ * as it returned from fork()
+ */
+void stats_exec_mark(uint64_t child_start) {
+    if (exec_ns != NULL) {
+        uint64_t ns = stats_now() - child_start;
+        __atomic_store_n(exec_ns, ns > 0 ? ns : 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* records the timed child's setup, if it got as far as execv() */
+void stats_exec_record(void) {
+    uint64_t ns =
+        exec_ns != NULL ? __atomic_exchange_n(exec_ns, 0, __ATOMIC_RELAXED) : 0;
+    if (ns > 0) {
+        stats_record_stage(STAGE_EXEC, ns);
+    }
+}
+
+/* clears all recorded samples */
+void stats_reset(void) {
+    memset(stages, 0, sizeof(stages));
+    memset(commands, 0, sizeof(commands));
+    memset(&other_commands, 0, sizeof(other_commands));
+}
+
+/* formats ns with a human readable unit into buf */
+static void format_duration(char *buf, size_t size, uint64_t ns) {
+    if (ns < 1000) {
+        snprintf(buf, size, "%luns", (unsigned long)ns);
+    } else if (ns < 1000000) {
+        snprintf(buf, size, "%.1fus", (double)ns / 1e3);
+    } else if (ns < 1000000000) {
+        snprintf(buf, size, "%.1fms", (double)ns / 1e6);
+    } else {
+        snprintf(buf, size, "%.2fs", (double)ns / 1e9);
+    }
+}
+
+/* prints one table row, returns 0 on success, -1 on failure */
+static int print_row(const char *name, const histogram_t *hist) {
+    char p50[32], p99[32], max[32];
+    format_duration(p50, sizeof(p50), histogram_quantile(hist, 0.5));
+    format_duration(p99, sizeof(p99), histogram_quantile(hist, 0.99));
+    format_duration(max, sizeof(max), hist->max);
+    if (printf("%-24s %10lu %10s %10s %10s\n", name,
+               (unsigned long)hist->count, p50, p99, max) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/* prints name as a JSON string, returns 0 on success, -1 on failure */
+static int print_json_string(const char *name) {
+    if (putchar('"') == EOF) {
+        return -1;
+    }
+    for (const char *c = name; *c != '\0'; c++) {
+        int ret;
+        if (*c == '"' || *c == '\\') {
+            ret = printf("\\%c", *c);
+        } else if ((unsigned char)*c < 0x20) {
+            ret = printf("\\u%04x", (unsigned char)*c);
+        } else {
+            ret = putchar(*c) == EOF ? -1 : 1;
+        }
+        if (ret < 0) {
+            return -1;
+        }
+    }
+    return putchar('"') == EOF ? -1 : 0;
+}
+
+/* prints one JSON member, returns 0 on success, -1 on failure */
+static int print_json_member(const char *name, const histogram_t *hist,
+                             int first) {
+    if ((!first && printf(",") < 0) || print_json_string(name) < 0) {
+        return -1;
+    }
+    if (printf(":{\"count\":%lu,\"p50_ns\":%lu,\"p99_ns\":%lu,\"max_ns\":%lu}",
+               (unsigned long)hist->count,
+               (unsigned long)histogram_quantile(hist, 0.5),
+               (unsigned long)histogram_quantile(hist, 0.99),
+               (unsigned long)hist->max) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * stats command, prints count, p50, p99 and max per stage and per command
+ * as a table, or as a JSON object if json is nonzero
+ * returns 0 on success, -1 on failure
+ */
+int stats_print(int json) {
+    if (json) {
+        if (printf("{\"stages\":{") < 0) {
+            return -1;
+        }
+        for (int i = 0; i < STAGE_NUM; i++) {
+            if (print_json_member(stage_names[i], &stages[i], i == 0) < 0) {
+                return -1;
+            }
+        }
+        if (printf("},\"commands\":{") < 0) {
+            return -1;
+        }
+        int first = 1;
+        for (int i = 0; i < COMMANDS_SIZE; i++) {
+            if (commands[i].name[0] != '\0') {
+                if (print_json_member(commands[i].name, &commands[i].hist,
+                                      first) < 0) {
+                    return -1;
+                }
+                first = 0;
+            }
+        }
+        if (other_commands.count > 0 &&
+            print_json_member("(other)", &other_commands, first) < 0) {
+            return -1;
+        }
+        return printf("}}\n") < 0 ? -1 : 0;
+    }
+
+    if (printf("%-24s %10s %10s %10s %10s\n", "stage", "count", "p50", "p99",
+               "max") < 0) {
+        return -1;
+    }
+    for (int i = 0; i < STAGE_NUM; i++) {
+        if (print_row(stage_names[i], &stages[i]) < 0) {
+            return -1;
+        }
+    }
+    if (printf("\n%-24s %10s %10s %10s %10s\n", "command", "count", "p50",
+               "p99", "max") < 0) {
+        return -1;
+    }
+    for (int i = 0; i < COMMANDS_SIZE; i++) {
+        if (commands[i].name[0] != '\0' &&
+            print_row(commands[i].name, &commands[i].hist) < 0) {
+            return -1;
+        }
+    }
+    if (other_commands.count > 0 &&
+        print_row("(other)", &other_commands) < 0) {
+        return -1;
+    }
+    return 0;
+}
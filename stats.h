@@ -0,0 +1,51 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdint.h>
+
+/* stages of the shell's own hot path that are timed */
+typedef enum {
+    STAGE_PARSE,    // parse(), not counting the commands substitutions run
+    STAGE_BUILTIN,  // exec_builtin()
+    STAGE_FORK,     // fork() as seen by the parent
+    STAGE_EXEC,     // a foreground child's setup, from fork() up to execv()
+    STAGE_WAIT,     // waitpid() in handle_fg_process (the whole run, so it
+                    // overlaps exec)
+    STAGE_REAP,     // reap_jobs()
+    STAGE_PROMPT,   // prompt render
+    STAGE_NUM
+} stats_stage_t;
+
+/* returns the current CLOCK_MONOTONIC time in nanoseconds */
+uint64_t stats_now(void);
+
+/* records a latency sample of ns nanoseconds for stage */
+void stats_record_stage(stats_stage_t stage, uint64_t ns);
+/*
+ * records a latency sample of ns nanoseconds for the command with the given
+ * name (argv[0]); names that don't fit in the table are counted as "(other)"
+ */
+void stats_record_command(const char *name, uint64_t ns);
+
+/*
+ * times a child's setup for STAGE_EXEC: stats_exec_start() in the parent
+ * before fork(), stats_exec_mark() in the child just before execv(), and
+ * stats_exec_record() in the parent once the child has run; the child writes
+ * its time to a page shared with the parent, so a child that fails before
+ * execv() records nothing
+ */
+void stats_exec_start(void);
+void stats_exec_mark(uint64_t child_start);
+void stats_exec_record(void);
+
+/* clears all recorded samples */
+void stats_reset(void);
+
+/*
+ * stats command, prints count, p50, p99 and max per stage and per command
+ * as a table, or as a JSON object if json is nonzero
+ * returns 0 on success, -1 on failure
+ */
+int stats_print(int json);
+
+#endif  // STATS_H_
@@ -0,0 +1,375 @@
+#define _GNU_SOURCE  // sigabbrev_np
+#include "./timers.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+#include "./evlog.h"
+
+#define DISARMED UINT64_MAX  // expiry time of a fully escalated deadline
+
+struct deadline {
+    uint64_t when;  // CLOCK_MONOTONIC ns the next signal is due, or DISARMED
+    int jid;
+    pid_t pgid;      // 0 for a restart (see timers_add_restart())
+    int signal;      // signal due at when
+    int sent;        // number of signals sent so far (0, 1 or 2)
+    int first_signal;
+    long duration_ms;
+    long kill_after_ms;
+};
+typedef struct deadline deadline_t;
+
+static deadline_t *heap;  // min-heap on when
+static int heap_size;
+static int heap_cap;
+static int timer_fd = -1;
+static uint64_t armed_for;  // expiry the timerfd is set to, 0 if unset
+static int *due;            // JIDs of jobs whose restarts are due
+static int due_num;
+static int due_cap;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void swap(int i, int j) {
+    deadline_t tmp = heap[i];
+    heap[i] = heap[j];
+    heap[j] = tmp;
+}
+
+static void sift_up(int i) {
+    while (i > 0 && heap[(i - 1) / 2].when > heap[i].when) {
+        swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void sift_down(int i) {
+    for (;;) {
+        int least = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < heap_size && heap[left].when < heap[least].when) {
+            least = left;
+        }
+        if (right < heap_size && heap[right].when < heap[least].when) {
+            least = right;
+        }
+        if (least == i) {
+            return;
+        }
+        swap(i, least);
+        i = least;
+    }
+}
+
+/* sets the timerfd to the earliest armed deadline, or disarms it */
+static void rearm(void) {
+    uint64_t when = heap_size > 0 ? heap[0].when : DISARMED;
+    if (timer_fd < 0 || when == armed_for ||
+        (when == DISARMED && armed_for == 0)) {
+        return;
+    }
+
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    if (when != DISARMED) {
+        spec.it_value.tv_sec = (time_t)(when / 1000000000u);
+        spec.it_value.tv_nsec = (long)(when % 1000000000u);
+    }
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+        perror("timerfd_settime");
+        return;
+    }
+    armed_for = when == DISARMED ? 0 : when;
+}
+
+/* removes heap entry i and rearms */
+static void remove_at(int i) {
+    heap_size--;
+    if (i < heap_size) {
+        heap[i] = heap[heap_size];
+        sift_down(i);
+        sift_up(i);
+    }
+    rearm();
+}
+
+/*
+ * returns the free slot at the end of the heap, making the timerfd and
+ * growing the heap if needed; NULL on failure
+ */
+static deadline_t *next_slot(void) {
+    if (timer_fd < 0) {
+        timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (timer_fd < 0) {
+            perror("timerfd_create");
+            return NULL;
+        }
+    }
+    if (heap_size == heap_cap) {
+        heap_cap = heap_cap > 0 ? 2 * heap_cap : 16;
+        heap = (deadline_t *)realloc(heap,
+                                     sizeof(deadline_t) * (size_t)heap_cap);
+    }
+    return &heap[heap_size];
+}
+
+/*
+ * starts job's deadline: timeout->signal is sent to process group pgid
+ * timeout->duration_ms from now, then SIGKILL timeout->kill_after_ms later
+ * jid is only used for the event log
+ * returns 0 on success, -1 on failure
+ */
+int timers_add(int jid, pid_t pgid, const job_timeout_t *timeout) {
+    deadline_t *deadline = next_slot();
+    if (deadline == NULL) {
+        return -1;
+    }
+    deadline->when = now_ns() + (uint64_t)timeout->duration_ms * 1000000u;
+    deadline->jid = jid;
+    deadline->pgid = pgid;
+    deadline->signal = timeout->signal;
+    deadline->sent = 0;
+    deadline->first_signal = timeout->signal;
+    deadline->duration_ms = timeout->duration_ms;
+    deadline->kill_after_ms = timeout->kill_after_ms;
+    heap_size++;
+    sift_up(heap_size - 1);
+    rearm();
+    return 0;
+}
+
+/*
+ * arms a restart of supervised job jid delay_ms from now; once it is due,
+ * timers_expire() leaves it for timers_next_restart()
+ * returns 0 on success, -1 on failure
+ */
+int timers_add_restart(int jid, long delay_ms) {
+    deadline_t *deadline = next_slot();
+    if (deadline == NULL) {
+        return -1;
+    }
+    memset(deadline, 0, sizeof(*deadline));
+    deadline->when = now_ns() + (uint64_t)delay_ms * 1000000u;
+    deadline->jid = jid;
+    heap_size++;
+    sift_up(heap_size - 1);
+    rearm();
+    return 0;
+}
+
+/* forgets job jid's restart, armed or due */
+void timers_cancel_restart(int jid) {
+    for (int i = 0; i < heap_size; i++) {
+        if (heap[i].pgid == 0 && heap[i].jid == jid) {
+            remove_at(i);
+            break;
+        }
+    }
+    for (int i = 0; i < due_num; i++) {
+        if (due[i] == jid) {
+            due[i] = due[--due_num];
+            break;
+        }
+    }
+}
+
+/* returns the JID of a job whose restart is due and forgets it, -1 if none */
+int timers_next_restart(void) {
+    return due_num > 0 ? due[--due_num] : -1;
+}
+
+/* returns 1 if any deadline is still armed, 0 if not */
+int timers_pending(void) { return heap_size > 0 && heap[0].when != DISARMED; }
+
+/* returns the timerfd, readable when a deadline passes; -1 if none yet */
+int timers_fd(void) { return timer_fd; }
+
+/*
+ * signals every process group whose deadline has passed, moves the restarts
+ * that are due to timers_next_restart()'s list and rearms
+ */
+void timers_expire(void) {
+    uint64_t expirations;
+    while (read(timer_fd, &expirations, sizeof(expirations)) > 0) {
+    }
+    // the fd no longer reflects a pending expiry
+    armed_for = 0;
+
+    uint64_t now = now_ns();
+    while (heap_size > 0 && heap[0].when <= now) {
+        deadline_t *deadline = &heap[0];
+        if (deadline->pgid == 0) {
+            if (due_num == due_cap) {
+                due_cap = due_cap > 0 ? 2 * due_cap : 16;
+                due = (int *)realloc(due, sizeof(int) * (size_t)due_cap);
+            }
+            due[due_num++] = deadline->jid;
+            heap[0] = heap[--heap_size];
+            sift_down(0);
+            continue;
+        }
+        if (kill(-deadline->pgid, deadline->signal) < 0 && errno != ESRCH) {
+            perror("kill");
+        }
+        // a stopped job has to run to act on the signal, unless the signal
+        // is meant to stop it
+        if (deadline->signal != SIGKILL && deadline->signal != SIGCONT &&
+            deadline->signal != SIGSTOP && deadline->signal != SIGTSTP &&
+            deadline->signal != SIGTTIN && deadline->signal != SIGTTOU) {
+            kill(-deadline->pgid, SIGCONT);
+        }
+        evlog_record(EV_TIMEOUT, deadline->jid, deadline->pgid,
+                     deadline->signal, NULL);
+
+        deadline->sent++;
+        if (deadline->sent == 1 && deadline->kill_after_ms > 0 &&
+            deadline->signal != SIGKILL) {
+            deadline->signal = SIGKILL;
+            deadline->when = now + (uint64_t)deadline->kill_after_ms * 1000000u;
+        } else {
+            deadline->when = DISARMED;
+        }
+        sift_down(0);
+    }
+    rearm();
+}
+
+/* writes a signal's name (e.g. "TERM") or number into buf */
+static void signal_name(int signal, char *buf, size_t size) {
+    const char *abbrev = sigabbrev_np(signal);
+    if (abbrev != NULL) {
+        snprintf(buf, size, "%s", abbrev);
+    } else {
+        snprintf(buf, size, "%d", signal);
+    }
+}
+
+/*
+ * forgets pgid's deadline, writing why the job ended into reason: empty if
+ * the deadline didn't pass, else " (timed out after ...)"
+ * returns 1 if the deadline passed, 0 if not
+ */
+int timers_finish(pid_t pgid, char *reason, size_t size) {
+    reason[0] = '\0';
+    for (int i = 0; i < heap_size; i++) {
+        if (heap[i].pgid != pgid) {
+            continue;
+        }
+
+        deadline_t deadline = heap[i];
+        remove_at(i);
+
+        if (deadline.sent == 0) {
+            return 0;
+        }
+        char first[16];
+        signal_name(deadline.first_signal, first, sizeof(first));
+        if (deadline.sent == 1) {
+            snprintf(reason, size, " (timed out after %ldms, sent SIG%s)",
+                     deadline.duration_ms, first);
+        } else {
+            snprintf(reason, size,
+                     " (timed out after %ldms, sent SIG%s, then SIGKILL after "
+                     "%ldms)",
+                     deadline.duration_ms, first, deadline.kill_after_ms);
+        }
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * parses a duration: a number with an optional fraction and an optional
+ * suffix s (seconds, the default), m (minutes), h (hours) or d (days)
+ * returns 0 on success, writing milliseconds to ms, -1 on failure
+ */
+int timers_parse_duration(const char *str, long *ms) {
+    char *end;
+    errno = 0;
+    double value = strtod(str, &end);
+    if (end == str || errno != 0 || !(value >= 0.0)) {
+        return -1;
+    }
+
+    double scale = 1000.0;
+    if (*end == 'm') {
+        scale *= 60.0;
+    } else if (*end == 'h') {
+        scale *= 3600.0;
+    } else if (*end == 'd') {
+        scale *= 86400.0;
+    } else if (*end != 's' && *end != '\0') {
+        return -1;
+    }
+    if (*end != '\0' && end[1] != '\0') {
+        return -1;
+    }
+
+    double result = value * scale;
+    if (result > 1e15) {
+        return -1;
+    }
+    *ms = (long)result;
+    // round tiny positive durations up, so they still time out
+    if (*ms == 0 && value > 0.0) {
+        *ms = 1;
+    }
+    return 0;
+}
+
+/*
+ * parses a signal: a number, or a name with or without the SIG prefix
+ * returns 0 on success, writing the signal number to signal, -1 on failure
+ */
+int timers_parse_signal(const char *str, int *signal) {
+    char *end;
+    long number = strtol(str, &end, 10);
+    if (end != str && *end == '\0') {
+        if (number < 1 || number >= NSIG) {
+            return -1;
+        }
+        *signal = (int)number;
+        return 0;
+    }
+
+    if (strncasecmp(str, "SIG", 3) == 0) {
+        str += 3;
+    }
+    for (int i = 1; i < NSIG; i++) {
+        const char *abbrev = sigabbrev_np(i);
+        if (abbrev != NULL && strcasecmp(str, abbrev) == 0) {
+            *signal = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* frees the heap and the due restarts and closes the timerfd */
+void timers_cleanup(void) {
+    free(heap);
+    heap = NULL;
+    heap_size = 0;
+    heap_cap = 0;
+    free(due);
+    due = NULL;
+    due_num = 0;
+    due_cap = 0;
+    if (timer_fd >= 0) {
+        close(timer_fd);
+        timer_fd = -1;
+    }
+    armed_for = 0;
+}
@@ -0,0 +1,78 @@
+#ifndef TIMERS_H_
+#define TIMERS_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "./jobs.h"
+
+/*
+ * Job deadlines. Every armed deadline is kept in one min-heap ordered by
+ * expiry time, and a single timerfd is set to the earliest one, so any number
+ * of jobs with timeouts costs one fd. When the timerfd is readable the shell
+ * calls timers_expire(), which signals the process groups whose deadlines
+ * have passed and arms the SIGKILL escalation if the job has one. A job's
+ * entry stays in the heap (disarmed once fully escalated) until the job is
+ * reaped and timers_finish() reports why it ended.
+ *
+ * The same heap holds the restarts of supervised jobs waiting out their
+ * backoff. timers_expire() moves a restart that is due to a list that the
+ * shell empties with timers_next_restart(), letting the job start again.
+ */
+
+/*
+ * starts job's deadline: timeout->signal is sent to process group pgid
+ * timeout->duration_ms from now, then SIGKILL timeout->kill_after_ms later
+ * jid is only used for the event log
+ * returns 0 on success, -1 on failure
+ */
+int timers_add(int jid, pid_t pgid, const job_timeout_t *timeout);
+
+/*
+ * arms a restart of supervised job jid delay_ms from now; once it is due,
+ * timers_expire() leaves it for timers_next_restart()
+ * returns 0 on success, -1 on failure
+ */
+int timers_add_restart(int jid, long delay_ms);
+
+/* forgets job jid's restart, armed or due */
+void timers_cancel_restart(int jid);
+
+/* returns the JID of a job whose restart is due and forgets it, -1 if none */
+int timers_next_restart(void);
+
+/* returns 1 if any deadline is still armed, 0 if not */
+int timers_pending(void);
+
+/* returns the timerfd, readable when a deadline passes; -1 if none yet */
+int timers_fd(void);
+
+/*
+ * signals every process group whose deadline has passed, moves the restarts
+ * that are due to timers_next_restart()'s list and rearms
+ */
+void timers_expire(void);
+
+/*
+ * forgets pgid's deadline, writing why the job ended into reason: empty if
+ * the deadline didn't pass, else " (timed out after ...)"
+ * returns 1 if the deadline passed, 0 if not
+ */
+int timers_finish(pid_t pgid, char *reason, size_t size);
+
+/*
+ * parses a duration: a number with an optional fraction and an optional
+ * suffix s (seconds, the default), m (minutes), h (hours) or d (days)
+ * returns 0 on success, writing milliseconds to ms, -1 on failure
+ */
+int timers_parse_duration(const char *str, long *ms);
+
+/*
+ * parses a signal: a number, or a name with or without the SIG prefix
+ * returns 0 on success, writing the signal number to signal, -1 on failure
+ */
+int timers_parse_signal(const char *str, int *signal);
+
+/* frees the heap and the due restarts and closes the timerfd */
+void timers_cleanup(void);
+
+#endif  // TIMERS_H_